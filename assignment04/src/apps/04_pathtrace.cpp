@@ -1,54 +1,88 @@
 #include "scene.h"
 #include "intersect.h"
+#include "clustermesh.h"
 #include "montecarlo.h"
 #include "animation.h"
+#include "bakecache.h"
+#include <algorithm>
 #include <iostream>
 #include <thread>
 using namespace std;
 // modify the following line to disable/enable parallel execution of the pathtracer
 bool parallel_pathtrace = true;
 
-float _min = 10000;
-float _max = 0;
 image3f pathtrace(Scene* scene, bool multithread);
 void pathtrace(Scene* scene, image3f* image, RngImage* rngs, int offset_row, int skip_row, bool verbose);
 
 
 
-// lookusp texture value
-vec3f lookup_scaled_texture(vec3f value, image3f* texture, vec2f uv, bool tile = false) {
-    if(not texture) return value;
-
-    int i = int(uv.x * texture->width());
-    float s = uv.x * texture->width() - i;
+// bilinear lookup of a texture level
+vec3f lookup_bilinear(const texture3f* texture, int level, vec2f uv, bool tile) {
+    auto w = texture->width(level), h = texture->height(level);
+    int i = int(uv.x * w);
+    float s = uv.x * w - i;
     int i1 = i + 1;
-    int j = int(uv.y * texture->height());
-    float t = uv.y * texture->height() - j;
+    int j = int(uv.y * h);
+    float t = uv.y * h - j;
     int j1 = j + 1;
 
     if (not tile) {
-        i = clamp(i, 0, texture->width() - 1);
-        i1 = clamp(i1, 0, texture->width() - 1);
-        j = clamp(j, 0, texture->height() - 1);
-        j1 = clamp(j1, 0, texture->height() - 1);
+        i = clamp(i, 0, w - 1);
+        i1 = clamp(i1, 0, w - 1);
+        j = clamp(j, 0, h - 1);
+        j1 = clamp(j1, 0, h - 1);
     }
     else {
-        i = i % texture->width();
+        i = i % w;
         if (i < 0)
-            i += texture->width();
-        i1 = i1 % texture->width();
+            i += w;
+        i1 = i1 % w;
         if (i1 < 0) {
-            i1 += texture->width();
+            i1 += w;
         }
-        j = j % texture->height();
+        j = j % h;
         if (j < 0)
-            j += texture->height();
-        j1 = j1 % texture->height();
+            j += h;
+        j1 = j1 % h;
         if (j1 < 0)
-            j1 += texture->height();
+            j1 += h;
     }
 
-    return value * (texture->at(i, j) * (1 - s) * (1 - t) + texture->at(i, j1) * (1 - s) * t + texture->at(i1, j) * s * (1 - t) + texture->at(i1, j1) * s * t);
+    return texture->at(level, i, j) * (1 - s) * (1 - t) + texture->at(level, i, j1) * (1 - s) * t + texture->at(level, i1, j) * s * (1 - t) + texture->at(level, i1, j1) * s * t;
+}
+
+// lookusp texture value, trilinearly filtered across mip levels at level of detail lod
+vec3f lookup_scaled_texture(vec3f value, const texture3f* texture, vec2f uv, float lod = 0, bool tile = false) {
+    if(not texture) return value;
+
+    // clamp the level of detail to the mip chain
+    lod = clamp(lod, 0.0f, (float)(texture->num_levels()-1));
+    auto l0 = (int)lod;
+    auto l1 = min(l0+1, texture->num_levels()-1);
+    auto s = lod - l0;
+
+    // blend the two closest levels
+    if(s == 0) return value * lookup_bilinear(texture, l0, uv, tile);
+    return value * (lookup_bilinear(texture, l0, uv, tile) * (1 - s) +
+                    lookup_bilinear(texture, l1, uv, tile) * s);
+}
+
+// texture level of detail from the footprint of a ray cone at an intersection
+float texture_lod(const texture3f* texture, const ray3f& ray, const intersection3f& intersection) {
+    if(not texture or intersection.texcoord_density <= 0) return 0;
+    // cone width at the hit and its projection on the surface
+    auto width = ray.cone_width + ray.cone_spread * intersection.ray_t * length(ray.d);
+    auto cosine = abs(dot(intersection.norm, normalize(ray.d)));
+    if(width <= 0 or cosine <= 0) return 0;
+    // texels covered by the footprint, in log2 units
+    return 0.5f * log2(intersection.texcoord_density * texture->width() * texture->height()) + log2(width / cosine);
+}
+
+// continue the ray cone of a ray past its intersection into a secondary ray
+ray3f continue_ray_cone(ray3f secondary, const ray3f& ray, const intersection3f& intersection) {
+    secondary.cone_width = ray.cone_width + ray.cone_spread * intersection.ray_t * length(ray.d);
+    secondary.cone_spread = ray.cone_spread;
+    return secondary;
 }
 /*
 vec3f lookup_scaled_texture(vec3f value, image3f* texture, vec2f uv, bool tile = false) {
@@ -77,15 +111,12 @@ vec3f eval_brdf(vec3f kd, vec3f ks, float n, vec3f v, vec3f l, vec3f norm, bool
 }
 
 // evaluate the environment map
-vec3f eval_env(vec3f ke, image3f* ke_txt, vec3f dir) {
+vec3f eval_env(vec3f ke, TextureHandle* ke_txt, vec3f dir) {
     if (ke_txt == nullptr) return ke;
     auto u = atan2(dir.x, dir.z) / (2 * pif);
     auto v = 1 - acos(dir.y) / pif;
-    return lookup_scaled_texture(ke, ke_txt, vec2f(u, v), true);
+    return lookup_scaled_texture(ke, texture_resolve(ke_txt).get(), vec2f(u, v), 0, true);
 }
-image3f level_0 = read_png("level_0.png", true);
-image3f level_1 = read_png("level_1.png", true);
-image3f level_2 = read_png("level_2.png", true);
 // compute the color corresponing to a ray by pathtrace
 vec3f pathtrace_ray(Scene* scene, ray3f ray, Rng* rng, int depth) {
     // get scene intersection
@@ -101,39 +132,17 @@ vec3f pathtrace_ray(Scene* scene, ray3f ray, Rng* rng, int depth) {
     auto norm = intersection.norm;
     auto v = -ray.d;
 
-    vec3f kd;
-    if (scene->mipmapping) {
-        float distance = dist(intersection.pos, ray.e);
-        if (distance > _max) _max = distance;
-        if (distance < _min) _min = distance;
-        //cout << distance << endl;
-        float scale;
-        if (distance < 1.8) {
-            kd += lookup_scaled_texture(intersection.mat->kd, &level_0, intersection.texcoord);
-        }
-        else if (distance < 2.6) {
-            scale = (2.6 - distance) / 0.8;
-            kd += scale * lookup_scaled_texture(intersection.mat->kd, &level_0, intersection.texcoord) +
-                    (1 - scale) * lookup_scaled_texture(intersection.mat->kd, &level_1, intersection.texcoord);
-        }
-        else if (distance < 3.4) {
-            kd += lookup_scaled_texture(intersection.mat->kd, &level_1, intersection.texcoord);
-        }
-        else if (distance < 4.2) {
-            scale = (4.2 - distance) / 0.8;
-            kd += scale * lookup_scaled_texture(intersection.mat->kd, &level_1, intersection.texcoord) +
-                    (1 - scale) * lookup_scaled_texture(intersection.mat->kd, &level_2, intersection.texcoord);
-        }
-        else if (distance >= 4.2) {
-            kd += lookup_scaled_texture(intersection.mat->kd, &level_2, intersection.texcoord);
-        }
-    }
-    else {
-        kd = lookup_scaled_texture(intersection.mat->kd, intersection.mat->kd_txt, intersection.texcoord);
-    }
+    // lookup a material texture, picking levels from the ray cone footprint if mipmapping
+    auto lookup = [&](vec3f value, TextureHandle* txt){
+        auto texture = texture_resolve(txt);
+        auto lod = (scene->mipmapping) ? texture_lod(texture.get(), ray, intersection) : 0.0f;
+        return lookup_scaled_texture(value, texture.get(), intersection.texcoord, lod);
+    };
+
     // compute material values by looking up textures
-    auto ke = lookup_scaled_texture(intersection.mat->ke, intersection.mat->ke_txt, intersection.texcoord);
-    auto ks = lookup_scaled_texture(intersection.mat->ks, intersection.mat->ks_txt, intersection.texcoord);
+    auto kd = lookup(intersection.mat->kd, intersection.mat->kd_txt);
+    auto ke = lookup(intersection.mat->ke, intersection.mat->ke_txt);
+    auto ks = lookup(intersection.mat->ks, intersection.mat->ks_txt);
     auto n = intersection.mat->n;
     auto mf = intersection.mat->microfacet;
 
@@ -158,7 +167,7 @@ vec3f pathtrace_ray(Scene* scene, ray3f ray, Rng* rng, int depth) {
         // if shadows are enabled
         if(scene->path_shadows) {
             // perform a shadow check and accumulate
-            if(not intersect_shadow(scene,ray3f::make_segment(pos,light->frame.o))) c += shade;
+            if(not intersect_shadow(scene,ray3f::make_segment(pos,light->frame.o,ray.time))) c += shade;
         } else {
             // else just accumulate
             c += shade;
@@ -169,6 +178,9 @@ vec3f pathtrace_ray(Scene* scene, ray3f ray, Rng* rng, int depth) {
         // skip if no emission from surface
         if (surface->mat->ke == zero3f)
             continue;
+        // grab the surface frame at the ray time if it is motion blurred
+        auto frame = (scene->animation->motion_blur and surface->animation) ?
+            animate_compute_frame(surface->animation, ray.time) : surface->frame;
         // todo: pick a point on the surface, grabbing normal, area, and texcoord
         vec3f lightPosition;
         vec3f normal = zero3f;
@@ -181,9 +193,9 @@ vec3f pathtrace_ray(Scene* scene, ray3f ray, Rng* rng, int depth) {
             newPoint.x = (r.x - 0.5) * 2 * surface->radius;
             newPoint.y = (r.y - 0.5) * 2 * surface->radius;
             // compute light position, normal, area
-            lightPosition = transform_point_from_local(surface->frame, newPoint);
+            lightPosition = transform_point_from_local(frame, newPoint);
             area = 4 * surface->radius * surface->radius;
-            normal = transform_normal_from_local(surface->frame, vec3f(0, 0, 1));
+            normal = transform_normal_from_local(frame, vec3f(0, 0, 1));
             // set tex coords as random value got before
             intersection.texcoord.x = r.x;
             intersection.texcoord.y = r.y;
@@ -193,15 +205,15 @@ vec3f pathtrace_ray(Scene* scene, ray3f ray, Rng* rng, int depth) {
             newPoint.x = r.x;
             newPoint.y = r.y;
             // compute light position, normal, area
-            lightPosition = transform_point_from_local(surface->frame, surface->radius * sample_direction_spherical_uniform(r));
+            lightPosition = transform_point_from_local(frame, surface->radius * sample_direction_spherical_uniform(r));
             area = 4 * pif * surface->radius * surface->radius;
-            normal = transform_normal_from_local(surface->frame, sample_direction_spherical_uniform(r)); //CORRECT?
+            normal = transform_normal_from_local(frame, sample_direction_spherical_uniform(r)); //CORRECT?
             // set tex coords as random value got before
             intersection.texcoord.x = r.x;
             intersection.texcoord.y = r.y;
         }
         // get light emission from material and texture
-        auto emission = lookup_scaled_texture(surface->mat->ke, surface->mat->ke_txt, r);
+        auto emission = lookup_scaled_texture(surface->mat->ke, texture_resolve(surface->mat->ke_txt).get(), r);
         //vec3f emission = surface.mat->ke_txt;
         // compute light direction
         vec3f direction = normalize(lightPosition - pos);
@@ -216,7 +228,7 @@ vec3f pathtrace_ray(Scene* scene, ray3f ray, Rng* rng, int depth) {
         // if shadows are enabled
         if(scene->path_shadows) {
             // perform a shadow check and accumulate
-            if(not intersect_shadow(scene,ray3f::make_segment(pos, lightPosition))) c += shade;
+            if(not intersect_shadow(scene,ray3f::make_segment(pos, lightPosition, ray.time))) c += shade;
         } else {
             // else just accumulate
             c += shade;
@@ -240,7 +252,7 @@ vec3f pathtrace_ray(Scene* scene, ray3f ray, Rng* rng, int depth) {
             // if shadows are enabled
             if (scene->path_shadows) {
                 // perform a shadow check and accumulate
-                if(not intersect_shadow(scene,ray3f(pos, res.first))) c += response;
+                if(not intersect_shadow(scene,ray3f(pos, res.first, ray3f_epsilon, ray3f_rayinf, ray.time))) c += response;
              }
             else
                 c += response;
@@ -258,7 +270,7 @@ vec3f pathtrace_ray(Scene* scene, ray3f ray, Rng* rng, int depth) {
            auto brdfcos = (max(dot(norm, res.first),0.0f)) * eval_brdf(kd, ks, n, v, res.first, norm, mf);
            // accumulate recersively scaled by brdf*cos/pdf
            if(res.second > 0.1){
-               c += pathtrace_ray(scene, ray3f(pos, res.first), rng, depth + 1) * (brdfcos / res.second)  / (1 - res.second);
+               c += pathtrace_ray(scene, continue_ray_cone(ray3f(pos, res.first, ray3f_epsilon, ray3f_rayinf, ray.time), ray, intersection), rng, depth + 1) * (brdfcos / res.second)  / (1 - res.second);
            }
     }
     else {
@@ -267,7 +279,7 @@ vec3f pathtrace_ray(Scene* scene, ray3f ray, Rng* rng, int depth) {
             // compute the material response (brdf*cos)
             auto brdfcos= (max(dot(norm, res.first),0.0f)) * eval_brdf(kd, ks, n, v, res.first, norm, mf);
             // accumulate recersively scaled by brdf*cos/pdf
-            c += pathtrace_ray(scene, ray3f(pos, res.first), rng, depth + 1) * (brdfcos / res.second);
+            c += pathtrace_ray(scene, continue_ray_cone(ray3f(pos, res.first, ray3f_epsilon, ray3f_rayinf, ray.time), ray, intersection), rng, depth + 1) * (brdfcos / res.second);
         }
     }
     // if the material has reflections
@@ -280,14 +292,14 @@ vec3f pathtrace_ray(Scene* scene, ray3f ray, Rng* rng, int depth) {
                     // create the reflection ray using random direction
                     vec3f reflection = reflect(ray.d,intersection.norm);
                     reflection = (1 - 0.2 * rng->next_float())*reflection;
-                    auto rr = ray3f(intersection.pos, reflection);
+                    auto rr = continue_ray_cone(ray3f(intersection.pos, reflection, ray3f_epsilon, ray3f_rayinf, ray.time), ray, intersection);
                     // accumulate the reflected light (recursive call) scaled by the material reflection
                     sum += intersection.mat->kr * pathtrace_ray(scene,rr,rng,depth+1);
                 }
                 c += sum/num;
             }else{
                 // create the reflection ray
-                auto rr = ray3f(intersection.pos,reflect(ray.d,intersection.norm));
+                auto rr = continue_ray_cone(ray3f(intersection.pos,reflect(ray.d,intersection.norm),ray3f_epsilon,ray3f_rayinf,ray.time),ray,intersection);
                 // accumulate the reflected light (recursive call) scaled by the material reflection
                 c += intersection.mat->kr * pathtrace_ray(scene,rr,rng,depth+1);
             }
@@ -302,7 +314,9 @@ vec3f pathtrace_ray(Scene* scene, ray3f ray, Rng* rng, int depth) {
 int main(int argc, char** argv) {
     auto args = parse_cmdline(argc, argv,
         { "04_pathtrace", "raytrace a scene",
-            {  {"resolution",     "r", "image resolution", typeid(int),    true,  jsonvalue() } },
+            {  {"resolution",     "r", "image resolution", typeid(int),    true,  jsonvalue() },
+               {"frame",          "f", "animation frame",  typeid(int),    true,  jsonvalue(0) },
+               {"bake",           "b", "baked animation filename", typeid(string), true, jsonvalue("") } },
             {  {"scene_filename", "",  "scene filename",   typeid(string), false, jsonvalue("scene.json") },
                {"image_filename", "",  "image filename",   typeid(string), true,  jsonvalue("") } }
         });
@@ -328,15 +342,31 @@ int main(int argc, char** argv) {
     }
 
 
-    // NOTE: acceleration structure does not support animations
+    // NOTE: the scene is rendered at the requested frame, read from a baked animation if given
+    // (otherwise animated from reset), with motion blur over the shutter if enabled
     message("reseting animation...\n");
     animate_reset(scene);
+    auto frame = args.object_element("frame").as_int();
+    auto bake_filename = args.object_element("bake").as_string();
+    if(bake_filename != "") {
+        message("loading frame %d from %s...\n", frame, bake_filename.c_str());
+        auto cache = open_bake(bake_filename, scene);
+        bake_load_frame(cache, scene, frame);
+        close_bake(cache);
+    } else if(frame > 0) {
+        message("animating %d frames...\n", frame);
+        for(int i = 0; i < frame; i ++) animate_update(scene);
+    }
 
     message("accelerating...\n");
     accelerate(scene);
 
     message("rendering %s...\n", scene_filename.c_str());
     auto image = pathtrace(scene, parallel_pathtrace);
+    if(scene->texture_cache) message("texture cache: %lld hits, %lld misses, %lld evictions, %d MB resident\n",
+        scene->texture_cache->hits.load(), scene->texture_cache->misses, scene->texture_cache->evictions, (int)(scene->texture_cache->size >> 20));
+    if(scene->geometry_cache and scene->geometry_cache->faults) message("geometry cache: %lld faults, %lld evictions, %d MB resident\n",
+        scene->geometry_cache->faults, scene->geometry_cache->evictions, (int)(scene->geometry_cache->size >> 20));
 
     message("saving %s...\n", image_filename.c_str());
     write_png(image_filename, image, true);
@@ -353,10 +383,26 @@ int main(int argc, char** argv) {
 // pathtrace an image
 void pathtrace(Scene* scene, image3f* image, RngImage* rngs, int offset_row, int skip_row, bool verbose) {
     if(verbose) message("\n  rendering started        ");
+    // with out-of-core meshes, the pixels of a row are traced in order of the cluster their center
+    // ray enters first, so that consecutive pixels reuse resident geometry (pixels have their own
+    // random number generators, so the image does not depend on the order)
+    auto out_of_core = false;
+    for(auto mesh : scene->meshes) out_of_core = out_of_core or mesh->_clusters;
+    auto order = vector<int>(scene->image_width);
+    auto keys = vector<int>(scene->image_width);
     // foreach pixel
     for(auto j = offset_row; j < scene->image_height; j += skip_row ) {
         if(verbose) message("\r  rendering %03d/%03d        ", j, scene->image_height);
-        for(auto i = 0; i < scene->image_width; i ++) {
+        for(auto i : range(scene->image_width)) order[i] = i;
+        if(out_of_core) {
+            for(auto i : range(scene->image_width)) {
+                auto u = (i + 0.5f) / scene->image_width, v = (j + 0.5f) / scene->image_height;
+                keys[i] = ray_cluster(scene, transform_ray(scene->camera->frame,
+                    ray3f(zero3f,normalize(vec3f((u-0.5f)*scene->camera->width,(v-0.5f)*scene->camera->height,-1)))));
+            }
+            std::stable_sort(order.begin(), order.end(), [&keys](int a, int b){ return keys[a] < keys[b]; });
+        }
+        for(auto i : order) {
             // init accumulated color
             image->at(i,j) = zero3f;
             // grab proper random number generator
@@ -373,6 +419,12 @@ void pathtrace(Scene* scene, image3f* image, RngImage* rngs, int offset_row, int
                     auto ray = transform_ray(scene->camera->frame,
                         ray3f(zero3f,normalize(vec3f((u-0.5f)*scene->camera->width,
                                                      (v-0.5f)*scene->camera->height,-1))));
+                    // pick the ray time within the shutter if motion blurred
+                    ray.time = scene->animation->time;
+                    if(scene->animation->motion_blur) ray.time += scene->animation->shutter.x +
+                        (scene->animation->shutter.y-scene->animation->shutter.x) * rng->next_float();
+                    // start the ray cone with the angle of a sample footprint
+                    ray.cone_spread = scene->camera->width / (scene->image_width * scene->image_samples);
                     // set pixel to the color raytraced with the ray
                     image->at(i,j) += pathtrace_ray(scene,ray,rng,0);
                 }
@@ -0,0 +1,29 @@
+#include "scene.h"
+#include "animation.h"
+#include "bakecache.h"
+
+// runs the animation of a scene over its length, without display, and saves every frame in
+// a baked animation cache that 04_pathtrace reads with --bake
+int main(int argc, char** argv) {
+    auto args = parse_cmdline(argc, argv,
+        { "bake", "bake the animation of a scene",
+            {  },
+            {  {"scene_filename", "",  "scene filename",            typeid(string), false, jsonvalue("scene.json") },
+               {"bake_filename",  "",  "baked animation filename",  typeid(string), true,  jsonvalue("") } }
+        });
+
+    auto scene_filename = args.object_element("scene_filename").as_string();
+    auto bake_filename = (args.object_element("bake_filename").as_string() != "") ?
+        args.object_element("bake_filename").as_string() :
+        scene_filename.substr(0,scene_filename.size()-5)+".bake";
+
+    message("loading %s...\n", scene_filename.c_str());
+    auto scene = load_json_scene(scene_filename);
+    error_if_not(scene, "scene is nullptr");
+
+    message("baking %d frames to %s...\n", scene->animation->length, bake_filename.c_str());
+    bake_animation(bake_filename, scene);
+
+    delete scene;
+    message("done\n");
+}
@@ -0,0 +1,41 @@
+#include "scene.h"
+#include "binmesh.h"
+#include "clustermesh.h"
+#include "bonetracks.h"
+
+// converts a json mesh (and its json skinning, if any) into a binary mesh for bin_mesh,
+// or its triangles into an out-of-core mesh for cluster_mesh
+int main(int argc, char** argv) {
+    auto args = parse_cmdline(argc, argv,
+        { "meshconvert", "convert a json mesh to a binary mesh",
+            {  {"skinning",         "s", "json skinning filename", typeid(string), true,  jsonvalue("") },
+               {"clusters",         "c", "save an out-of-core mesh", typeid(bool),  true,  jsonvalue(false) },
+               {"tracks",           "t", "compress bone xforms in keyframe tracks", typeid(bool), true, jsonvalue(false) } },
+            {  {"mesh_filename",    "",  "json mesh filename",     typeid(string), false, jsonvalue("mesh.json") },
+               {"binary_filename",  "",  "binary mesh filename",   typeid(string), true,  jsonvalue("") } }
+        });
+
+    auto mesh_filename = args.object_element("mesh_filename").as_string();
+    auto skinning_filename = args.object_element("skinning").as_string();
+    auto clusters = args.object_element("clusters").as_bool();
+    auto tracks = args.object_element("tracks").as_bool();
+    auto binary_filename = (args.object_element("binary_filename").as_string() != "") ?
+        args.object_element("binary_filename").as_string() :
+        mesh_filename.substr(0,mesh_filename.size()-5)+((clusters) ? ".clmesh" : ".binmesh");
+
+    message("loading %s...\n", mesh_filename.c_str());
+    auto mesh = load_json_mesh(mesh_filename, skinning_filename);
+
+    if(tracks and mesh->skinning) {
+        message("compressing bone xforms...\n");
+        mesh->skinning->bone_animation = compress_bone_xforms(mesh->skinning->bone_xforms);
+        vector<vector<mat4f>>().swap(mesh->skinning->bone_xforms);
+    }
+
+    message("saving %s...\n", binary_filename.c_str());
+    if(clusters) save_clustermesh(binary_filename, mesh);
+    else save_binmesh(binary_filename, mesh);
+
+    delete mesh;
+    message("done\n");
+}
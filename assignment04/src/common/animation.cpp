@@ -1,71 +1,231 @@
 #include "animation.h"
 #include "tesselation.h"
+#include "bonetracks.h"
+#include "simulation.h"
+
+#include <algorithm>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// keyframe interval containing time (clamped to the first and last interval)
+static int _animation_interval(const float* keytimes, int nkeys, float time) {
+    auto interval = (int)(std::upper_bound(keytimes, keytimes + nkeys, time) - keytimes);
+    return clamp(interval-1, 0, max(0, nkeys-2));
+}
+
+// xform of an animation given its interval keys and the interpolation weight
+// (the closed form of translation * rotation_z * rotation_y * rotation_x)
+static mat4f _animation_xform(const vec3f& t0, const vec3f& t1, const vec3f& r0, const vec3f& r1, float t) {
+    auto tr = t0*(1-t)+t1*t;
+    auto r = r0*(1-t)+r1*t;
+    auto ca = cos(r.x), sa = sin(r.x), cb = cos(r.y), sb = sin(r.y), cc = cos(r.z), sc = sin(r.z);
+    return mat4f(cc*cb, cc*sb*sa - sc*ca, cc*sb*ca + sc*sa, tr.x,
+                 sc*cb, sc*sb*sa + cc*ca, sc*sb*ca - cc*sa, tr.y,
+                 -sb,   cb*sa,            cb*ca,            tr.z,
+                 0, 0, 0, 1);
+}
 
 // compute the frame from an animation
-frame3f animate_compute_frame(FrameAnimation* animation, int time) {
-    // grab keyframe interval
-    auto interval = 0;
-    for(auto t : animation->keytimes) if(time < t) break; else interval++;
-    interval--;
-    // get translation and rotation matrices
-    auto t = float(time-animation->keytimes[interval])/float(animation->keytimes[interval+1]-animation->keytimes[interval]);
-    auto m_t = translation_matrix(animation->translation[interval]*(1-t)+animation->translation[interval+1]*t);
-    auto m_rz = rotation_matrix(animation->rotation[interval].z*(1-t)+animation->rotation[interval+1].z*t,z3f);
-    auto m_ry = rotation_matrix(animation->rotation[interval].y*(1-t)+animation->rotation[interval+1].y*t,y3f);
-    auto m_rx = rotation_matrix(animation->rotation[interval].x*(1-t)+animation->rotation[interval+1].x*t,x3f);
-    // compute combined xform matrix
-    auto m = m_t * m_rz * m_ry * m_rx;
+frame3f animate_compute_frame(FrameAnimation* animation, float time) {
+    // grab keyframe interval by binary search (this is called concurrently for motion blur)
+    auto nkeys = (int)animation->keytimes.size();
+    auto interval = (int)(std::upper_bound(animation->keytimes.begin(), animation->keytimes.end(), time) - animation->keytimes.begin());
+    interval = clamp(interval-1, 0, max(0, nkeys-2));
+    auto next = min(interval+1, nkeys-1);
+    // interpolation weight
+    auto t = (next != interval) ? float(time-animation->keytimes[interval])/float(animation->keytimes[next]-animation->keytimes[interval]) : 0.0f;
+    t = clamp(t, 0.0f, 1.0f);
     // return the transformed frame
+    auto m = _animation_xform(animation->translation[interval], animation->translation[next],
+                              animation->rotation[interval], animation->rotation[next], t);
     return transform_frame(m, animation->rest_frame);
 }
 
+void animate_compile(Scene* scene) {
+    auto table = arena_new<AnimationTable>(scene->arena);
+    auto add = [table](FrameAnimation* animation, frame3f* frame, frame3f* display_frame) {
+        table->frames.push_back(frame);
+        table->display_frames.push_back(display_frame);
+        table->rest_frames.push_back(animation->rest_frame);
+        if(table->first.empty()) table->first.push_back(0);
+        for(auto i : range(animation->keytimes.size())) {
+            table->keytimes.push_back(animation->keytimes[i]);
+            table->translation.push_back(animation->translation[i]);
+            table->rotation.push_back(animation->rotation[i]);
+        }
+        table->first.push_back(table->keytimes.size());
+        table->cursor.push_back(0);
+    };
+    for(auto mesh : scene->meshes) if(mesh->animation) add(mesh->animation, &mesh->frame, nullptr);
+    for(auto surface : scene->surfaces) {
+        if(surface->animation) add(surface->animation, &surface->frame, (surface->_display_mesh) ? &surface->_display_mesh->frame : nullptr);
+    }
+    scene->animation->_table = table;
+}
+
 // update mesh frames for animation
+// all animations are evaluated in one pass over the compiled table: intervals are found from
+// each cursor, then interpolated keys are composed in place over the flat arrays
 void animate_frame(Scene* scene) {
-    // foreach mesh
-    for(auto mesh : scene->meshes) {
-        // if not animation, continue
-        if(not mesh->animation) continue;
-        // update frame
-        mesh->frame = animate_compute_frame(mesh->animation, scene->animation->time);
+    if(not scene->animation->_table) animate_compile(scene);
+    auto table = scene->animation->_table;
+    auto time = (float)scene->animation->time;
+    // foreach animation
+    for(auto a : range(table->frames.size())) {
+        auto first = table->first[a], nkeys = table->first[a+1]-first;
+        auto keytimes = table->keytimes.data() + first;
+        // advance the cursor for monotonic playback, or search the interval
+        auto interval = table->cursor[a];
+        auto inside = [&](int i){ return (i == 0 or keytimes[i] <= time) and (i >= nkeys-2 or time < keytimes[i+1]); };
+        if(not inside(interval)) interval = (interval+1 < nkeys-1 and inside(interval+1)) ? interval+1 : _animation_interval(keytimes, nkeys, time);
+        table->cursor[a] = interval;
+        // interpolate keys and update frames
+        auto next = min(interval+1, nkeys-1);
+        auto t = (next != interval) ? clamp((time-keytimes[interval])/(keytimes[next]-keytimes[interval]), 0.0f, 1.0f) : 0.0f;
+        auto m = _animation_xform(table->translation[first+interval], table->translation[first+next],
+                                  table->rotation[first+interval], table->rotation[first+next], t);
+        *table->frames[a] = transform_frame(m, table->rest_frames[a]);
+        if(table->display_frames[a]) *table->display_frames[a] = *table->frames[a];
     }
-    // foreach surface
-    for(auto surface : scene->surfaces) {
-        // if not animation, continue
-        if(not surface->animation) continue;
-        // update frame
-        surface->frame = animate_compute_frame(surface->animation, scene->animation->time);
-        // update the _display_mesh
-        if(surface->_display_mesh) surface->_display_mesh->frame = surface->frame;
+}
+
+// build the skinning kernel streams, padding vertices to blocks of 8 that skin nothing
+static void _skin_prepare(MeshSkinning* skinning, int nbones) {
+    auto nverts = (int)skinning->vert_rest_pos.size();
+    auto stride = (nverts + 7) / 8 * 8;
+    skinning->_num_bones = nbones;
+    skinning->_stride = stride;
+    skinning->_rest_soa.assign(6*stride, 0);
+    skinning->_bone_soa.assign(4*stride, nbones);
+    skinning->_weight_soa.assign(4*stride, 0);
+    for(auto i : range(nverts)) {
+        for(auto k : range(3)) {
+            skinning->_rest_soa[k*stride+i] = skinning->vert_rest_pos[i][k];
+            skinning->_rest_soa[(3+k)*stride+i] = skinning->vert_rest_norm[i][k];
+        }
+        for(auto j : range(4)) {
+            // missing bones keep the identity bone with zero weight
+            auto bi = skinning->vert_bone_ids[i][j];
+            if(bi < 0) continue;
+            skinning->_bone_soa[j*stride+i] = bi;
+            skinning->_weight_soa[j*stride+i] = skinning->vert_bone_weights[i][j];
+        }
     }
 }
 
-// skinning scene
+#ifdef __AVX2__
+// skin the 8 vertices starting at i (avx2 version of the scalar kernel below, same operation order)
+static void _skin_block(Mesh* mesh, int i, int nverts) {
+    auto skinning = mesh->skinning;
+    auto stride = skinning->_stride;
+    auto rest = skinning->_rest_soa.data() + i;
+    auto mats = skinning->_bone_matrices.data();
+    auto zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1);
+    __m256 r[6], acc[6];
+    for(auto k : range(6)) { r[k] = _mm256_loadu_ps(rest + k*stride); acc[k] = zero; }
+    for(auto j : range(4)) {
+        // gather the bone matrix elements of the 8 vertices
+        auto b = _mm256_mullo_epi32(_mm256_loadu_si256((const __m256i*)(skinning->_bone_soa.data() + j*stride + i)), _mm256_set1_epi32(12));
+        auto w = _mm256_loadu_ps(skinning->_weight_soa.data() + j*stride + i);
+        __m256 m[12];
+        for(auto e : range(12)) m[e] = _mm256_i32gather_ps(mats + e, b, 4);
+        // transform position and normal, normalizing the normal as transform_normal
+        __m256 p[3], n[3];
+        for(auto k : range(3)) {
+            p[k] = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[k*4+0], r[0]), _mm256_mul_ps(m[k*4+1], r[1])), _mm256_mul_ps(m[k*4+2], r[2])), m[k*4+3]);
+            n[k] = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[k*4+0], r[3]), _mm256_mul_ps(m[k*4+1], r[4])), _mm256_mul_ps(m[k*4+2], r[5]));
+        }
+        auto l = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(n[0],n[0]), _mm256_mul_ps(n[1],n[1])), _mm256_mul_ps(n[2],n[2])));
+        auto il = _mm256_and_ps(_mm256_cmp_ps(l, zero, _CMP_GT_OQ), _mm256_div_ps(one, l));
+        for(auto k : range(3)) {
+            acc[k] = _mm256_add_ps(acc[k], _mm256_mul_ps(w, p[k]));
+            acc[3+k] = _mm256_add_ps(acc[3+k], _mm256_mul_ps(w, _mm256_mul_ps(n[k], il)));
+        }
+    }
+    // normalize normal
+    auto l = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(acc[3],acc[3]), _mm256_mul_ps(acc[4],acc[4])), _mm256_mul_ps(acc[5],acc[5])));
+    auto il = _mm256_and_ps(_mm256_cmp_ps(l, zero, _CMP_GT_OQ), _mm256_div_ps(one, l));
+    for(auto k : range(3)) acc[3+k] = _mm256_mul_ps(acc[3+k], il);
+    // write back
+    float out[6][8];
+    for(auto k : range(6)) _mm256_storeu_ps(out[k], acc[k]);
+    for(auto v : range(min(8, nverts-i))) {
+        mesh->pos[i+v] = vec3f(out[0][v], out[1][v], out[2][v]);
+        mesh->norm[i+v] = vec3f(out[3][v], out[4][v], out[5][v]);
+    }
+}
+#else
+// skin the 8 vertices starting at i
+static void _skin_block(Mesh* mesh, int i, int nverts) {
+    auto skinning = mesh->skinning;
+    auto stride = skinning->_stride;
+    auto rest = skinning->_rest_soa.data() + i;
+    auto mats = skinning->_bone_matrices.data();
+    auto bones = skinning->_bone_soa.data() + i;
+    auto weights = skinning->_weight_soa.data() + i;
+    auto pos = mesh->pos.data() + i, norm = mesh->norm.data() + i;
+    for(auto v : range(min(8, nverts-i))) {
+        float acc[6] = {0, 0, 0, 0, 0, 0};
+        for(auto j : range(4)) {
+            auto m = mats + 12*bones[j*stride+v];
+            auto w = weights[j*stride+v];
+            // transform position and normal, normalizing the normal as transform_normal
+            float p[3], n[3];
+            for(auto k : range(3)) {
+                p[k] = m[k*4+0]*rest[v] + m[k*4+1]*rest[stride+v] + m[k*4+2]*rest[2*stride+v] + m[k*4+3];
+                n[k] = m[k*4+0]*rest[3*stride+v] + m[k*4+1]*rest[4*stride+v] + m[k*4+2]*rest[5*stride+v];
+            }
+            auto l = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+            auto il = (l > 0) ? 1 / l : 0;
+            for(auto k : range(3)) {
+                acc[k] += w * p[k];
+                acc[3+k] += w * (n[k] * il);
+            }
+        }
+        // normalize normal and write back
+        auto l = sqrt(acc[3]*acc[3] + acc[4]*acc[4] + acc[5]*acc[5]);
+        auto il = (l > 0) ? 1 / l : 0;
+        pos[v] = vec3f(acc[0], acc[1], acc[2]);
+        norm[v] = vec3f(acc[3]*il, acc[4]*il, acc[5]*il);
+    }
+}
+#endif
+
+// skinning scene at the current frame
 void animate_skin(Scene* scene) {
+    animate_skin(scene, scene->animation->time);
+}
+
+// skinning scene at a (possibly fractional) frame time
+// vertices are skinned in parallel chunks, each vertex independently, so the result
+// does not depend on the number of threads
+void animate_skin(Scene* scene, float time) {
     // foreach mesh
     for(auto mesh : scene->meshes) {
         // if no skinning, continue
         if(not mesh->skinning) continue;
-        // foreach vertex index
-        for(auto i : range(mesh->pos.size())) {
-            // set pos/norm to zero
-            mesh->pos[i] = zero3f;
-            mesh->norm[i] = zero3f;
-            // for each bone slot (0..3)
-            for(auto j : range(4)) {
-                // get bone weight and index
-                auto w = mesh->skinning->vert_bone_weights[i][j];
-                auto bi = mesh->skinning->vert_bone_ids[i][j];
-                // if index < 0, continue
-                if(bi < 0) continue;
-                // grab bone xform
-                auto xf = mesh->skinning->bone_xforms[scene->animation->time][bi];
-                // update position and normal
-                mesh->pos[i] += w * transform_point(xf,mesh->skinning->vert_rest_pos[i]);
-                mesh->norm[i] += w * transform_normal(xf,mesh->skinning->vert_rest_norm[i]);
-            }
-            // normalize normal
-            mesh->norm[i] = normalize(mesh->norm[i]);
+        auto skinning = mesh->skinning;
+        auto animation = skinning->bone_animation;
+        auto nbones = (animation) ? animation->num_bones : (int)skinning->bone_xforms[(int)time].size();
+        auto nverts = (int)skinning->vert_rest_pos.size();
+        // build the kernel streams on first use
+        if(skinning->_num_bones != nbones or skinning->_stride != (nverts + 7) / 8 * 8) _skin_prepare(skinning, nbones);
+        // grab bone xforms as 3x4 matrices, followed by the identity used for missing bones
+        // (compressed tracks are interpolated, uncompressed xforms are taken at the frame)
+        skinning->_bone_matrices.resize(12*(nbones+1));
+        if(animation) sample_bone_animation(animation, time, skinning->_bone_matrices.data());
+        for(auto b : range((animation) ? nbones : 0, nbones+1)) {
+            auto xf = (b < nbones) ? skinning->bone_xforms[(int)time][b] : mat4f();
+            for(auto k : range(3)) for(auto e : range(4)) skinning->_bone_matrices[b*12+k*4+e] = xf[k][e];
         }
+        // skin vertex chunks in parallel
+        mesh->pos.resize(nverts);
+        mesh->norm.resize(nverts);
+        parallel_for((nverts + skinning_chunk_size - 1) / skinning_chunk_size, [mesh,nverts](int c){
+            for(auto i = c*skinning_chunk_size; i < min(nverts, (c+1)*skinning_chunk_size); i += 8) _skin_block(mesh, i, nverts);
+        });
     }
 }
 
@@ -75,80 +235,16 @@ void simulate(Scene* scene) {
     for(auto mesh : scene->meshes) {
         // skip if no simulation
         if(not mesh->simulation) continue;
-        // compute time per step
-        auto ddt = scene->animation->dt / scene->animation->simsteps;
-        // foreach simulation steps
-        for(auto j : range(scene->animation->simsteps)) {
-            // compute extenal forces (gravity)
-            for(auto i : range(mesh->simulation->force.size())) mesh->simulation->force[i] = scene->animation->gravity * mesh->simulation->mass[i];
-            // for each spring, compute spring force on points
-            for(auto spring : mesh->simulation->springs) {
-                // compute spring distance and length
-                auto delta_pos = mesh->pos[spring.ids.y] - mesh->pos[spring.ids.x];
-                auto spring_dir = normalize(delta_pos);
-                auto spring_length = length(delta_pos);
-                // compute static force
-                auto fs = spring_dir * (spring_length - spring.restlength) * spring.ks;
-                // accumulate static force on points
-                mesh->simulation->force[spring.ids.x] +=  fs;
-                mesh->simulation->force[spring.ids.y] += -fs;
-                // compute dynamic force
-                auto delta_vel = mesh->simulation->vel[spring.ids.y] - mesh->simulation->vel[spring.ids.x];
-                // accumulate dynamic force on points
-                auto fd = dot(delta_vel,spring_dir) * spring_dir * spring.kd;
-                mesh->simulation->force[spring.ids.x] +=  fd;
-                mesh->simulation->force[spring.ids.y] += -fd;
-            }
-            // newton laws
-            for(auto i : range(mesh->pos.size())) {
-                // if pinned, skip
-                if(mesh->simulation->pinned[i]) continue;
-                // acceleration
-                auto acc = mesh->simulation->force[i] / mesh->simulation->mass[i];
-                // update velocity and positions using Euler's method
-                mesh->pos[i] += ddt * mesh->simulation->vel[i] + ddt * ddt * acc / 2;
-                mesh->simulation->vel[i] += ddt * acc;
-                // for each mesh, check for collision
-                for(auto collider : scene->surfaces) {
-                    // compute inside tests
-                    auto inside = false; auto pos = zero3f, norm = zero3f;
-                    // if quad
-                    if(collider->isquad) {
-                        // compute local poisition
-                        auto lpos = transform_point_inverse(collider->frame, mesh->pos[i]);
-                        // perform inside test
-                        if(lpos.z < 0 and lpos.x > -collider->radius and lpos.x < collider->radius
-                           and lpos.y > -collider->radius and lpos.y < collider->radius) {
-                            // if inside, set position and normal
-                            inside = true;
-                            pos = transform_point(collider->frame, {lpos.x,lpos.y,0});
-                            norm = collider->frame.z;
-                        }
-                        // else sphere
-                    } else {
-                        // inside test
-                        auto rr = (mesh->pos[i]-collider->frame.o) / collider->radius;
-                        if(length(rr) < 1) {
-                            // if inside, set position and normal
-                            inside = true;
-                            pos = collider->frame.o + (collider->radius) * normalize(rr);
-                            norm = normalize(rr);
-                        }
-                    }
-                    // if inside
-                    if(inside) {
-                        // set particle position
-                        mesh->pos[i] = pos;
-                        // update velocity
-                        auto vel = mesh->simulation->vel[i];
-                        mesh->simulation->vel[i] = (vel - dot(norm,vel)*norm)*(1-scene->animation->bounce_dump.x) -
-                        dot(norm, vel)*norm*(1-scene->animation->bounce_dump.y);
-                    }
-                }
-            }
+        // advance with the mesh integrator
+        if(mesh->simulation->solver == simulation_implicit) simulate_implicit(scene, mesh);
+        else if(mesh->simulation->solver == simulation_xpbd) simulate_xpbd(scene, mesh);
+        else if(scene->animation->adaptive_steps) simulate_adaptive(scene, mesh);
+        else simulate_explicit(scene, mesh, scene->animation->simsteps);
+        // update smooth normals in place if it has triangles or quads
+        if(not mesh->triangle.empty() or not mesh->quad.empty()) {
+            if(not mesh->simulation->_vertex_faces) mesh->simulation->_vertex_faces = make_vertex_faces(mesh, scene->arena);
+            update_smooth_normals(mesh, mesh->simulation->_vertex_faces, mesh->simulation->normals_epsilon);
         }
-        // smooth normals if it has triangles or quads
-        if(not mesh->triangle.empty() or not mesh->quad.empty()) smooth_normals(mesh);
     }
 }
 
@@ -167,6 +263,9 @@ void animate_reset(Scene* scene) {
             mesh->pos = mesh->simulation->init_pos;
             mesh->simulation->vel = mesh->simulation->init_vel;
             mesh->simulation->force.resize(mesh->simulation->init_pos.size());
+            mesh->simulation->stats = SimulationStats();
+            if(not mesh->simulation->_adjacency) mesh->simulation->_adjacency = make_spring_adjacency(mesh->simulation, (int)mesh->pos.size(), scene->arena);
+            if(not mesh->simulation->_vertex_faces and (not mesh->triangle.empty() or not mesh->quad.empty())) mesh->simulation->_vertex_faces = make_vertex_faces(mesh, scene->arena);
         }
     }
 }
@@ -3,12 +3,38 @@
 
 #include "scene.h"
 
+// keyframe animations of a scene compiled in a flat track table
+// keys of all animations are stored contiguously, and each animation keeps a cursor to its last
+// interval so that monotonic playback finds the next interval in constant time
+struct AnimationTable {
+    vector<frame3f*>    frames;         // frame updated by each animation
+    vector<frame3f*>    display_frames; // display mesh frame also updated (nullptr if none)
+    vector<frame3f>     rest_frames;    // rest frame of each animation
+    vector<int>         first;          // first key of each animation (one more entry than animations)
+    vector<float>       keytimes;       // key times
+    vector<vec3f>       translation;    // translation keys
+    vector<vec3f>       rotation;       // rotation keys
+    vector<int>         cursor;         // last interval of each animation
+};
+
+// compute the frame of a keyframed animation at a (possibly fractional) time
+frame3f animate_compute_frame(FrameAnimation* animation, float time);
+
+// compile the keyframe animations of the scene (done on the first update)
+void animate_compile(Scene* scene);
+
 // keyframe animation
 void animate_frame(Scene* scene);
 
-// skinning scene
+// vertices per parallel skinning task (a multiple of 8)
+#define skinning_chunk_size 4096
+
+// skinning scene at the current frame
 void animate_skin(Scene* scene);
 
+// skinning scene at a (possibly fractional) frame time, interpolating compressed bone tracks
+void animate_skin(Scene* scene, float time);
+
 // particle simulation
 void simulate(Scene* scene);
 
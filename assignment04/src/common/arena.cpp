@@ -0,0 +1,37 @@
+#include "arena.h"
+
+#include <cstddef>
+
+// bump allocate in a list of blocks, adding a block when the last one is full
+// (blocks from new are aligned for all fundamental types, so offsets only need rounding)
+static void* _arena_blocks_alloc(ArenaBlocks& blocks, size_t size, size_t align) {
+    error_if_not(align <= alignof(std::max_align_t), "unsupported arena alignment\n");
+    auto offset = (blocks.used + align - 1) / align * align;
+    if(blocks.blocks.empty() or offset + size > blocks.capacity) {
+        blocks.capacity = (size > arena_block_size) ? size : arena_block_size;
+        blocks.blocks.push_back(new unsigned char[blocks.capacity]);
+        offset = 0;
+    }
+    blocks.used = offset + size;
+    return blocks.blocks.back() + offset;
+}
+
+SceneArena* make_arena() {
+    return new SceneArena();
+}
+
+void* arena_alloc(SceneArena* arena, size_t size, size_t align, void(*destroy)(void*)) {
+    std::lock_guard<std::mutex> lock(arena->_mutex);
+    if(not destroy) return _arena_blocks_alloc(arena->records, size, align);
+    auto memory = _arena_blocks_alloc(arena->objects, size, align);
+    arena->_destructors.push_back(make_pair(memory, destroy));
+    return memory;
+}
+
+void delete_arena(SceneArena* arena) {
+    if(not arena) return;
+    for(auto i = (int)arena->_destructors.size()-1; i >= 0; i --) arena->_destructors[i].second(arena->_destructors[i].first);
+    for(auto block : arena->records.blocks) delete [] block;
+    for(auto block : arena->objects.blocks) delete [] block;
+    delete arena;
+}
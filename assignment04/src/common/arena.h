@@ -0,0 +1,48 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include "common.h"
+
+#include <mutex>
+#include <new>
+#include <type_traits>
+
+// arena blocks are at least arena_block_size bytes
+#define arena_block_size (1 << 16)
+
+// bump allocated memory blocks
+struct ArenaBlocks {
+    vector<unsigned char*>  blocks;         // allocated blocks
+    size_t                  used = 0;       // bytes used in the last block
+    size_t                  capacity = 0;   // size of the last block
+};
+
+// arena owning the objects of a scene, released all at once when the scene is deleted
+// trivially destructible records (e.g. Material, Light) are packed contiguously in their own
+// blocks and released without being visited; other objects (e.g. Mesh) have their destructor
+// recorded and run in reverse allocation order
+struct SceneArena {
+    ArenaBlocks                         records;        // trivially destructible objects
+    ArenaBlocks                         objects;        // objects with a destructor
+    vector<pair<void*,void(*)(void*)>>  _destructors;   // objects to destroy, in allocation order
+    std::mutex                          _mutex;         // scenes are loaded by concurrent tasks
+};
+
+// make an empty arena
+SceneArena* make_arena();
+
+// allocate uninitialized memory in the arena (records are not destroyed)
+void* arena_alloc(SceneArena* arena, size_t size, size_t align, void(*destroy)(void*) = nullptr);
+
+// make a default constructed object owned by the arena
+template<typename T>
+inline T* arena_new(SceneArena* arena) {
+    if(std::is_trivially_destructible<T>::value) return new(arena_alloc(arena, sizeof(T), alignof(T))) T();
+    auto memory = arena_alloc(arena, sizeof(T), alignof(T), [](void* object){ ((T*)object)->~T(); });
+    return new(memory) T();
+}
+
+// destroy the objects of an arena and release its memory
+void delete_arena(SceneArena* arena);
+
+#endif
@@ -0,0 +1,154 @@
+#include "bakecache.h"
+#include "animation.h"
+#include "compress.h"
+
+#include <cstring>
+
+// bytes of the vertices of a deforming mesh in a frame record (4-byte aligned)
+static uint64_t _bake_mesh_size(const BakeMeshEntry& entry) {
+    return sizeof(range3f) + ((uint64_t)entry.num_verts*3*sizeof(uint16_t) + 3) / 4 * 4 + ((entry.has_norm) ? (uint64_t)entry.num_verts*sizeof(uint32_t) : 0);
+}
+
+// write the vertices of a deforming mesh into a frame record
+static void _bake_mesh_write(unsigned char* data, const BakeMeshEntry& entry, Mesh* mesh) {
+    // quantization bounds
+    auto bbox = range3f();
+    for(auto& p : mesh->pos) bbox = runion(bbox, p);
+    memcpy(data, &bbox, sizeof(bbox));
+    auto size = bbox.max - bbox.min;
+    auto scale = vec3f(size.x / 65535, size.y / 65535, size.z / 65535);
+    auto pos = (uint16_t*)(data + sizeof(range3f));
+    auto norm = (uint32_t*)(data + sizeof(range3f) + ((uint64_t)entry.num_verts*3*sizeof(uint16_t) + 3) / 4 * 4);
+    // encode vertices in parallel
+    parallel_for(entry.num_verts, [mesh,&entry,bbox,scale,pos,norm](int i){
+        for(auto j : range(3)) {
+            auto d = (scale[j] > 0) ? (mesh->pos[i][j] - bbox.min[j]) / scale[j] : 0;
+            pos[i*3+j] = (uint16_t)round(clamp(d, 0.0f, 65535.0f));
+        }
+        if(entry.has_norm) norm[i] = encode_octahedral(mesh->norm[i]);
+    });
+}
+
+// read the vertices of a deforming mesh from a frame record
+static void _bake_mesh_read(const unsigned char* data, const BakeMeshEntry& entry, Mesh* mesh) {
+    auto bbox = range3f();
+    memcpy(&bbox, data, sizeof(bbox));
+    auto size = bbox.max - bbox.min;
+    auto scale = vec3f(size.x / 65535, size.y / 65535, size.z / 65535);
+    auto pos = (const uint16_t*)(data + sizeof(range3f));
+    auto norm = (const uint32_t*)(data + sizeof(range3f) + ((uint64_t)entry.num_verts*3*sizeof(uint16_t) + 3) / 4 * 4);
+    error_if_not(mesh->pos.size() == entry.num_verts and mesh->norm.empty() != (bool)entry.has_norm, "vertices changed since the bake was opened\n");
+    parallel_for(entry.num_verts, [mesh,&entry,bbox,scale,pos,norm](int i){
+        mesh->pos[i] = vec3f(bbox.min.x + pos[i*3+0]*scale.x, bbox.min.y + pos[i*3+1]*scale.y, bbox.min.z + pos[i*3+2]*scale.z);
+        if(entry.has_norm) mesh->norm[i] = decode_octahedral(norm[i]);
+    });
+}
+
+void bake_animation(const string& filename, Scene* scene) {
+    // start from reset, where deforming meshes have their vertices
+    animate_reset(scene);
+    // record layout: frames of meshes and surfaces, then deforming meshes
+    auto entries = vector<BakeMeshEntry>();
+    auto frame_size = (uint64_t)(scene->meshes.size() + scene->surfaces.size()) * sizeof(frame3f);
+    for(auto i : range(scene->meshes.size())) {
+        auto mesh = scene->meshes[i];
+        if(not mesh->skinning and not mesh->simulation) continue;
+        auto entry = BakeMeshEntry();
+        memset(&entry, 0, sizeof(entry));
+        entry.mesh = i;
+        entry.num_verts = mesh->pos.size();
+        entry.has_norm = not mesh->norm.empty();
+        entry.offset = frame_size;
+        frame_size += _bake_mesh_size(entry);
+        entries.push_back(entry);
+    }
+
+    // make header, placing the frame records after the table with 16-byte alignment
+    auto header = BakeHeader();
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, bake_magic, 4);
+    header.version = bake_version;
+    header.num_frames = max(1, scene->animation->length);
+    header.num_meshes = scene->meshes.size();
+    header.num_surfaces = scene->surfaces.size();
+    header.num_deforming = entries.size();
+    header.frame_size = frame_size;
+    header.frames_offset = (sizeof(BakeHeader) + entries.size()*sizeof(BakeMeshEntry) + 15) / 16 * 16;
+
+    // write header and table
+    auto f = fopen(filename.c_str(), "wb");
+    error_if_not(f != nullptr, "cannot create file: %s\n", filename.c_str());
+    error_if_not(fwrite(&header, sizeof(header), 1, f) == 1, "error writing file: %s\n", filename.c_str());
+    if(not entries.empty()) error_if_not(fwrite(entries.data(), sizeof(BakeMeshEntry), entries.size(), f) == entries.size(), "error writing file: %s\n", filename.c_str());
+    auto padding = vector<unsigned char>(header.frames_offset - sizeof(BakeHeader) - entries.size()*sizeof(BakeMeshEntry), 0);
+    if(not padding.empty()) error_if_not(fwrite(padding.data(), 1, padding.size(), f) == padding.size(), "error writing file: %s\n", filename.c_str());
+
+    // foreach frame, animate and write its record
+    auto record = vector<unsigned char>(frame_size);
+    for(auto frame : range(header.num_frames)) {
+        message("\r  baking %03d/%03d        ", frame, header.num_frames);
+        if(frame > 0) animate_update(scene);
+        auto frames = (frame3f*)record.data();
+        for(auto i : range(scene->meshes.size())) frames[i] = scene->meshes[i]->frame;
+        for(auto i : range(scene->surfaces.size())) frames[scene->meshes.size()+i] = scene->surfaces[i]->frame;
+        for(auto& entry : entries) {
+            auto mesh = scene->meshes[entry.mesh];
+            error_if_not(mesh->pos.size() == entry.num_verts and mesh->norm.empty() != (bool)entry.has_norm, "vertices changed while baking\n");
+            _bake_mesh_write(record.data() + entry.offset, entry, mesh);
+        }
+        error_if_not(fwrite(record.data(), 1, record.size(), f) == record.size(), "error writing file: %s\n", filename.c_str());
+    }
+    message("\r  baking done        \n");
+    fclose(f);
+}
+
+BakeCache* open_bake(const string& filename, Scene* scene) {
+    auto file = open_mapped_file(filename);
+    error_if_not(file != nullptr, "cannot open file: %s\n", filename.c_str());
+    // validate header
+    error_if_not(file->size >= sizeof(BakeHeader), "invalid bake file: %s\n", filename.c_str());
+    auto header = (const BakeHeader*)file->data;
+    error_if_not(memcmp(header->magic, bake_magic, 4) == 0, "invalid bake file: %s\n", filename.c_str());
+    error_if_not(header->version == bake_version, "unsupported bake version %d: %s\n", header->version, filename.c_str());
+    error_if_not(header->num_meshes == scene->meshes.size() and header->num_surfaces == scene->surfaces.size(),
+                 "bake file does not match the scene: %s\n", filename.c_str());
+    error_if_not(header->frames_offset >= sizeof(BakeHeader) + (uint64_t)header->num_deforming*sizeof(BakeMeshEntry) and
+                 header->frames_offset + (uint64_t)header->num_frames*header->frame_size <= file->size, "truncated bake file: %s\n", filename.c_str());
+    // validate deforming mesh table
+    auto cache = new BakeCache();
+    cache->num_frames = header->num_frames;
+    auto entries = (const BakeMeshEntry*)(file->data + sizeof(BakeHeader));
+    cache->meshes.assign(entries, entries + header->num_deforming);
+    for(auto& entry : cache->meshes) {
+        error_if_not(entry.mesh < header->num_meshes and entry.offset <= header->frame_size and _bake_mesh_size(entry) <= header->frame_size - entry.offset,
+                     "invalid bake file: %s\n", filename.c_str());
+        auto mesh = scene->meshes[entry.mesh];
+        error_if_not(mesh->skinning or mesh->simulation, "bake file does not match the scene (mesh %d does not deform): %s\n", (int)entry.mesh, filename.c_str());
+        error_if_not(entry.num_verts == mesh->pos.size() and (bool)entry.has_norm == not mesh->norm.empty(),
+                     "bake file does not match the scene (vertices of mesh %d): %s\n", (int)entry.mesh, filename.c_str());
+    }
+    cache->_header = header;
+    cache->_file = file;
+    return cache;
+}
+
+void close_bake(BakeCache* cache) {
+    close_mapped_file(cache->_file);
+    delete cache;
+}
+
+void bake_load_frame(BakeCache* cache, Scene* scene, int frame) {
+    error_if_not(frame >= 0 and frame < cache->num_frames, "frame %d not baked\n", frame);
+    auto record = cache->_file->data + cache->_header->frames_offset + (uint64_t)frame*cache->_header->frame_size;
+    // frames
+    auto frames = (const frame3f*)record;
+    for(auto i : range(scene->meshes.size())) scene->meshes[i]->frame = frames[i];
+    for(auto i : range(scene->surfaces.size())) {
+        auto surface = scene->surfaces[i];
+        surface->frame = frames[scene->meshes.size()+i];
+        if(surface->_display_mesh) surface->_display_mesh->frame = surface->frame;
+    }
+    // deforming meshes
+    for(auto& entry : cache->meshes) _bake_mesh_read(record + entry.offset, entry, scene->meshes[entry.mesh]);
+    scene->animation->time = frame;
+}
@@ -0,0 +1,60 @@
+#ifndef _BAKECACHE_H_
+#define _BAKECACHE_H_
+
+#include "scene.h"
+#include "mapfile.h"
+
+#include <cstdint>
+
+// baked animation cache
+// a file is a header, a table of the deforming (skinned or simulated) meshes and one fixed size
+// record per frame, so that any frame is read in place from the mapped file; a record holds the
+// frames of all meshes and surfaces, then the vertices of each deforming mesh quantized like
+// compressed vertices (positions to 16 bits within the frame bounds, octahedral normals)
+#define bake_magic "BAKE"
+#define bake_version 1
+
+// file header
+struct BakeHeader {
+    char        magic[4];       // bake_magic
+    uint32_t    version;        // bake_version
+    uint32_t    num_frames;     // number of frames
+    uint32_t    num_meshes;     // number of scene meshes
+    uint32_t    num_surfaces;   // number of scene surfaces
+    uint32_t    num_deforming;  // number of entries in the deforming mesh table
+    uint64_t    frame_size;     // bytes per frame record
+    uint64_t    frames_offset;  // offset of the first frame record from the start of the file
+};
+
+// deforming mesh table entry
+struct BakeMeshEntry {
+    uint32_t    mesh;           // mesh index in the scene
+    uint32_t    num_verts;      // number of vertices
+    uint32_t    has_norm;       // whether normals are stored
+    uint32_t    reserved;       // padding
+    uint64_t    offset;         // offset of the mesh vertices in a frame record
+};
+
+// open baked animation cache
+struct BakeCache {
+    int                     num_frames = 0;     // number of frames
+    vector<BakeMeshEntry>   meshes;             // deforming meshes
+
+    const BakeHeader*       _header = nullptr;  // file header (points into the file)
+    MappedFile*             _file = nullptr;    // file contents
+};
+
+// bake the frames of a scene animation, running animate_update from reset over its length
+void bake_animation(const string& filename, Scene* scene);
+
+// open a baked animation cache, validating it against the scene it was baked from: mesh and
+// surface counts, and the vertex count and normals of each deforming mesh
+BakeCache* open_bake(const string& filename, Scene* scene);
+
+// close a baked animation cache
+void close_bake(BakeCache* cache);
+
+// set the scene to a baked frame (frames, and positions and normals of deforming meshes)
+void bake_load_frame(BakeCache* cache, Scene* scene, int frame);
+
+#endif
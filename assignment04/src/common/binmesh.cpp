@@ -0,0 +1,289 @@
+#include "binmesh.h"
+#include "bonetracks.h"
+
+#include <cstring>
+
+// scalar type and number of components of array elements
+static void _binmesh_layout(const float*, BinaryMeshType& type, int& components) { type = binmesh_float; components = 1; }
+static void _binmesh_layout(const vec2f*, BinaryMeshType& type, int& components) { type = binmesh_float; components = 2; }
+static void _binmesh_layout(const vec3f*, BinaryMeshType& type, int& components) { type = binmesh_float; components = 3; }
+static void _binmesh_layout(const vec4f*, BinaryMeshType& type, int& components) { type = binmesh_float; components = 4; }
+static void _binmesh_layout(const mat4f*, BinaryMeshType& type, int& components) { type = binmesh_float; components = 16; }
+static void _binmesh_layout(const int*, BinaryMeshType& type, int& components) { type = binmesh_int; components = 1; }
+static void _binmesh_layout(const vec2i*, BinaryMeshType& type, int& components) { type = binmesh_int; components = 2; }
+static void _binmesh_layout(const vec3i*, BinaryMeshType& type, int& components) { type = binmesh_int; components = 3; }
+static void _binmesh_layout(const vec4i*, BinaryMeshType& type, int& components) { type = binmesh_int; components = 4; }
+static void _binmesh_layout(const unsigned char*, BinaryMeshType& type, int& components) { type = binmesh_byte; components = 1; }
+static void _binmesh_layout(const uint16_t*, BinaryMeshType& type, int& components) { type = binmesh_short; components = 1; }
+
+// channels of compressed bone tracks with their array name prefix
+static vector<pair<string,BoneTrack*>> _binmesh_bone_tracks(BoneAnimation* animation) {
+    return { {"rotation", &animation->rotation}, {"translation", &animation->translation}, {"stretch", &animation->stretch} };
+}
+
+// check a bone track read from a file: every bone has keys at increasing frames within the
+// animation, and value tracks have the dequantization bounds of every bone
+static bool _binmesh_valid_track(const BoneTrack& track, int num_bones, int num_frames, bool has_bounds) {
+    if((int)track.first.size() != num_bones+1 or track.first[0] != 0) return false;
+    if(track.first.back() != (int)track.times.size() or track.values.size() != track.times.size()*track.components) return false;
+    if(has_bounds and ((int)track.offset.size() != num_bones*track.components or (int)track.scale.size() != num_bones*track.components)) return false;
+    for(auto b : range(num_bones)) {
+        if(track.first[b+1] <= track.first[b]) return false;
+        for(auto k : range(track.first[b], track.first[b+1])) {
+            if(track.times[k] >= num_frames or (k > track.first[b] and track.times[k] <= track.times[k-1])) return false;
+        }
+    }
+    return true;
+}
+
+// size in bytes of a scalar type
+static int _binmesh_scalar_size(uint32_t type) { return (type == binmesh_byte) ? 1 : (type == binmesh_short) ? 2 : 4; }
+
+BinaryMeshFile* open_binmesh(const string& filename) {
+    auto file = new BinaryMeshFile();
+    // map or read the file
+    file->_file = open_mapped_file(filename);
+    error_if_not(file->_file != nullptr, "cannot open file: %s\n", filename.c_str());
+    error_if_not(file->_file->size >= sizeof(BinaryMeshHeader), "bad binary mesh file: %s\n", filename.c_str());
+    auto data = file->_file->data;
+    auto size = file->_file->size;
+    // check header
+    auto header = (const BinaryMeshHeader*)data;
+    error_if_not(memcmp(header->magic, binmesh_magic, 4) == 0, "bad binary mesh file: %s\n", filename.c_str());
+    error_if_not(header->version == binmesh_version, "unsupported binary mesh version %d: %s\n", (int)header->version, filename.c_str());
+    error_if_not(sizeof(BinaryMeshHeader) + header->num_arrays*sizeof(BinaryMeshEntry) <= size, "bad binary mesh file: %s\n", filename.c_str());
+    // make array views, checking that they are within the file
+    auto entries = (const BinaryMeshEntry*)(data + sizeof(BinaryMeshHeader));
+    for(auto i : range(header->num_arrays)) {
+        auto& entry = entries[i];
+        error_if_not(memchr(entry.name, 0, sizeof(entry.name)) != nullptr, "bad array name: %s\n", filename.c_str());
+        error_if_not(entry.type <= binmesh_short, "bad array type: %s\n", filename.c_str());
+        // bounds are checked by dividing the space left after the offset, so that sizes cannot wrap around
+        error_if_not(entry.components > 0, "bad array layout: %s\n", filename.c_str());
+        auto element_size = (uint64_t)entry.components * _binmesh_scalar_size(entry.type);
+        error_if_not(entry.offset % 16 == 0 and entry.offset <= size and entry.count <= (size - entry.offset) / element_size,
+                     "bad array bounds: %s\n", filename.c_str());
+        auto array = BinaryMeshArray();
+        array.type = (BinaryMeshType)entry.type;
+        array.components = entry.components;
+        array.rows = entry.rows;
+        array.count = entry.count;
+        array.data = data + entry.offset;
+        file->arrays[entry.name] = array;
+    }
+    return file;
+}
+
+void close_binmesh(BinaryMeshFile* file) {
+    close_mapped_file(file->_file);
+    delete file;
+}
+
+// copy an array of the file into a vector, if present
+template<typename T>
+static void _binmesh_get(BinaryMeshFile* file, const string& name, vector<T>& value) {
+    if(file->arrays.find(name) == file->arrays.end()) return;
+    auto& array = file->arrays[name];
+    auto type = binmesh_float; auto components = 0;
+    _binmesh_layout((const T*)nullptr, type, components);
+    error_if_not(array.type == type and array.components == components, "bad layout for array %s\n", name.c_str());
+    value.resize(array.count);
+    if(array.count) memcpy(value.data(), array.data, array.count*sizeof(T));
+}
+
+Mesh* load_binmesh(const string& filename) {
+    auto file = open_binmesh(filename);
+    auto mesh = new Mesh();
+    // geometry
+    _binmesh_get(file, "pos", mesh->pos);
+    _binmesh_get(file, "norm", mesh->norm);
+    _binmesh_get(file, "texcoord", mesh->texcoord);
+    _binmesh_get(file, "triangle", mesh->triangle);
+    _binmesh_get(file, "quad", mesh->quad);
+    _binmesh_get(file, "point", mesh->point);
+    _binmesh_get(file, "line", mesh->line);
+    _binmesh_get(file, "spline", mesh->spline);
+    // skinning
+    if(file->arrays.find("skinning.bone_ids") != file->arrays.end()) {
+        mesh->skinning = new MeshSkinning();
+        _binmesh_get(file, "skinning.rest_pos", mesh->skinning->vert_rest_pos);
+        _binmesh_get(file, "skinning.rest_norm", mesh->skinning->vert_rest_norm);
+        _binmesh_get(file, "skinning.bone_ids", mesh->skinning->vert_bone_ids);
+        _binmesh_get(file, "skinning.bone_weights", mesh->skinning->vert_bone_weights);
+        // bone transforms are stored as rows of equal length
+        auto xforms = vector<mat4f>();
+        _binmesh_get(file, "skinning.bone_xforms", xforms);
+        auto rows = (xforms.empty()) ? 0 : file->arrays["skinning.bone_xforms"].rows;
+        error_if_not(xforms.empty() or (rows > 0 and (int)xforms.size() % rows == 0), "bad bone xforms in %s\n", filename.c_str());
+        for(auto b : range(rows)) {
+            auto cols = (int)xforms.size() / rows;
+            mesh->skinning->bone_xforms.push_back(vector<mat4f>(xforms.begin()+b*cols, xforms.begin()+(b+1)*cols));
+        }
+        // compressed bone tracks
+        if(file->arrays.find("skinning.bone_frames") != file->arrays.end()) {
+            auto animation = new BoneAnimation();
+            auto frames = vector<int>();
+            _binmesh_get(file, "skinning.bone_frames", frames);
+            error_if_not(frames.size() == 2, "bad bone tracks in %s\n", filename.c_str());
+            animation->num_bones = frames[0];
+            animation->num_frames = frames[1];
+            error_if_not(animation->num_bones >= 0 and animation->num_frames >= 0, "bad bone tracks in %s\n", filename.c_str());
+            animation->stretch.components = 6;
+            for(auto channel : _binmesh_bone_tracks(animation)) {
+                auto& track = *channel.second;
+                auto prefix = "skinning." + channel.first;
+                _binmesh_get(file, prefix + ".first", track.first);
+                _binmesh_get(file, prefix + ".times", track.times);
+                _binmesh_get(file, prefix + ".values", track.values);
+                _binmesh_get(file, prefix + ".offset", track.offset);
+                _binmesh_get(file, prefix + ".scale", track.scale);
+                error_if_not(_binmesh_valid_track(track, animation->num_bones, animation->num_frames, &track != &animation->rotation),
+                             "bad bone tracks in %s\n", filename.c_str());
+            }
+            mesh->skinning->bone_animation = animation;
+        }
+    }
+    // simulation
+    if(file->arrays.find("simulation.mass") != file->arrays.end()) {
+        mesh->simulation = new MeshSimulation();
+        _binmesh_get(file, "simulation.init_pos", mesh->simulation->init_pos);
+        _binmesh_get(file, "simulation.init_vel", mesh->simulation->init_vel);
+        _binmesh_get(file, "simulation.mass", mesh->simulation->mass);
+        _binmesh_get(file, "simulation.vel", mesh->simulation->vel);
+        _binmesh_get(file, "simulation.force", mesh->simulation->force);
+        auto pinned = vector<unsigned char>();
+        _binmesh_get(file, "simulation.pinned", pinned);
+        mesh->simulation->pinned = vector<bool>(pinned.begin(), pinned.end());
+        // springs are stored as one array per field
+        auto ids = vector<vec2i>(); auto restlength = vector<float>(), ks = vector<float>(), kd = vector<float>();
+        _binmesh_get(file, "simulation.springs.ids", ids);
+        _binmesh_get(file, "simulation.springs.restlength", restlength);
+        _binmesh_get(file, "simulation.springs.ks", ks);
+        _binmesh_get(file, "simulation.springs.kd", kd);
+        error_if_not(restlength.size() == ids.size() and ks.size() == ids.size() and kd.size() == ids.size(), "bad springs in %s\n", filename.c_str());
+        for(auto i : range(ids.size())) mesh->simulation->springs.push_back({ids[i], restlength[i], ks[i], kd[i]});
+    }
+    close_binmesh(file);
+    return mesh;
+}
+
+// array to be written
+struct _BinaryMeshWriteArray {
+    string          name;           // array name
+    BinaryMeshType  type;           // scalar type
+    int             components;     // scalars per element
+    int             rows;           // number of rows for nested arrays
+    int             count;          // number of elements
+    const void*     data;           // array data
+};
+
+// add an array to be written, skipping empty ones
+template<typename T>
+static void _binmesh_add(vector<_BinaryMeshWriteArray>& arrays, const string& name, const vector<T>& value, int rows = 0) {
+    if(value.empty()) return;
+    error_if_not(name.size() < sizeof(BinaryMeshEntry::name), "array name too long: %s\n", name.c_str());
+    auto array = _BinaryMeshWriteArray{name, binmesh_float, 0, rows, (int)value.size(), value.data()};
+    _binmesh_layout((const T*)nullptr, array.type, array.components);
+    arrays.push_back(array);
+}
+
+void save_binmesh(const string& filename, Mesh* mesh) {
+    auto arrays = vector<_BinaryMeshWriteArray>();
+    // geometry
+    _binmesh_add(arrays, "pos", mesh->pos);
+    _binmesh_add(arrays, "norm", mesh->norm);
+    _binmesh_add(arrays, "texcoord", mesh->texcoord);
+    _binmesh_add(arrays, "triangle", mesh->triangle);
+    _binmesh_add(arrays, "quad", mesh->quad);
+    _binmesh_add(arrays, "point", mesh->point);
+    _binmesh_add(arrays, "line", mesh->line);
+    _binmesh_add(arrays, "spline", mesh->spline);
+    // skinning (nested bone transforms are flattened by rows)
+    auto xforms = vector<mat4f>();
+    auto bone_frames = vector<int>();
+    if(mesh->skinning) {
+        _binmesh_add(arrays, "skinning.rest_pos", mesh->skinning->vert_rest_pos);
+        _binmesh_add(arrays, "skinning.rest_norm", mesh->skinning->vert_rest_norm);
+        _binmesh_add(arrays, "skinning.bone_ids", mesh->skinning->vert_bone_ids);
+        _binmesh_add(arrays, "skinning.bone_weights", mesh->skinning->vert_bone_weights);
+        // compressed bone tracks replace the bone transforms
+        if(mesh->skinning->bone_animation) {
+            auto animation = mesh->skinning->bone_animation;
+            bone_frames = { animation->num_bones, animation->num_frames };
+            _binmesh_add(arrays, "skinning.bone_frames", bone_frames);
+            for(auto channel : _binmesh_bone_tracks(animation)) {
+                auto& track = *channel.second;
+                auto prefix = "skinning." + channel.first;
+                _binmesh_add(arrays, prefix + ".first", track.first);
+                _binmesh_add(arrays, prefix + ".times", track.times);
+                _binmesh_add(arrays, prefix + ".values", track.values);
+                _binmesh_add(arrays, prefix + ".offset", track.offset);
+                _binmesh_add(arrays, prefix + ".scale", track.scale);
+            }
+        } else {
+            for(auto& row : mesh->skinning->bone_xforms) {
+                error_if_not(row.size() == mesh->skinning->bone_xforms[0].size(), "bone transforms must have the same length\n");
+                xforms.insert(xforms.end(), row.begin(), row.end());
+            }
+            _binmesh_add(arrays, "skinning.bone_xforms", xforms, mesh->skinning->bone_xforms.size());
+        }
+    }
+    // simulation (springs are split into one array per field)
+    auto pinned = vector<unsigned char>();
+    auto ids = vector<vec2i>(); auto restlength = vector<float>(), ks = vector<float>(), kd = vector<float>();
+    if(mesh->simulation) {
+        _binmesh_add(arrays, "simulation.init_pos", mesh->simulation->init_pos);
+        _binmesh_add(arrays, "simulation.init_vel", mesh->simulation->init_vel);
+        _binmesh_add(arrays, "simulation.mass", mesh->simulation->mass);
+        _binmesh_add(arrays, "simulation.vel", mesh->simulation->vel);
+        _binmesh_add(arrays, "simulation.force", mesh->simulation->force);
+        pinned = vector<unsigned char>(mesh->simulation->pinned.begin(), mesh->simulation->pinned.end());
+        _binmesh_add(arrays, "simulation.pinned", pinned);
+        for(auto& spring : mesh->simulation->springs) {
+            ids.push_back(spring.ids);
+            restlength.push_back(spring.restlength);
+            ks.push_back(spring.ks);
+            kd.push_back(spring.kd);
+        }
+        _binmesh_add(arrays, "simulation.springs.ids", ids);
+        _binmesh_add(arrays, "simulation.springs.restlength", restlength);
+        _binmesh_add(arrays, "simulation.springs.ks", ks);
+        _binmesh_add(arrays, "simulation.springs.kd", kd);
+    }
+
+    // make header and array table, placing the data after the table with 16-byte alignment
+    auto header = BinaryMeshHeader();
+    memcpy(header.magic, binmesh_magic, 4);
+    header.version = binmesh_version;
+    header.num_arrays = arrays.size();
+    header.reserved = 0;
+    auto entries = vector<BinaryMeshEntry>(arrays.size());
+    auto offset = (uint64_t)(sizeof(BinaryMeshHeader) + arrays.size()*sizeof(BinaryMeshEntry));
+    for(auto i : range(arrays.size())) {
+        auto& entry = entries[i];
+        memset(&entry, 0, sizeof(entry));
+        strncpy(entry.name, arrays[i].name.c_str(), sizeof(entry.name)-1);
+        entry.type = arrays[i].type;
+        entry.components = arrays[i].components;
+        entry.rows = arrays[i].rows;
+        entry.count = arrays[i].count;
+        entry.offset = (offset + 15) / 16 * 16;
+        offset = entry.offset + entry.count*entry.components*_binmesh_scalar_size(entry.type);
+    }
+
+    // write file
+    auto f = fopen(filename.c_str(), "wb");
+    error_if_not(f != nullptr, "cannot create file: %s\n", filename.c_str());
+    error_if_not(fwrite(&header, sizeof(header), 1, f) == 1, "error writing file: %s\n", filename.c_str());
+    if(not entries.empty()) error_if_not(fwrite(entries.data(), sizeof(BinaryMeshEntry), entries.size(), f) == entries.size(), "error writing file: %s\n", filename.c_str());
+    auto written = (uint64_t)(sizeof(BinaryMeshHeader) + entries.size()*sizeof(BinaryMeshEntry));
+    for(auto i : range(arrays.size())) {
+        // pad to the array offset
+        static const unsigned char zeros[16] = {0};
+        error_if_not(fwrite(zeros, 1, entries[i].offset-written, f) == entries[i].offset-written, "error writing file: %s\n", filename.c_str());
+        auto bytes = entries[i].count*entries[i].components*_binmesh_scalar_size(entries[i].type);
+        error_if_not(fwrite(arrays[i].data, 1, bytes, f) == bytes, "error writing file: %s\n", filename.c_str());
+        written = entries[i].offset + bytes;
+    }
+    fclose(f);
+}
@@ -0,0 +1,67 @@
+#ifndef _BINMESH_H_
+#define _BINMESH_H_
+
+#include "scene.h"
+#include "mapfile.h"
+
+#include <cstdint>
+
+// binary mesh container
+// a file is a header, a table of named arrays and the array data; arrays are 16-byte
+// aligned so that a memory mapped file can be read in place (data is little endian)
+// arrays are named after the json keys, e.g. "pos", "skinning.bone_ids", "simulation.mass"
+// (compressed bone tracks are stored by channel, e.g. "skinning.rotation.times")
+#define binmesh_magic "BMSH"
+#define binmesh_version 1
+
+// scalar types of binary mesh arrays
+enum BinaryMeshType { binmesh_float = 0, binmesh_int = 1, binmesh_byte = 2, binmesh_short = 3 };
+
+// file header
+struct BinaryMeshHeader {
+    char        magic[4];       // binmesh_magic
+    uint32_t    version;        // binmesh_version
+    uint32_t    num_arrays;     // number of entries in the array table
+    uint32_t    reserved;       // padding
+};
+
+// array table entry
+struct BinaryMeshEntry {
+    char        name[32];       // array name (zero terminated)
+    uint32_t    type;           // scalar type (BinaryMeshType)
+    uint32_t    components;     // scalars per element
+    uint32_t    rows;           // number of rows for nested arrays (0 for flat arrays)
+    uint32_t    reserved;       // padding
+    uint64_t    count;          // number of elements
+    uint64_t    offset;         // data offset from the start of the file
+};
+
+// zero-copy view of an array inside an open binary mesh file
+struct BinaryMeshArray {
+    BinaryMeshType  type = binmesh_float;   // scalar type
+    int             components = 0;         // scalars per element
+    int             rows = 0;               // number of rows for nested arrays
+    uint64_t        count = 0;              // number of elements
+    const void*     data = nullptr;         // array data (points into the file)
+};
+
+// open binary mesh file, memory mapped when supported
+struct BinaryMeshFile {
+    map<string,BinaryMeshArray> arrays;             // arrays by name
+
+    MappedFile*                 _file = nullptr;    // file contents
+};
+
+// open a binary mesh file and validate its array table
+BinaryMeshFile* open_binmesh(const string& filename);
+
+// close a binary mesh file, invalidating all array views
+void close_binmesh(BinaryMeshFile* file);
+
+// load a mesh with its skinning and simulation data (materials are not stored)
+Mesh* load_binmesh(const string& filename);
+
+// save the arrays of a mesh with its skinning and simulation data
+void save_binmesh(const string& filename, Mesh* mesh);
+
+#endif
@@ -0,0 +1,268 @@
+#include "bonetracks.h"
+
+#include <algorithm>
+
+// quaternion (x,y,z,w) of a rotation matrix given by rows
+static vec4f _bonetracks_quat(const vec3f* r) {
+    auto trace = r[0].x + r[1].y + r[2].z;
+    auto q = vec4f();
+    if(trace > 0) {
+        auto s = sqrt(trace + 1) * 2;
+        q = vec4f((r[2].y - r[1].z) / s, (r[0].z - r[2].x) / s, (r[1].x - r[0].y) / s, s / 4);
+    } else if(r[0].x > r[1].y and r[0].x > r[2].z) {
+        auto s = sqrt(1 + r[0].x - r[1].y - r[2].z) * 2;
+        q = vec4f(s / 4, (r[0].y + r[1].x) / s, (r[0].z + r[2].x) / s, (r[2].y - r[1].z) / s);
+    } else if(r[1].y > r[2].z) {
+        auto s = sqrt(1 + r[1].y - r[0].x - r[2].z) * 2;
+        q = vec4f((r[0].y + r[1].x) / s, s / 4, (r[1].z + r[2].y) / s, (r[0].z - r[2].x) / s);
+    } else {
+        auto s = sqrt(1 + r[2].z - r[0].x - r[1].y) * 2;
+        q = vec4f((r[0].z + r[2].x) / s, (r[1].z + r[2].y) / s, s / 4, (r[1].x - r[0].y) / s);
+    }
+    return normalize(q);
+}
+
+// normalized linear interpolation of quaternions along the shortest arc
+static vec4f _bonetracks_nlerp(const vec4f& a, const vec4f& b, float t) {
+    auto s = (dot(a, b) < 0) ? -1.0f : 1.0f;
+    return normalize(a * (1 - t) + b * (s * t));
+}
+
+// rotation angle between quaternions
+static float _bonetracks_angle(const vec4f& a, const vec4f& b) {
+    return 2 * acos(min(1.0f, abs(dot(a, b))));
+}
+
+// range of the three smallest quaternion components
+#define _bonetracks_quat_range 0.70710678f
+
+// quantize a quaternion as its three smallest components
+static void _bonetracks_encode_quat(vec4f q, uint16_t* v) {
+    auto largest = 0;
+    for(auto i : range(1,4)) if(abs(q[i]) > abs(q[largest])) largest = i;
+    if(q[largest] < 0) q = -q;
+    float c[3]; auto n = 0;
+    for(auto i : range(4)) if(i != largest) c[n++] = clamp((q[i] + _bonetracks_quat_range) / (2 * _bonetracks_quat_range), 0.0f, 1.0f);
+    v[0] = (uint16_t)(((largest >> 1) << 15) | (int)round(c[0] * 32767));
+    v[1] = (uint16_t)(((largest & 1) << 15) | (int)round(c[1] * 32767));
+    v[2] = (uint16_t)round(c[2] * 65535);
+}
+
+// dequantize a quaternion stored as its three smallest components
+static vec4f _bonetracks_decode_quat(const uint16_t* v) {
+    auto largest = ((v[0] >> 15) << 1) | (v[1] >> 15);
+    float c[3] = { (v[0] & 0x7fff) / 32767.0f, (v[1] & 0x7fff) / 32767.0f, v[2] / 65535.0f };
+    auto q = vec4f(); auto n = 0; auto sum = 0.0f;
+    for(auto i : range(4)) {
+        if(i == largest) continue;
+        q[i] = c[n++] * 2 * _bonetracks_quat_range - _bonetracks_quat_range;
+        sum += q[i] * q[i];
+    }
+    q[largest] = sqrt(max(0.0f, 1 - sum));
+    return normalize(q);
+}
+
+// translation or stretch values of a key
+struct _BoneValue {
+    float v[6];     // values (3 for translations, 6 for stretches)
+};
+
+// quantize a value within per bone bounds
+static void _bonetracks_encode_value(const _BoneValue& value, const float* offset, const float* scale, int n, uint16_t* v) {
+    for(auto i : range(n)) v[i] = (scale[i] > 0) ? (uint16_t)round(clamp((value.v[i] - offset[i]) / scale[i], 0.0f, 65535.0f)) : 0;
+}
+
+// dequantize a value within per bone bounds
+static _BoneValue _bonetracks_decode_value(const uint16_t* v, const float* offset, const float* scale, int n) {
+    auto value = _BoneValue();
+    for(auto i : range(n)) value.v[i] = offset[i] + v[i] * scale[i];
+    return value;
+}
+
+// polar decomposition of a 3x3 matrix given by rows in a rotation and a symmetric stretch
+// (xx, yy, zz, xy, xz, yz); a negative determinant is moved into the stretch
+static void _bonetracks_polar(const vec3f* m, vec3f* r, _BoneValue& stretch) {
+    auto flip = (dot(m[0], cross(m[1], m[2])) < 0) ? -1.0f : 1.0f;
+    for(auto i : range(3)) r[i] = m[i] * flip;
+    // average the matrix with its inverse transpose until it converges to a rotation
+    for(auto iter = 0; iter < 32; iter ++) {
+        vec3f c[3] = { cross(r[1], r[2]), cross(r[2], r[0]), cross(r[0], r[1]) };
+        auto det = dot(r[0], c[0]);
+        if(det == 0) { r[0] = x3f; r[1] = y3f; r[2] = z3f; break; }
+        auto delta = 0.0f;
+        for(auto i : range(3)) {
+            auto ri = (r[i] + c[i] / det) / 2;
+            delta = max(delta, length(ri - r[i]));
+            r[i] = ri;
+        }
+        if(delta < 1e-7f) break;
+    }
+    // stretch = r^T m
+    float s[3][3];
+    for(auto i : range(3)) for(auto j : range(3)) s[i][j] = (r[0][i]*m[0][j] + r[1][i]*m[1][j] + r[2][i]*m[2][j]);
+    stretch = _BoneValue{ { s[0][0], s[1][1], s[2][2], (s[0][1]+s[1][0])/2, (s[0][2]+s[2][0])/2, (s[1][2]+s[2][1])/2 } };
+}
+
+// pick keyframes such that interpolating the quantized keys reproduces all frames within tolerance
+// (greedily extends each segment while it stays within tolerance)
+template<typename T, typename interp_func, typename error_func>
+static vector<int> _bonetracks_reduce(const vector<T>& frames, const vector<T>& quantized, float tolerance,
+                                      const interp_func& interp, const error_func& error) {
+    auto nframes = (int)frames.size();
+    auto keys = vector<int>{0};
+    auto start = 0;
+    while(start < nframes - 1) {
+        auto end = start + 1;
+        while(end + 1 < nframes) {
+            auto ok = true;
+            for(auto k = start + 1; k <= end and ok; k++) {
+                auto t = (k - start) / float(end + 1 - start);
+                ok = error(interp(quantized[start], quantized[end+1], t), frames[k]) <= tolerance;
+            }
+            if(not ok) break;
+            end++;
+        }
+        keys.push_back(end);
+        start = end;
+    }
+    // constant channels keep a single key
+    if(keys.size() == 2 and error(quantized[0], quantized[nframes-1]) == 0) keys.pop_back();
+    return keys;
+}
+
+BoneAnimation* compress_bone_xforms(const vector<vector<mat4f>>& bone_xforms) {
+    auto animation = new BoneAnimation();
+    animation->num_frames = bone_xforms.size();
+    animation->num_bones = (bone_xforms.empty()) ? 0 : bone_xforms[0].size();
+    error_if_not(animation->num_frames <= 65536, "too many frames for bone tracks\n");
+    for(auto& xforms : bone_xforms) error_if_not((int)xforms.size() == animation->num_bones, "bone transforms must have the same length\n");
+    auto nframes = animation->num_frames, nbones = animation->num_bones;
+
+    // decompose xforms in translation, rotation and stretch
+    auto rotations = vector<vector<vec4f>>(nbones, vector<vec4f>(nframes));
+    auto translations = vector<vector<_BoneValue>>(nbones, vector<_BoneValue>(nframes));
+    auto stretches = vector<vector<_BoneValue>>(nbones, vector<_BoneValue>(nframes));
+    auto bounds = range3f();
+    for(auto f : range(nframes)) {
+        for(auto b : range(nbones)) {
+            auto& m = bone_xforms[f][b];
+            vec3f rows[3] = { vec3f(m[0][0], m[0][1], m[0][2]), vec3f(m[1][0], m[1][1], m[1][2]), vec3f(m[2][0], m[2][1], m[2][2]) };
+            vec3f r[3];
+            _bonetracks_polar(rows, r, stretches[b][f]);
+            rotations[b][f] = _bonetracks_quat(r);
+            translations[b][f] = _BoneValue{ { m[0][3], m[1][3], m[2][3] } };
+            bounds = runion(bounds, vec3f(m[0][3], m[1][3], m[2][3]));
+        }
+    }
+    auto size = (nbones and nframes) ? max(bounds.max.x - bounds.min.x, max(bounds.max.y - bounds.min.y, bounds.max.z - bounds.min.z)) : 0.0f;
+    auto translation_tolerance = bonetracks_translation_tolerance * ((size > 0) ? size : 1);
+
+    // quantize each channel and reduce its keys
+    auto add_value_track = [&](BoneTrack& track, const vector<_BoneValue>& frames, float tolerance) {
+        auto n = track.components;
+        auto offset = _BoneValue(), scale = _BoneValue();
+        for(auto i : range(n)) {
+            auto vmin = frames[0].v[i], vmax = frames[0].v[i];
+            for(auto& value : frames) { vmin = min(vmin, value.v[i]); vmax = max(vmax, value.v[i]); }
+            offset.v[i] = vmin; scale.v[i] = (vmax - vmin) / 65535;
+        }
+        auto quantized = vector<_BoneValue>(frames.size());
+        auto encoded = vector<uint16_t>(frames.size()*n);
+        for(auto f : range(frames.size())) {
+            _bonetracks_encode_value(frames[f], offset.v, scale.v, n, encoded.data() + f*n);
+            quantized[f] = _bonetracks_decode_value(encoded.data() + f*n, offset.v, scale.v, n);
+        }
+        auto interp = [n](const _BoneValue& a, const _BoneValue& b, float t){
+            auto value = _BoneValue();
+            for(auto i : range(n)) value.v[i] = a.v[i] * (1 - t) + b.v[i] * t;
+            return value;
+        };
+        auto error = [n](const _BoneValue& a, const _BoneValue& b){
+            auto e = 0.0f;
+            for(auto i : range(n)) e = max(e, abs(a.v[i] - b.v[i]));
+            return e;
+        };
+        for(auto k : _bonetracks_reduce(frames, quantized, tolerance, interp, error)) {
+            track.times.push_back(k);
+            track.values.insert(track.values.end(), encoded.begin() + k*n, encoded.begin() + (k+1)*n);
+        }
+        track.offset.insert(track.offset.end(), offset.v, offset.v + n);
+        track.scale.insert(track.scale.end(), scale.v, scale.v + n);
+        track.first.push_back(track.times.size());
+    };
+    auto add_rotation_track = [&](BoneTrack& track, const vector<vec4f>& frames) {
+        auto quantized = vector<vec4f>(frames.size());
+        auto encoded = vector<uint16_t>(frames.size()*3);
+        for(auto f : range(frames.size())) {
+            _bonetracks_encode_quat(frames[f], encoded.data() + f*3);
+            quantized[f] = _bonetracks_decode_quat(encoded.data() + f*3);
+        }
+        for(auto k : _bonetracks_reduce(frames, quantized, bonetracks_rotation_tolerance, _bonetracks_nlerp, _bonetracks_angle)) {
+            track.times.push_back(k);
+            track.values.insert(track.values.end(), encoded.begin() + k*3, encoded.begin() + k*3 + 3);
+        }
+        track.first.push_back(track.times.size());
+    };
+    animation->stretch.components = 6;
+    for(auto track : { &animation->rotation, &animation->translation, &animation->stretch }) track->first.push_back(0);
+    for(auto b : range(nbones)) {
+        add_rotation_track(animation->rotation, rotations[b]);
+        add_value_track(animation->translation, translations[b], translation_tolerance);
+        add_value_track(animation->stretch, stretches[b], bonetracks_stretch_tolerance);
+    }
+    return animation;
+}
+
+// keys of a bone channel around a fractional time, with the interpolation weight of the second
+static void _bonetracks_keys(const BoneTrack& track, int bone, float time, int& k0, int& k1, float& t) {
+    auto first = track.first[bone], last = track.first[bone+1] - 1;
+    t = 0;
+    if(time <= track.times[first]) { k0 = k1 = first; return; }
+    if(time >= track.times[last]) { k0 = k1 = last; return; }
+    k0 = (int)(std::upper_bound(track.times.begin() + first, track.times.begin() + last + 1, time) - track.times.begin()) - 1;
+    k1 = k0 + 1;
+    t = (time - track.times[k0]) / float(track.times[k1] - track.times[k0]);
+}
+
+// sample a value channel of a bone
+static _BoneValue _bonetracks_sample_value(const BoneTrack& track, int bone, float time) {
+    auto k0 = 0, k1 = 0; auto t = 0.0f;
+    _bonetracks_keys(track, bone, time, k0, k1, t);
+    auto n = track.components;
+    auto offset = track.offset.data() + bone*n, scale = track.scale.data() + bone*n;
+    auto a = _bonetracks_decode_value(track.values.data() + k0*n, offset, scale, n);
+    auto b = _bonetracks_decode_value(track.values.data() + k1*n, offset, scale, n);
+    for(auto i : range(n)) a.v[i] = a.v[i] * (1 - t) + b.v[i] * t;
+    return a;
+}
+
+// sample a bone xform as a 3x4 matrix
+static void _bonetracks_sample(BoneAnimation* animation, int bone, float time, float* m) {
+    auto k0 = 0, k1 = 0; auto t = 0.0f;
+    auto& rotation = animation->rotation;
+    _bonetracks_keys(rotation, bone, time, k0, k1, t);
+    auto q = _bonetracks_nlerp(_bonetracks_decode_quat(rotation.values.data() + k0*3), _bonetracks_decode_quat(rotation.values.data() + k1*3), t);
+    auto p = _bonetracks_sample_value(animation->translation, bone, time);
+    auto st = _bonetracks_sample_value(animation->stretch, bone, time);
+    // compose translation * rotation * stretch
+    auto x = q.x, y = q.y, z = q.z, w = q.w;
+    vec3f r[3] = { vec3f(1 - 2*(y*y + z*z), 2*(x*y - z*w), 2*(x*z + y*w)),
+                   vec3f(2*(x*y + z*w), 1 - 2*(x*x + z*z), 2*(y*z - x*w)),
+                   vec3f(2*(x*z - y*w), 2*(y*z + x*w), 1 - 2*(x*x + y*y)) };
+    vec3f s[3] = { vec3f(st.v[0], st.v[3], st.v[4]), vec3f(st.v[3], st.v[1], st.v[5]), vec3f(st.v[4], st.v[5], st.v[2]) };
+    for(auto i : range(3)) {
+        for(auto j : range(3)) m[i*4+j] = r[i].x * s[0][j] + r[i].y * s[1][j] + r[i].z * s[2][j];
+        m[i*4+3] = p.v[i];
+    }
+}
+
+void sample_bone_animation(BoneAnimation* animation, float time, float* matrices) {
+    time = clamp(time, 0.0f, (float)max(0, animation->num_frames - 1));
+    for(auto b : range(animation->num_bones)) _bonetracks_sample(animation, b, time, matrices + b*12);
+}
+
+mat4f sample_bone_xform(BoneAnimation* animation, int bone, float time) {
+    float m[12];
+    _bonetracks_sample(animation, bone, clamp(time, 0.0f, (float)max(0, animation->num_frames - 1)), m);
+    return mat4f(m[0], m[1], m[2], m[3], m[4], m[5], m[6], m[7], m[8], m[9], m[10], m[11], 0, 0, 0, 1);
+}
@@ -0,0 +1,48 @@
+#ifndef _BONETRACKS_H_
+#define _BONETRACKS_H_
+
+#include "scene.h"
+
+#include <cstdint>
+
+// compressed bone animation
+// bone xforms are decomposed in translation, rotation and stretch (the symmetric matrix of the
+// polar decomposition, so skinning xforms with non-uniform scale and shear are kept); each channel
+// keeps only the keyframes needed to reproduce the sampled frames within a tolerance, with
+// quantized values, and is interpolated between keyframes, so animations can be sampled at
+// fractional times
+#define bonetracks_rotation_tolerance 0.0005f       // max rotation error (radians)
+#define bonetracks_translation_tolerance 0.0001f    // max translation error (relative to the animation bounds)
+#define bonetracks_stretch_tolerance 0.0001f        // max stretch matrix element error
+
+// keyframes of one channel of all bones
+// rotations are stored as the three smallest quaternion components, the index of the largest
+// one in the top bits of the first two; translations and stretches are quantized within per bone bounds
+struct BoneTrack {
+    int                 components = 3; // quantized values per key (3, or 6 for stretches)
+    vector<int>         first;          // first key of each bone (num_bones+1 entries)
+    vector<uint16_t>    times;          // key frames
+    vector<uint16_t>    values;         // quantized key values
+    vector<float>       offset;         // per bone dequantization offset (not for rotations)
+    vector<float>       scale;          // per bone dequantization scale (not for rotations)
+};
+
+// compressed bone xforms of a skinned mesh
+struct BoneAnimation {
+    int                 num_bones = 0;      // number of bones
+    int                 num_frames = 0;     // number of sampled frames
+    BoneTrack           rotation;           // rotation keys
+    BoneTrack           translation;        // translation keys
+    BoneTrack           stretch;            // stretch keys (xx, yy, zz, xy, xz, yz)
+};
+
+// compress bone xforms (indexed by frame, then bone) into keyframe tracks
+BoneAnimation* compress_bone_xforms(const vector<vector<mat4f>>& bone_xforms);
+
+// sample bone xforms at a fractional frame time as 3x4 matrices (12 floats per bone)
+void sample_bone_animation(BoneAnimation* animation, float time, float* matrices);
+
+// sample the xform of a bone at a fractional frame time
+mat4f sample_bone_xform(BoneAnimation* animation, int bone, float time);
+
+#endif
@@ -0,0 +1,281 @@
+#include "clustermesh.h"
+#include "intersect.h"
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+ClusterCache* make_cluster_cache(size_t budget) {
+    auto cache = new ClusterCache();
+    cache->budget = budget;
+    return cache;
+}
+
+void delete_cluster_cache(ClusterCache* cache) {
+    delete cache;
+}
+
+// check the bvh node at index nid: leaves hold a range of primitives, internal nodes reference
+// later nodes (the builder writes nodes in pre-order), so traversals cannot loop
+static bool _clustermesh_valid_node(const ClusterNode& node, int nid, int num_nodes, int num_prims) {
+    if(node.leaf) return node.n0 >= 0 and node.n0 <= node.n1 and node.n1 <= num_prims;
+    return node.n0 > nid and node.n1 > nid and node.n0 < num_nodes and node.n1 < num_nodes;
+}
+
+ClusterMesh* open_clustermesh(const string& filename, ClusterCache* cache) {
+    auto mesh = new ClusterMesh();
+    mesh->cache = cache;
+    // map or read the file
+    mesh->_file = open_mapped_file(filename);
+    error_if_not(mesh->_file != nullptr, "cannot open file: %s\n", filename.c_str());
+    error_if_not(mesh->_file->size >= sizeof(ClusterMeshHeader), "bad cluster mesh file: %s\n", filename.c_str());
+    auto data = mesh->_file->data;
+    auto size = mesh->_file->size;
+    // check header
+    auto header = (const ClusterMeshHeader*)data;
+    error_if_not(memcmp(header->magic, clustermesh_magic, 4) == 0, "bad cluster mesh file: %s\n", filename.c_str());
+    error_if_not(header->version == clustermesh_version, "unsupported cluster mesh version %d: %s\n", (int)header->version, filename.c_str());
+    auto tables = sizeof(ClusterMeshHeader) + (uint64_t)header->num_clusters*sizeof(ClusterMeshEntry) + (uint64_t)header->num_nodes*sizeof(ClusterNode);
+    error_if_not(tables <= size, "bad cluster mesh file: %s\n", filename.c_str());
+    mesh->header = header;
+    mesh->clusters = (const ClusterMeshEntry*)(data + sizeof(ClusterMeshHeader));
+    mesh->nodes = (const ClusterNode*)(data + sizeof(ClusterMeshHeader) + header->num_clusters*sizeof(ClusterMeshEntry));
+    // check that the top-level bvh and the clusters are within the file
+    for(auto i : range(header->num_nodes)) {
+        error_if_not(_clustermesh_valid_node(mesh->nodes[i], (int)i, (int)header->num_nodes, (int)header->num_clusters), "bad cluster mesh bvh: %s\n", filename.c_str());
+    }
+    auto vertex_size = sizeof(vec3f) + ((header->flags & clustermesh_has_norm) ? sizeof(vec3f) : 0) + ((header->flags & clustermesh_has_texcoord) ? sizeof(vec2f) : 0);
+    for(auto i : range(header->num_clusters)) {
+        auto& entry = mesh->clusters[i];
+        auto bytes = entry.num_verts*vertex_size + entry.num_triangles*sizeof(vec3i) + entry.num_nodes*sizeof(ClusterNode);
+        error_if_not(entry.offset % clustermesh_page_size == 0 and bytes <= entry.size and entry.offset <= size and entry.size <= size - entry.offset and
+                     entry.num_nodes > 0 and entry.num_verts <= INT32_MAX and entry.num_triangles <= INT32_MAX and entry.num_nodes <= INT32_MAX,
+                     "bad cluster bounds: %s\n", filename.c_str());
+    }
+    mesh->_state = vector<std::atomic<unsigned char>>(header->num_clusters);
+    mesh->_checked = vector<std::atomic<unsigned char>>(header->num_clusters);
+    return mesh;
+}
+
+void close_clustermesh(ClusterMesh* mesh) {
+    if(not mesh) return;
+    // drop the resident clusters of the mesh from the cache
+    if(mesh->cache) {
+        std::lock_guard<std::mutex> lock(mesh->cache->mutex);
+        auto& resident = mesh->cache->resident;
+        for(auto i = 0; i < (int)resident.size(); ) {
+            if(resident[i].first != mesh) { i ++; continue; }
+            mesh->cache->size -= mesh->clusters[resident[i].second].size;
+            resident[i] = resident.back();
+            resident.pop_back();
+        }
+    }
+    close_mapped_file(mesh->_file);
+    delete mesh;
+}
+
+// hint the os that the pages of a cluster are about to be used or can be released
+static void _clustermesh_advise(ClusterMesh* mesh, int cid, bool release) {
+#ifndef _WIN32
+    if(not mesh->_file->_mapped) return;
+    auto& entry = mesh->clusters[cid];
+    madvise((void*)(mesh->_file->data + entry.offset), entry.size, (release) ? MADV_DONTNEED : MADV_WILLNEED);
+#endif
+}
+
+// mark a cluster as recently used, faulting it in if evicted and sweeping the clock until the
+// resident clusters fit the budget; used clusters only take the lock when they were evicted
+static void _clustermesh_touch(ClusterMesh* mesh, int cid) {
+    auto& state = mesh->_state[cid];
+    auto current = state.load(std::memory_order_relaxed);
+    if(current == 2) return;
+    if(current == 1 and state.compare_exchange_strong(current, 2)) return;
+    // fault the cluster in
+    auto cache = mesh->cache;
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    current = 1;
+    if(state.compare_exchange_strong(current, 2) or current == 2) return;
+    state.store(2);
+    cache->resident.push_back(make_pair(mesh, cid));
+    cache->size += mesh->clusters[cid].size;
+    cache->faults ++;
+    _clustermesh_advise(mesh, cid, false);
+    // second chance sweep: recently used clusters are spared once, the others are released
+    while(cache->budget and cache->size > cache->budget and cache->resident.size() > 1) {
+        if(cache->hand >= (int)cache->resident.size()) cache->hand = 0;
+        auto entry = cache->resident[cache->hand];
+        if(entry.first == mesh and entry.second == cid) { cache->hand ++; continue; }
+        auto& estate = entry.first->_state[entry.second];
+        auto used = (unsigned char)1;
+        if(not estate.compare_exchange_strong(used, 0)) { estate.store(1); cache->hand ++; continue; }
+        _clustermesh_advise(entry.first, entry.second, true);
+        cache->size -= entry.first->clusters[entry.second].size;
+        cache->evictions ++;
+        cache->resident[cache->hand] = cache->resident.back();
+        cache->resident.pop_back();
+    }
+}
+
+ClusterView clustermesh_cluster(ClusterMesh* mesh, int cid) {
+    if(mesh->cache) _clustermesh_touch(mesh, cid);
+    // arrays are stored one after the other
+    auto& entry = mesh->clusters[cid];
+    auto data = mesh->_file->data + entry.offset;
+    auto view = ClusterView();
+    view.pos = (const vec3f*)data; data += entry.num_verts*sizeof(vec3f);
+    if(mesh->header->flags & clustermesh_has_norm) { view.norm = (const vec3f*)data; data += entry.num_verts*sizeof(vec3f); }
+    if(mesh->header->flags & clustermesh_has_texcoord) { view.texcoord = (const vec2f*)data; data += entry.num_verts*sizeof(vec2f); }
+    view.triangle = (const vec3i*)data; data += entry.num_triangles*sizeof(vec3i);
+    view.nodes = (const ClusterNode*)data;
+    // validate the cluster on first access (concurrent first accesses check it more than once)
+    if(not mesh->_checked[cid].load(std::memory_order_acquire)) {
+        for(auto i : range((int)entry.num_nodes)) {
+            error_if_not(_clustermesh_valid_node(view.nodes[i], i, (int)entry.num_nodes, (int)entry.num_triangles), "bad cluster bvh in cluster %d\n", cid);
+        }
+        for(auto i : range((int)entry.num_triangles)) {
+            auto t = view.triangle[i];
+            auto nverts = (int)entry.num_verts;
+            error_if_not(t.x >= 0 and t.x < nverts and t.y >= 0 and t.y < nverts and t.z >= 0 and t.z < nverts, "bad triangle in cluster %d\n", cid);
+        }
+        mesh->_checked[cid].store(1, std::memory_order_release);
+    }
+    return view;
+}
+
+// build a bvh over prims [start,end) with at most leaf_size prims per leaf, splitting at the median
+// of the largest axis of the prim centers; prims are reordered so that leaves are contiguous
+static int _clustermesh_build(vector<ClusterNode>& nodes, vector<int>& prims, const vector<range3f>& bboxes,
+                              int start, int end, int leaf_size) {
+    auto nodeid = (int)nodes.size();
+    nodes.push_back(ClusterNode());
+    auto bbox = range3f(), cbbox = range3f();
+    for(auto i : range(start,end)) { bbox = runion(bbox, bboxes[prims[i]]); cbbox = runion(cbbox, center(bboxes[prims[i]])); }
+    nodes[nodeid].bbox = bbox;
+    if(end - start <= leaf_size) {
+        nodes[nodeid].leaf = 1;
+        nodes[nodeid].n0 = start;
+        nodes[nodeid].n1 = end;
+        return nodeid;
+    }
+    auto s = size(cbbox);
+    auto axis = (s.x >= s.y and s.x >= s.z) ? 0 : (s.y >= s.z) ? 1 : 2;
+    auto middle = (start+end) / 2;
+    std::nth_element(prims.begin()+start, prims.begin()+middle, prims.begin()+end,
+                     [&](int a, int b){ return center(bboxes[a])[axis] < center(bboxes[b])[axis]; });
+    auto n0 = _clustermesh_build(nodes, prims, bboxes, start, middle, leaf_size);
+    auto n1 = _clustermesh_build(nodes, prims, bboxes, middle, end, leaf_size);
+    nodes[nodeid].leaf = 0;
+    nodes[nodeid].n0 = n0;
+    nodes[nodeid].n1 = n1;
+    return nodeid;
+}
+
+// write bytes to a file
+static void _clustermesh_write(FILE* f, const void* data, size_t size, const string& filename) {
+    if(size) error_if_not(fwrite(data, 1, size, f) == size, "error writing file: %s\n", filename.c_str());
+}
+
+// pad with zeros the size bytes just written up to the next page
+static void _clustermesh_pad(FILE* f, size_t size, const string& filename) {
+    static const unsigned char zeros[clustermesh_page_size] = {0};
+    _clustermesh_write(f, zeros, (clustermesh_page_size - size % clustermesh_page_size) % clustermesh_page_size, filename);
+}
+
+void save_clustermesh(const string& filename, Mesh* mesh) {
+    // quads are split in two triangles, as for in-memory accelerators
+    auto triangles = mesh->triangle;
+    for(auto f : mesh->quad) {
+        triangles.push_back({f.x,f.y,f.z});
+        triangles.push_back({f.x,f.z,f.w});
+    }
+    auto has_norm = mesh->norm.size() == mesh->pos.size() and not mesh->pos.empty();
+    auto has_texcoord = mesh->texcoord.size() == mesh->pos.size() and not mesh->pos.empty();
+    // triangle bounds, padded as for in-memory accelerators
+    auto bboxes = vector<range3f>(triangles.size());
+    for(auto i : range(triangles.size())) {
+        auto f = triangles[i];
+        bboxes[i] = rscale(make_range3f({mesh->pos[f.x],mesh->pos[f.y],mesh->pos[f.z]}), 1+ray3f_epsilon);
+    }
+    // split the triangles in clusters, whose leaves are renumbered to reference clusters
+    auto prims = vector<int>(triangles.size());
+    for(auto i : range(prims.size())) prims[i] = i;
+    auto nodes = vector<ClusterNode>();
+    if(not prims.empty()) _clustermesh_build(nodes, prims, bboxes, 0, prims.size(), clustermesh_cluster_triangles);
+    auto cluster_ranges = vector<vec2i>();
+    for(auto& node : nodes) {
+        if(not node.leaf) continue;
+        cluster_ranges.push_back(vec2i(node.n0, node.n1));
+        node.n0 = cluster_ranges.size()-1;
+        node.n1 = cluster_ranges.size();
+    }
+
+    // write header and tables, leaving the cluster table to be filled once clusters are written
+    auto f = fopen(filename.c_str(), "wb");
+    error_if_not(f != nullptr, "cannot create file: %s\n", filename.c_str());
+    auto header = ClusterMeshHeader();
+    memcpy(header.magic, clustermesh_magic, 4);
+    header.version = clustermesh_version;
+    header.num_clusters = cluster_ranges.size();
+    header.num_nodes = nodes.size();
+    header.flags = ((has_norm) ? clustermesh_has_norm : 0) | ((has_texcoord) ? clustermesh_has_texcoord : 0);
+    header.reserved = 0;
+    auto entries = vector<ClusterMeshEntry>(cluster_ranges.size());
+    _clustermesh_write(f, &header, sizeof(header), filename);
+    _clustermesh_write(f, entries.data(), entries.size()*sizeof(ClusterMeshEntry), filename);
+    auto tables = sizeof(header) + entries.size()*sizeof(ClusterMeshEntry) + nodes.size()*sizeof(ClusterNode);
+    _clustermesh_write(f, nodes.data(), nodes.size()*sizeof(ClusterNode), filename);
+    _clustermesh_pad(f, tables, filename);
+    auto offset = (uint64_t)(tables + clustermesh_page_size - 1) / clustermesh_page_size * clustermesh_page_size;
+
+    // write clusters, each with its own vertices and bvh
+    for(auto cid : range(cluster_ranges.size())) {
+        auto range_ = cluster_ranges[cid];
+        // cluster bvh over the cluster triangles
+        auto cprims = vector<int>(range_.y-range_.x);
+        auto cbboxes = vector<range3f>(cprims.size());
+        for(auto i : range(cprims.size())) { cprims[i] = i; cbboxes[i] = bboxes[prims[range_.x+i]]; }
+        auto cnodes = vector<ClusterNode>();
+        _clustermesh_build(cnodes, cprims, cbboxes, 0, cprims.size(), clustermesh_leaf_triangles);
+        // triangles in leaf order, with vertices numbered in order of first use
+        auto vmap = std::unordered_map<int,int>();
+        auto pos = vector<vec3f>(), norm = vector<vec3f>();
+        auto texcoord = vector<vec2f>();
+        auto triangle = vector<vec3i>(cprims.size());
+        for(auto i : range(cprims.size())) {
+            auto f = triangles[prims[range_.x+cprims[i]]];
+            for(auto k : range(3)) {
+                auto it = vmap.find(f[k]);
+                if(it == vmap.end()) {
+                    it = vmap.insert(make_pair(f[k], (int)pos.size())).first;
+                    pos.push_back(mesh->pos[f[k]]);
+                    if(has_norm) norm.push_back(mesh->norm[f[k]]);
+                    if(has_texcoord) texcoord.push_back(mesh->texcoord[f[k]]);
+                }
+                triangle[i][k] = it->second;
+            }
+        }
+        auto& entry = entries[cid];
+        entry.offset = offset;
+        entry.num_verts = pos.size();
+        entry.num_triangles = triangle.size();
+        entry.num_nodes = cnodes.size();
+        _clustermesh_write(f, pos.data(), pos.size()*sizeof(vec3f), filename);
+        _clustermesh_write(f, norm.data(), norm.size()*sizeof(vec3f), filename);
+        _clustermesh_write(f, texcoord.data(), texcoord.size()*sizeof(vec2f), filename);
+        _clustermesh_write(f, triangle.data(), triangle.size()*sizeof(vec3i), filename);
+        _clustermesh_write(f, cnodes.data(), cnodes.size()*sizeof(ClusterNode), filename);
+        auto bytes = (pos.size()+norm.size())*sizeof(vec3f) + texcoord.size()*sizeof(vec2f) + triangle.size()*sizeof(vec3i) + cnodes.size()*sizeof(ClusterNode);
+        _clustermesh_pad(f, bytes, filename);
+        entry.size = (bytes + clustermesh_page_size - 1) / clustermesh_page_size * clustermesh_page_size;
+        offset += entry.size;
+    }
+
+    // fill in the cluster table
+    error_if_not(fseek(f, sizeof(header), SEEK_SET) == 0, "error writing file: %s\n", filename.c_str());
+    _clustermesh_write(f, entries.data(), entries.size()*sizeof(ClusterMeshEntry), filename);
+    fclose(f);
+}
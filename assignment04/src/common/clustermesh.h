@@ -0,0 +1,110 @@
+#ifndef _CLUSTERMESH_H_
+#define _CLUSTERMESH_H_
+
+#include "scene.h"
+#include "mapfile.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+// out-of-core mesh file for meshes larger than memory
+// triangles are grouped in spatially coherent clusters, each stored with its own vertices and
+// bvh in page-aligned blocks; the file is memory mapped and only the top-level bvh over the
+// clusters is read up front, so cluster pages are faulted in when rays first reach them
+#define clustermesh_magic "CLMS"
+#define clustermesh_version 1
+#define clustermesh_page_size 4096          // cluster alignment in the file
+#define clustermesh_cluster_triangles 2048  // max triangles per cluster
+#define clustermesh_leaf_triangles 4        // max triangles per leaf of the cluster bvh
+
+// flags of the optional vertex arrays
+#define clustermesh_has_norm 1
+#define clustermesh_has_texcoord 2
+
+// file header, followed by the top-level nodes and the cluster table
+struct ClusterMeshHeader {
+    char        magic[4];       // clustermesh_magic
+    uint32_t    version;        // clustermesh_version
+    uint32_t    num_clusters;   // number of clusters
+    uint32_t    num_nodes;      // number of top-level bvh nodes
+    uint32_t    flags;          // vertex arrays stored with the clusters
+    uint32_t    reserved;       // padding
+};
+
+// bvh node as stored in the file (top-level leaves reference clusters, cluster leaves triangles)
+struct ClusterNode {
+    range3f     bbox;           // bounding box
+    int32_t     leaf;           // leaf node
+    int32_t     n0, n1;         // for leaves: start and end primitive; for internal: left and right node
+};
+
+// cluster table entry
+struct ClusterMeshEntry {
+    uint64_t    offset;         // data offset from the start of the file (page aligned)
+    uint32_t    size;           // data size in bytes
+    uint32_t    num_verts;      // number of vertices
+    uint32_t    num_triangles;  // number of triangles (in leaf order, with cluster vertex indices)
+    uint32_t    num_nodes;      // number of cluster bvh nodes
+};
+
+// view of a cluster inside the mapped file
+struct ClusterView {
+    const vec3f*        pos = nullptr;      // vertex position
+    const vec3f*        norm = nullptr;     // vertex normal (nullptr if missing)
+    const vec2f*        texcoord = nullptr; // vertex texture coordinates (nullptr if missing)
+    const vec3i*        triangle = nullptr; // triangles
+    const ClusterNode*  nodes = nullptr;    // cluster bvh
+};
+
+struct ClusterMesh;
+
+// clusters of a scene resident in memory, kept within a memory budget by a clock sweep
+// evicted pages are released to the os and faulted in again from the file on the next access,
+// so rays still traversing an evicted cluster remain correct
+struct ClusterCache {
+    size_t                          budget = 0;     // memory budget in bytes (0 for unlimited)
+    size_t                          size = 0;       // memory of the resident clusters
+    long long                       faults = 0;     // clusters faulted in
+    long long                       evictions = 0;  // clusters evicted to fit the budget
+    vector<pair<ClusterMesh*,int>>  resident;       // resident clusters, swept by the clock hand
+    int                             hand = 0;       // clock hand
+    std::mutex                      mutex;          // guards the members above
+};
+
+// open out-of-core mesh
+struct ClusterMesh {
+    const ClusterMeshHeader*            header = nullptr;   // file header
+    const ClusterNode*                  nodes = nullptr;    // top-level bvh (leaves reference clusters)
+    const ClusterMeshEntry*             clusters = nullptr; // cluster table
+    ClusterCache*                       cache = nullptr;    // resident set (nullptr to skip accounting; evicts only with a budget)
+
+    MappedFile*                         _file = nullptr;    // file contents
+    vector<std::atomic<unsigned char>>  _state;             // per cluster: 0 evicted, 1 resident, 2 recently used
+    vector<std::atomic<unsigned char>>  _checked;           // per cluster: whether its bvh and triangles were validated
+};
+
+// make a cluster cache with a memory budget in bytes (0 for unlimited)
+ClusterCache* make_cluster_cache(size_t budget);
+
+// delete a cluster cache (meshes using it must be closed first)
+void delete_cluster_cache(ClusterCache* cache);
+
+// open an out-of-core mesh, accounting its resident clusters in cache (may be nullptr)
+// the header, top-level bvh and cluster table are validated here; the bvh and triangles of
+// each cluster are validated on its first access, so that opening does not fault in every page
+ClusterMesh* open_clustermesh(const string& filename, ClusterCache* cache);
+
+// close an out-of-core mesh, invalidating its cluster views
+void close_clustermesh(ClusterMesh* mesh);
+
+// get a cluster, marking it as recently used and evicting other clusters when over budget
+ClusterView clustermesh_cluster(ClusterMesh* mesh, int cid);
+
+// bounds of an out-of-core mesh
+inline range3f clustermesh_bbox(ClusterMesh* mesh) { return (mesh->header->num_nodes) ? mesh->nodes[0].bbox : range3f(); }
+
+// save the triangles and quads of a mesh as an out-of-core mesh
+void save_clustermesh(const string& filename, Mesh* mesh);
+
+#endif
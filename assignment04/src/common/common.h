@@ -11,6 +11,8 @@
 #include <fstream>
 #include <cstdio>
 #include <typeinfo>
+#include <functional>
+#include <thread>
 
 // bringing stand libraray objects in scope
 using std::string;
@@ -59,6 +61,11 @@ struct range {
     iterator end() { return iterator(max); }
 };
 
+// runs body(i) for each i in [0,count) on all hardware threads, each thread taking contiguous blocks
+// (runs on a persistent worker pool, since this is called at every simulation substep; the caller
+// takes blocks too, so calls may be nested; defined in taskpool.cpp)
+void parallel_for(int count, const std::function<void(int)>& body);
+
 // load a text file into a buffer
 inline string load_text_file(const char* filename) {
     auto text = string("");
@@ -0,0 +1,36 @@
+#include "compress.h"
+
+void compress_vertices(Mesh* mesh, SceneArena* arena) {
+    // curves, skinning and simulation update or read float vertices directly
+    if(not mesh->line.empty() or not mesh->spline.empty() or mesh->skinning or mesh->simulation) {
+        message("mesh vertices not compressed (curves, skinning or simulation)\n");
+        return;
+    }
+    auto compressed = arena_new<CompressedVertices>(arena);
+    // quantization bounds
+    for(auto& p : mesh->pos) compressed->bbox = runion(compressed->bbox, p);
+    auto size = compressed->bbox.max - compressed->bbox.min;
+    compressed->scale = vec3f(size.x / 65535, size.y / 65535, size.z / 65535);
+    // encode vertices in parallel
+    auto nverts = (int)mesh->pos.size();
+    compressed->pos.resize(nverts*3);
+    if(not mesh->norm.empty()) compressed->norm.resize(nverts);
+    if(not mesh->texcoord.empty()) compressed->texcoord.resize(nverts);
+    parallel_for(nverts, [mesh,compressed](int i){
+        auto p = mesh->pos[i];
+        for(auto j : range(3)) {
+            auto d = (compressed->scale[j] > 0) ? (p[j] - compressed->bbox.min[j]) / compressed->scale[j] : 0;
+            compressed->pos[i*3+j] = (uint16_t)round(clamp(d, 0.0f, 65535.0f));
+        }
+        if(not compressed->norm.empty()) compressed->norm[i] = encode_octahedral(mesh->norm[i]);
+        if(not compressed->texcoord.empty()) {
+            auto t = mesh->texcoord[i];
+            compressed->texcoord[i] = (uint32_t)float_to_half(t.x) | ((uint32_t)float_to_half(t.y) << 16);
+        }
+    });
+    // release float vertices
+    vector<vec3f>().swap(mesh->pos);
+    vector<vec3f>().swap(mesh->norm);
+    vector<vec2f>().swap(mesh->texcoord);
+    mesh->_compressed = compressed;
+}
@@ -0,0 +1,76 @@
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include "scene.h"
+#include "arena.h"
+#include "texture.h"
+
+#include <cstdint>
+
+// compressed vertex attributes of a triangle mesh, 14 bytes per vertex instead of 32
+// positions are quantized to 16 bits per axis within the mesh bounds, normals are
+// octahedral encoded in two 16 bit snorms, and texture coordinates are stored as half floats
+struct CompressedVertices {
+    range3f             bbox;       // quantization bounds
+    vec3f               scale;      // bounds extent over the quantization range
+    vector<uint16_t>    pos;        // quantized positions (3 per vertex)
+    vector<uint32_t>    norm;       // octahedral normals (empty if missing)
+    vector<uint32_t>    texcoord;   // half float texture coordinates (empty if missing)
+};
+
+// encode a unit vector with an octahedral mapping in two 16 bit snorms
+inline uint32_t encode_octahedral(const vec3f& n) {
+    auto l1 = abs(n.x) + abs(n.y) + abs(n.z);
+    auto x = (l1 > 0) ? n.x / l1 : 0, y = (l1 > 0) ? n.y / l1 : 0;
+    if(n.z < 0) {
+        auto ox = x, oy = y;
+        x = (1 - abs(oy)) * ((ox >= 0) ? 1 : -1);
+        y = (1 - abs(ox)) * ((oy >= 0) ? 1 : -1);
+    }
+    auto qx = (int16_t)round(clamp(x, -1.0f, 1.0f) * 32767);
+    auto qy = (int16_t)round(clamp(y, -1.0f, 1.0f) * 32767);
+    return (uint32_t)(uint16_t)qx | ((uint32_t)(uint16_t)qy << 16);
+}
+
+// decode an octahedral encoded unit vector
+inline vec3f decode_octahedral(uint32_t e) {
+    auto x = (int16_t)(e & 0xffff) / 32767.0f, y = (int16_t)(e >> 16) / 32767.0f;
+    auto n = vec3f(x, y, 1 - abs(x) - abs(y));
+    if(n.z < 0) {
+        n.x = (1 - abs(y)) * ((x >= 0) ? 1 : -1);
+        n.y = (1 - abs(x)) * ((y >= 0) ? 1 : -1);
+    }
+    return normalize(n);
+}
+
+// compress the vertices of a triangle mesh, releasing its float arrays
+// (meshes with curves, skinning or simulation keep their float vertices)
+void compress_vertices(Mesh* mesh, SceneArena* arena);
+
+// mesh vertex position, decoded if compressed
+inline vec3f mesh_pos(Mesh* mesh, int vid) {
+    auto c = mesh->_compressed;
+    if(not c) return mesh->pos[vid];
+    auto q = c->pos.data() + 3*vid;
+    return vec3f(c->bbox.min.x + q[0]*c->scale.x, c->bbox.min.y + q[1]*c->scale.y, c->bbox.min.z + q[2]*c->scale.z);
+}
+
+// mesh vertex normal, decoded if compressed
+inline vec3f mesh_norm(Mesh* mesh, int vid) {
+    if(not mesh->_compressed) return mesh->norm[vid];
+    return decode_octahedral(mesh->_compressed->norm[vid]);
+}
+
+// whether the mesh has texture coordinates
+inline bool mesh_has_texcoord(Mesh* mesh) {
+    return (mesh->_compressed) ? not mesh->_compressed->texcoord.empty() : not mesh->texcoord.empty();
+}
+
+// mesh vertex texture coordinates, decoded if compressed
+inline vec2f mesh_texcoord(Mesh* mesh, int vid) {
+    if(not mesh->_compressed) return mesh->texcoord[vid];
+    auto e = mesh->_compressed->texcoord[vid];
+    return vec2f(half_to_float(e & 0xffff), half_to_float(e >> 16));
+}
+
+#endif
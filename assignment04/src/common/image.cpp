@@ -1,145 +1,132 @@
 #include "image.h"
+#include "mapfile.h"
 #include "lodepng.h"
 
-static void _read_pnm(const string& filename, char& type,
-               int& width, int& height, int& nc,
-               float& scale, unsigned char*& buffer) {
-    char identifier[4]; 
-    bool ascii = false;
-    
-    FILE *f = fopen(filename.c_str(), "rb");
-    if (f == 0) {
-        error_if_not(f != 0, "failed to open image file %s", filename.c_str());
-        nc = width = height = 0;
-        buffer = nullptr;
-        return;
+#include <cctype>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef USE_ZLIB
+#include <zlib.h>
+// minimum number of rows deflated together when writing png images
+#define png_block_rows 32
+#endif
+
+// read the next whitespace separated token of a pnm header, skipping comments
+static bool _pnm_token(const MappedFile* file, size_t& pos, string& token) {
+    while(pos < file->size) {
+        if(file->data[pos] == '#') { while(pos < file->size and file->data[pos] != '\n') pos ++; }
+        else if(isspace(file->data[pos])) pos ++;
+        else break;
     }
-    
-    error_if_not(fscanf(f, "%s", identifier) == 1, "error reading image file");
-    string id = identifier;
-    
-    if("Pf" == id) { nc = 1; ascii = false; type = 'f'; }
-    else if ("PF"  == id) { nc = 3; ascii = false; type = 'f'; }
-    else if ("P2"  == id) { nc = 1; ascii = true; type = 'B'; }
-    else if ("P3"  == id) { nc = 3; ascii = true; type = 'B'; }
-    else if ("P5"  == id) { nc = 1; ascii = false; type = 'B'; }
-    else if ("P6"  == id) { nc = 3; ascii = false; type = 'B'; }
-    else {	error("unknown image format"); }
-    
-    error_if_not(fscanf(f, "%d%d\n", &width, &height) == 2, "error reading image file %s", filename.c_str());
-    if(type == 'B') { 
-        buffer = new unsigned char[width*height*nc]; 
-        int maxv;
-        error_if_not(fscanf(f, "%d\n", &maxv) == 1, "error reading image file %s", filename.c_str());
-        error_if_not(maxv == 255, "unsupported max value");
-        scale = 1.0f / maxv;
-        if(!ascii) {
-            int bread = (int)fread(buffer, sizeof(unsigned char), width*height*nc, f);
-            error_if_not(bread == width*height*nc, "error reading image file %s", filename.c_str());
-        } else {
-            unsigned char* buf = (unsigned char*)buffer;
-            for(int i = 0; i < width*height*nc; i ++) {
-                int v;
-                error_if_not(fscanf(f, "%d", &v) == 1, "error reading image file %s", filename.c_str());
-                buf[i] = (unsigned char)v;
-            }
-        }
-    } else if(type == 'f') { 
-        buffer = (unsigned char*)(new float[width*height*nc]);
-        char scale_string[16];
-        error_if_not(fgets(scale_string, 16, f) == scale_string, "error reading with fgets, file %s", filename.c_str());
-        sscanf(scale_string, "%f\n", &scale);
-        error_if_not(scale < 0, "only support little endian pfm");
-        scale = abs(scale);
-        // flip y while reading
-        for(int j = height-1; j >= 0; j --) {
-            float* buf = (float*)buffer;
-            int bytes = (int)fread(buf + (j*width*nc), sizeof(float), width*nc, f);
-            error_if_not(bytes == width*nc, "error reading image file");
-        }
-    } else error("unknown type");
-    
-    fclose(f);
+    token.clear();
+    while(pos < file->size and not isspace(file->data[pos])) token.push_back(file->data[pos++]);
+    return not token.empty();
+}
+
+// read the next value of an ascii pnm
+static int _pnm_ascii_value(const MappedFile* file, size_t& pos) {
+    while(pos < file->size and isspace(file->data[pos])) pos ++;
+    error_if_not(pos < file->size and isdigit(file->data[pos]), "error reading image file");
+    auto v = 0;
+    while(pos < file->size and isdigit(file->data[pos])) v = v*10 + (file->data[pos++] - '0');
+    return v;
 }
 
 image3f read_pnm(const string& filename, bool flipY) {
-    int width, height, nc; float scale; unsigned char* buffer; char type;
-    _read_pnm(filename, type, width, height, nc, scale, buffer);
-    if (not buffer) {
-        error_if_not(false, "failed to load image file %s", filename.c_str());
+    // map the file
+    auto file = open_mapped_file(filename);
+    if (not file) {
+        error_if_not(false, "failed to open image file %s", filename.c_str());
         return image3f();
     }
-    error_if_not(nc == 3 && (type == 'f' || type == 'B'), "unsupported image format in file %s", filename.c_str());
     
+    // parse the header once (binary data starts after a single whitespace)
+    auto pos = (size_t)0;
+    auto magic = string(), width_token = string(), height_token = string(), scale_token = string();
+    error_if_not(_pnm_token(file, pos, magic) and _pnm_token(file, pos, width_token) and
+                 _pnm_token(file, pos, height_token) and _pnm_token(file, pos, scale_token),
+                 "error reading image file %s", filename.c_str());
+    error_if_not(magic == "PF" or magic == "P6" or magic == "P3", "unsupported image format in file %s", filename.c_str());
+    auto width = atoi(width_token.c_str()), height = atoi(height_token.c_str());
+    auto scale = (float)atof(scale_token.c_str());
+    pos ++;
+    // validate the size against the file (ascii values take at least one byte each)
+    error_if_not(width > 0 and height > 0, "bad image size in file %s", filename.c_str());
+    auto value_size = (magic == "PF") ? sizeof(float) : (size_t)1;
+    error_if_not(pos <= file->size and (size_t)width*height*3*value_size <= file->size - pos, "error reading image file %s", filename.c_str());
+    
+    // convert rows in parallel directly into the image, flipping them in place
     image3f img(width,height);
-    if(type == 'f') {
-        float* buf = (float*)buffer;
-        for(int i = 0; i < img.width()*img.height(); i ++) {
-            img.data()[i] = vec3f(buf[i*3+0],buf[i*3+1],buf[i*3+2]) * scale;
+    if(magic == "PF") {
+        error_if_not(scale < 0, "only support little endian pfm");
+        scale = abs(scale);
+        // pfm rows are stored bottom to top
+        parallel_for(height, [&](int j){
+            auto row = &img.at(0, (flipY) ? j : height-1-j);
+            memcpy(row, file->data + pos + (size_t)j*width*3*sizeof(float), width*3*sizeof(float));
+            for(auto i : range(width)) row[i] = row[i] * scale;
+        });
+    } else if(magic == "P6") {
+        error_if_not(scale == 255, "unsupported max value");
+        scale = 1.0f / scale;
+        parallel_for(height, [&](int j){
+            auto row = &img.at(0, (flipY) ? height-1-j : j);
+            auto buf = file->data + pos + (size_t)j*width*3;
+            for(auto i : range(width)) row[i] = vec3f((float)buf[i*3+0],(float)buf[i*3+1],(float)buf[i*3+2]) * scale;
+        });
+    } else {
+        // ascii values are parsed serially, since their offsets are not known in advance
+        error_if_not(scale == 255, "unsupported max value");
+        scale = 1.0f / scale;
+        pos --;
+        for(auto j : range(height)) {
+            auto row = &img.at(0, (flipY) ? height-1-j : j);
+            for(auto i : range(width)) {
+                auto r = _pnm_ascii_value(file, pos), g = _pnm_ascii_value(file, pos), b = _pnm_ascii_value(file, pos);
+                row[i] = vec3f((float)r,(float)g,(float)b) * scale;
+            }
         }
-    } else if(type == 'B') {
-        unsigned char* buf = (unsigned char*)buffer;
-        for(int i = 0; i < img.width()*img.height(); i ++) {
-            img.data()[i] = vec3f((float)buf[i*3+0],(float)buf[i*3+1],(float)buf[i*3+2]) * scale;
-        }        
     }
-    if (buffer) delete [] buffer;
-    
-    if(flipY) img = img.flipy();
     
+    close_mapped_file(file);
     return img;
 }
 
-static void _write_pnm(const char *filename, char type,
-                         int width, int height, int nc,
-                         bool ascii, unsigned char* buffer) {
-    FILE *f = fopen(filename, "wb");
-    error_if_not(f != 0, "failed to create image file %s", filename);
-    
-    string magic; 
-    int scale = -1; 
-    int ds = 0;
-    if(type == 'f' && nc == 1 && !ascii) { magic = "Pf"; scale = -1; 
-        ds = sizeof(float); }
-    else if(type == 'f' && nc == 3 && !ascii) { magic = "PF"; scale = -1; 
-        ds = sizeof(float); }
-    else if(type == 'B' && nc == 1 && !ascii) { magic = "P5"; scale = 255; 
-        ds = sizeof(unsigned char); }
-    else if(type == 'B' && nc == 3 && !ascii) { magic = "P6"; scale = 255; 
-        ds = sizeof(unsigned char); }
-    else if(type == 'B' && nc == 1 && ascii) { magic = "P2"; scale = 255; 
-        ds = sizeof(unsigned char); }
-    else if(type == 'B' && nc == 3 && ascii) { magic = "P3"; scale = 255; 
-        ds = sizeof(unsigned char); }
-    else error("unsupported image format");
-    
-    error_if_not(fprintf(f, "%s\n", magic.c_str()) > 0, "error writing file %s", filename);
-    error_if_not(fprintf(f, "%d %d\n", width, height) > 0, "error writing file %s", filename);
-    error_if_not(fprintf(f, "%d\n", scale) > 0, "error writing file %s", filename);
-    
-    if(!ascii) {
-        if(type == 'f') {
-            for(int j = height-1; j >= 0; j --) {
-                float* buf = (float*)buffer;
-                error_if_not((int)fwrite(buf + j*width*nc, ds, width*nc, f) == width*nc, "error writing file %s", filename);
-            }
-        } else {
-            error_if_not((int)fwrite(buffer, ds, width*height*nc, f) == width*height*nc, "error writing file %s", filename);
-        }
-    } else {
-        unsigned char* buf = (unsigned char*)buffer;
-        for(int i = 0; i < width*height*nc; i ++) {
-            int v = buf[i];
-            error_if_not(fprintf(f, "%d \n", v) != 0, "error writing file %s", filename);
-        }
+void write_pfm(const string& filename, const image3f& img, bool flipY) {
+    FILE *f = fopen(filename.c_str(), "wb");
+    error_if_not(f != 0, "failed to create image file %s", filename.c_str());
+    // stream rows straight from the image through a large buffer (pfm rows are stored bottom to top)
+    setvbuf(f, nullptr, _IOFBF, 1 << 20);
+    error_if_not(fprintf(f, "PF\n%d %d\n%d\n", img.width(), img.height(), -1) > 0, "error writing file %s", filename.c_str());
+    for(auto j : range(img.height())) {
+        auto row = &img.at(0, (flipY) ? j : img.height()-1-j);
+        error_if_not((int)fwrite(row, sizeof(float), img.width()*3, f) == img.width()*3, "error writing file %s", filename.c_str());
     }
-    
-	fclose(f);
+    fclose(f);
 }
 
-void write_pfm(const string& filename, const image3f& img, bool flipY) {
-    _write_pnm(filename.c_str(), 'f', img.width(), img.height(), 3, false,
-               (flipY)?(unsigned char*)img.flipy().data():(unsigned char*)img.data());
+vector<image3f> make_mipmap(const image3f& img) {
+    auto mipmap = vector<image3f>();
+    auto prev = img;
+    while(prev.width() > 1 or prev.height() > 1) {
+        // halve each size, averaging 2x2 blocks (odd sizes reuse the last row or column)
+        auto w = max(1,prev.width()/2), h = max(1,prev.height()/2);
+        auto level = image3f(w,h);
+        for(int j = 0; j < h; j ++) {
+            for(int i = 0; i < w; i ++) {
+                auto i0 = min(2*i,prev.width()-1), i1 = min(2*i+1,prev.width()-1);
+                auto j0 = min(2*j,prev.height()-1), j1 = min(2*j+1,prev.height()-1);
+                level.at(i,j) = (prev.at(i0,j0)+prev.at(i1,j0)+prev.at(i0,j1)+prev.at(i1,j1))/4;
+            }
+        }
+        mipmap.push_back(level);
+        prev = level;
+    }
+    return mipmap;
 }
 
 image3f read_png(const string& filename, bool flipY) {
@@ -164,18 +151,131 @@ image3f read_png(const string& filename, bool flipY) {
     return img;
 }
 
+// convert a row of colors to 8-bit rgb, clamping and truncating each channel
+static void _write_png_row(const vec3f* src, unsigned char* dst, int width) {
+    auto i = 0;
+#ifdef __SSE2__
+    // four pixels (twelve channels) at a time
+    auto zero = _mm_setzero_ps(), one = _mm_set1_ps(255.0f);
+    for(; i + 4 <= width; i += 4) {
+        auto f = (const float*)(src + i);
+        auto c0 = _mm_cvttps_epi32(_mm_min_ps(one, _mm_max_ps(zero, _mm_mul_ps(_mm_loadu_ps(f+0), one))));
+        auto c1 = _mm_cvttps_epi32(_mm_min_ps(one, _mm_max_ps(zero, _mm_mul_ps(_mm_loadu_ps(f+4), one))));
+        auto c2 = _mm_cvttps_epi32(_mm_min_ps(one, _mm_max_ps(zero, _mm_mul_ps(_mm_loadu_ps(f+8), one))));
+        auto c = _mm_packus_epi16(_mm_packs_epi32(c0, c1), _mm_packs_epi32(c2, c2));
+        unsigned char bytes[16];
+        _mm_storeu_si128((__m128i*)bytes, c);
+        memcpy(dst + i*3, bytes, 12);
+    }
+#endif
+    for(; i < width; i ++) {
+        dst[i*3+0] = (unsigned char)clamp(src[i].x * 255, 0.0f, 255.0f);
+        dst[i*3+1] = (unsigned char)clamp(src[i].y * 255, 0.0f, 255.0f);
+        dst[i*3+2] = (unsigned char)clamp(src[i].z * 255, 0.0f, 255.0f);
+    }
+}
+
+#ifdef USE_ZLIB
+// png paeth predictor
+static unsigned char _png_paeth(int a, int b, int c) {
+    auto p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    return (pa <= pb and pa <= pc) ? a : (pb <= pc) ? b : c;
+}
+
+// filter a row (prev is zeros for the first one), picking the filter with the smallest sum of residuals
+// filtered holds scratch space for the five candidate filterings
+static void _png_filter_row(const unsigned char* row, const unsigned char* prev, unsigned char* out, int size, unsigned char* filtered) {
+    auto none = filtered, sub = filtered + size, up = filtered + 2*size, average = filtered + 3*size, paeth = filtered + 4*size;
+    for(auto i : range(size)) {
+        int a = (i >= 3) ? row[i-3] : 0, b = prev[i], c = (i >= 3) ? prev[i-3] : 0;
+        none[i] = row[i];
+        sub[i] = row[i] - a;
+        up[i] = row[i] - b;
+        average[i] = row[i] - (a + b) / 2;
+        paeth[i] = row[i] - _png_paeth(a, b, c);
+    }
+    auto best = 0; auto best_sum = -1L;
+    for(auto type : range(5)) {
+        auto sum = 0L;
+        for(auto i : range(size)) sum += (filtered[type*size+i] < 128) ? filtered[type*size+i] : 256 - filtered[type*size+i];
+        if(best_sum < 0 or sum < best_sum) { best = type; best_sum = sum; }
+    }
+    out[0] = (unsigned char)best;
+    memcpy(out + 1, filtered + best*size, size);
+}
+
+// append a png chunk
+static void _png_chunk(vector<unsigned char>& png, const char* type, const unsigned char* data, size_t size) {
+    auto be32 = [&png](uLong v) { for(auto shift : {24,16,8,0}) png.push_back((unsigned char)(v >> shift)); };
+    be32(size);
+    auto start = png.size();
+    png.insert(png.end(), type, type + 4);
+    png.insert(png.end(), data, data + size);
+    be32(crc32(0, png.data() + start, png.size() - start));
+}
+#endif
+
 void write_png(const string& filename, const image3f& img, bool flipY) {
-    vector<unsigned char> img_png(img.width()*img.height()*4);
-    for(int x = 0; x < img.width(); x++ ) {
-        for( int y = 0; y < img.height(); y++ ) {
-            int i_img = y * img.width() + x;
-            int i_png = ( ( flipY ? (img.height()-1-y) : y ) * img.width() + x ) * 4;
-            img_png[i_png+0] = (unsigned char)clamp(img.data()[i_img].x * 255, 0.0f, 255.0f);
-            img_png[i_png+1] = (unsigned char)clamp(img.data()[i_img].y * 255, 0.0f, 255.0f);
-            img_png[i_png+2] = (unsigned char)clamp(img.data()[i_img].z * 255, 0.0f, 255.0f);
-            img_png[i_png+3] = 255;
+    auto width = img.width(), height = img.height();
+    // convert rows in parallel
+    auto rgb = vector<unsigned char>((size_t)width*height*3);
+    parallel_for(height, [&](int j){
+        _write_png_row(&img.at(0, flipY ? height-1-j : j), rgb.data() + (size_t)j*width*3, width);
+    });
+#ifdef USE_ZLIB
+    // filter and deflate blocks of rows independently in parallel; each block but the last ends
+    // with a full flush, so that the blocks concatenate into a single zlib stream
+    auto row_size = width*3;
+    auto rows_per_block = max(png_block_rows, (height + 15) / 16);
+    // always deflate at least one block, so that an empty image still ends with a final block
+    auto nblocks = max(1, (height + rows_per_block - 1) / rows_per_block);
+    auto blocks = vector<vector<unsigned char>>(nblocks);
+    auto adlers = vector<uLong>(nblocks);
+    parallel_for(nblocks, [&](int b){
+        auto j0 = b*rows_per_block, j1 = min(height, j0+rows_per_block);
+        auto filtered = vector<unsigned char>((size_t)(j1-j0)*(row_size+1));
+        auto zeros = vector<unsigned char>(row_size, 0), scratch = vector<unsigned char>(5*row_size);
+        for(auto j : range(j0,j1)) {
+            _png_filter_row(rgb.data() + (size_t)j*row_size, (j) ? rgb.data() + (size_t)(j-1)*row_size : zeros.data(),
+                            filtered.data() + (size_t)(j-j0)*(row_size+1), row_size, scratch.data());
         }
+        adlers[b] = adler32(adler32(0, nullptr, 0), filtered.data(), filtered.size());
+        z_stream stream; memset(&stream, 0, sizeof(stream));
+        error_if_not(deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK, "cannot compress png image\n");
+        blocks[b].resize(deflateBound(&stream, filtered.size()) + 16);
+        stream.next_in = filtered.data(); stream.avail_in = filtered.size();
+        stream.next_out = blocks[b].data(); stream.avail_out = blocks[b].size();
+        auto ret = deflate(&stream, (b == nblocks-1) ? Z_FINISH : Z_FULL_FLUSH);
+        error_if_not(ret == ((b == nblocks-1) ? Z_STREAM_END : Z_OK) and stream.avail_in == 0, "cannot compress png image\n");
+        blocks[b].resize(blocks[b].size() - stream.avail_out);
+        deflateEnd(&stream);
+    });
+    // zlib stream: header, deflated blocks and checksum
+    auto zdata = vector<unsigned char>({ 0x78, 0x9c });
+    auto adler = adler32(0, nullptr, 0);
+    for(auto b : range(nblocks)) {
+        zdata.insert(zdata.end(), blocks[b].begin(), blocks[b].end());
+        auto block_size = min(height, (b+1)*rows_per_block) - b*rows_per_block;
+        adler = adler32_combine(adler, adlers[b], (z_off_t)block_size*(row_size+1));
     }
-    unsigned error = lodepng::encode(filename, img_png, img.width(), img.height());
+    for(auto shift : {24,16,8,0}) zdata.push_back((unsigned char)(adler >> shift));
+    // png file: signature, header, data and end chunks
+    auto png = vector<unsigned char>({ 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' });
+    unsigned char header[13] = { (unsigned char)(width >> 24), (unsigned char)(width >> 16), (unsigned char)(width >> 8), (unsigned char)width,
+                                 (unsigned char)(height >> 24), (unsigned char)(height >> 16), (unsigned char)(height >> 8), (unsigned char)height,
+                                 8, 2, 0, 0, 0 };
+    _png_chunk(png, "IHDR", header, 13);
+    _png_chunk(png, "IDAT", zdata.data(), zdata.size());
+    _png_chunk(png, "IEND", nullptr, 0);
+    auto f = fopen(filename.c_str(), "wb");
+    error_if_not(f and fwrite(png.data(), 1, png.size(), f) == png.size(), "cannot write png image: %s", filename.c_str());
+    if(f) fclose(f);
+#else
+    unsigned error = lodepng::encode(filename, rgb, width, height, LCT_RGB);
     error_if_not(not error, "cannot write png image: %s", filename.c_str());
+#endif
+}
+
+void write_png_async(TaskPool* pool, const string& filename, const image3f& img, bool flipY) {
+    taskpool_run(pool, [filename,img,flipY](){ write_png(filename, img, flipY); });
 }
@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "vmath.h"
+#include "taskpool.h"
 
 // A generic image
 struct image3f {
@@ -70,8 +71,13 @@ private:
 
 // Write an floating point color PFM image file
 void write_pfm(const string& filename, const image3f& img, bool flipY = false);
-// Write an 8-bit color compressed PNG file (sets PNG alpha to 1 everywhere)
+// Write an 8-bit color compressed PNG file (rows are converted and, with zlib, compressed in parallel)
 void write_png(const string& filename, const image3f& img, bool flipY = false);
+// Write a PNG file in a task of pool, so that the caller can continue (e.g. rendering the next frame)
+void write_png_async(TaskPool* pool, const string& filename, const image3f& img, bool flipY = false);
+
+// Build the mip chain of an image by repeated 2x2 box filtering (from half resolution down to 1x1)
+vector<image3f> make_mipmap(const image3f& img);
 
 // Load a PFM or PPM color image and return it as a floating point color image
 image3f read_pnm(const string& filename, bool flipY);
@@ -1,11 +1,20 @@
 #include "scene.h"
 #include "intersect.h"
+#include "animation.h"
+#include "tesselation.h"
+#include "clustermesh.h"
+#include "compress.h"
 
 #include <algorithm>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 
 #define BVHAccelerator_min_prims 4
 #define BVHAccelerator_epsilon ray3f_epsilon
 #define BVHAccelerator_build_maxaxis false
+#define BVHAccelerator_motion_samples 16
 
 // bvh accelerator node
 struct BVHNode {
@@ -28,6 +37,30 @@ struct BVHAccelerator {
     vector<BVHNode> nodes;  // bvh nodes
 };
 
+// catmull-clark refined face: triangles of the face and their own bvh
+struct SubdivisionPatch {
+    vector<vec3f>   pos;            // vertex position
+    vector<vec3f>   norm;           // vertex normal
+    vector<vec3i>   triangle;       // triangle
+    BVHAccelerator* bvh = nullptr;  // bvh accelerator over the patch triangles
+    
+    ~SubdivisionPatch() { if(bvh) delete bvh; }
+};
+
+// lazily refined faces of a catmull-clark mesh, kept in a bounded lru cache
+// shared by all rendering threads
+struct SubdivisionCache {
+    Mesh*               base = nullptr;     // control quads (the mesh, made of quads by one eager level if needed)
+    vector<vector<int>> vertex_faces;       // quads around each vertex
+    int                 level = 0;          // refinement level of the faces (shared, so that patches meet without cracks)
+    int                 max_triangles = 0;  // cache budget in triangles
+    
+    std::mutex          mutex;              // guards the entries below
+    std::list<int>      lru;                // resident faces, most recently used first
+    std::unordered_map<int,pair<std::shared_ptr<SubdivisionPatch>,std::list<int>::iterator>> patches; // resident patches
+    int                 num_triangles = 0;  // resident triangles
+};
+
 // split the list of nodes according to a policy
 int make_accelerator_split(vector<pair<range3f,int>>& boxed_prims, int start, int end, const range3f& bbox, bool maxaxis) {
     auto axis = 0;
@@ -169,6 +202,109 @@ inline bool intersect_quad(const ray3f& ray, float radius) {
     float t; vec3f p; return intersect_quad(ray, radius, t, p);
 }
 
+// split a cubic bezier segment in half (de casteljau)
+inline void split_bezier(const vec3f* cp, vec3f* left, vec3f* right) {
+    auto p01 = (cp[0]+cp[1])/2, p12 = (cp[1]+cp[2])/2, p23 = (cp[2]+cp[3])/2;
+    auto p012 = (p01+p12)/2, p123 = (p12+p23)/2;
+    auto mid = (p012+p123)/2;
+    left[0] = cp[0]; left[1] = p01; left[2] = p012; left[3] = mid;
+    right[0] = mid; right[1] = p123; right[2] = p23; right[3] = cp[3];
+}
+
+// intersect a tube of radius r around a cubic bezier segment given in ray space
+// (the ray starts at the origin and goes along +z); the curve is split recursively
+// and each flat enough piece is treated as a straight segment
+bool intersect_curve(const vec3f* cp, float r, float zmin, float zmax, int depth,
+                     float u0, float u1, float& z, float& u, vec3f& n) {
+    // cull against the control point bounds grown by the radius
+    auto bbox = make_range3f({cp[0],cp[1],cp[2],cp[3]});
+    if(bbox.min.x > r or bbox.max.x < -r or bbox.min.y > r or bbox.max.y < -r) return false;
+    if(bbox.min.z > zmax+r or bbox.max.z < zmin-r) return false;
+    // recursively intersect the two halves, shortening the ray after the first hit
+    if(depth > 0) {
+        vec3f left[4], right[4];
+        split_bezier(cp, left, right);
+        auto um = (u0+u1)/2;
+        auto hit = intersect_curve(left, r, zmin, zmax, depth-1, u0, um, z, u, n);
+        if(hit) zmax = z;
+        return intersect_curve(right, r, zmin, zmax, depth-1, um, u1, z, u, n) or hit;
+    }
+    // closest point to the ray on the segment, in projection
+    auto dx = cp[3].x-cp[0].x, dy = cp[3].y-cp[0].y;
+    auto dd = dx*dx+dy*dy;
+    auto w = (dd > 0) ? clamp(-(cp[0].x*dx+cp[0].y*dy)/dd, 0.0f, 1.0f) : 0.0f;
+    auto pc = cp[0]*(1-w)+cp[3]*w;
+    auto dist2 = pc.x*pc.x+pc.y*pc.y;
+    if(dist2 > r*r) return false;
+    // hit the front of the tube
+    auto h = sqrt(r*r-dist2);
+    if(pc.z-h < zmin or pc.z-h > zmax) return false;
+    z = pc.z-h;
+    u = u0*(1-w)+u1*w;
+    n = vec3f(-pc.x,-pc.y,-h)/r;
+    return true;
+}
+
+// grab the cubic control points of a mesh curve (lines are treated as straight cubics)
+// and the vertex indices of its endpoints
+inline void mesh_curve(Mesh* mesh, int cid, vec3f* cp, vec2i& ends) {
+    if(cid < (int)mesh->line.size()) {
+        auto l = mesh->line[cid];
+        auto p0 = mesh->pos[l.x], p1 = mesh->pos[l.y];
+        cp[0] = p0; cp[1] = p0*(2.0f/3)+p1*(1.0f/3); cp[2] = p0*(1.0f/3)+p1*(2.0f/3); cp[3] = p1;
+        ends = l;
+    } else {
+        auto s = mesh->spline[cid-mesh->line.size()];
+        for(auto i : range(4)) cp[i] = mesh->pos[s[i]];
+        ends = {s.x,s.w};
+    }
+}
+
+// bounds of a mesh curve
+inline range3f mesh_curve_bbox(Mesh* mesh, int cid) {
+    vec3f cp[4]; vec2i ends;
+    mesh_curve(mesh, cid, cp, ends);
+    auto bbox = make_range3f({cp[0],cp[1],cp[2],cp[3]});
+    return range3f(bbox.min-one3f*mesh->curve_radius, bbox.max+one3f*mesh->curve_radius);
+}
+
+// intersect a mesh curve in the mesh local frame
+intersection3f intersect_mesh_curve(Mesh* mesh, int cid, const ray3f& tray) {
+    // grab control points and move them into ray space
+    vec3f cp[4]; vec2i ends;
+    mesh_curve(mesh, cid, cp, ends);
+    auto dlen = length(tray.d);
+    auto rframe = frame_from_z(tray.d); rframe.o = tray.e;
+    for(auto i : range(4)) cp[i] = transform_point_inverse(rframe, cp[i]);
+    // pick the subdivision depth from the curve flatness
+    auto r = mesh->curve_radius;
+    auto l0 = 0.0f;
+    for(auto i : range(2)) l0 = max(l0, max(abs(cp[i].x-2*cp[i+1].x+cp[i+2].x), abs(cp[i].y-2*cp[i+1].y+cp[i+2].y)));
+    auto depth = (l0 > 0) ? clamp((int)round(log2(1.41421356f*6*l0/(8*r*0.05f))/2), 0, 10) : 0;
+    // intersect curve
+    auto z = 0.0f, u = 0.0f; auto n = zero3f;
+    if(not intersect_curve(cp, r, tray.tmin*dlen, tray.tmax*dlen, depth, 0, 1, z, u, n)) return intersection3f();
+    // set up intersection in the mesh frame
+    auto intersection = intersection3f();
+    intersection.hit = true;
+    intersection.ray_t = z/dlen;
+    intersection.pos = tray.eval(intersection.ray_t);
+    intersection.norm = transform_normal(rframe, n);
+    if(mesh->texcoord.empty()) intersection.texcoord = {u,0};
+    else intersection.texcoord = mesh->texcoord[ends.x]*(1-u)+mesh->texcoord[ends.y]*u;
+    intersection.mat = mesh->mat;
+    return intersection;
+}
+
+// texcoord area per unit of surface area of a mesh triangle (used for texture filtering)
+inline float mesh_texcoord_density(Mesh* mesh, const vec3i& f) {
+    if(not mesh_has_texcoord(mesh)) return 0;
+    auto t0 = mesh_texcoord(mesh, f.x), t1 = mesh_texcoord(mesh, f.y), t2 = mesh_texcoord(mesh, f.z);
+    auto uvarea = abs((t1.x-t0.x)*(t2.y-t0.y)-(t2.x-t0.x)*(t1.y-t0.y));
+    auto area = length(cross(mesh_pos(mesh, f.y)-mesh_pos(mesh, f.x), mesh_pos(mesh, f.z)-mesh_pos(mesh, f.x)));
+    return (area > 0) ? uvarea / area : 0;
+}
+
 // intersect an accelerator
 template<typename intersect_func>
 intersection3f intersect(BVHAccelerator* bvh, int nodeid, const ray3f& ray,
@@ -224,28 +360,357 @@ bool intersect_shadow(BVHAccelerator* bvh, int nodeid, const ray3f& ray,
     return false;
 }
 
-// build accelerator
-BVHAccelerator* make_accelerator(vector<range3f>& bboxes) {
+// build accelerator (owned by arena if given)
+BVHAccelerator* make_accelerator(vector<range3f>& bboxes, SceneArena* arena = nullptr) {
     vector<pair<range3f,int>> boxed_prims(bboxes.size());
     for(auto i : range(bboxes.size())) boxed_prims[i] = pair<range3f,int>(rscale(bboxes[i],1+BVHAccelerator_epsilon),i);
-    auto bvh = new BVHAccelerator();
+    auto bvh = (arena) ? arena_new<BVHAccelerator>(arena) : new BVHAccelerator();
     bvh->nodes.push_back(BVHNode());
     make_accelerator_node(0, boxed_prims, bvh->nodes, 0, bboxes.size());
-    bvh->prims.reserve(bboxes.size());
+    bvh->prims.resize(bboxes.size());
     for(auto i : range(boxed_prims.size())) bvh->prims[i] = boxed_prims[i].second;
     return bvh;
 }
 
+// intersect a triangle of a list of vertex positions and normals
+inline intersection3f intersect_triangle(const vector<vec3f>& pos, const vector<vec3f>& norm, const vec3i& triangle, const ray3f& tray) {
+    // intersect triangle
+    auto t = 0.0f, u = 0.0f, v = 0.0f;
+    if(not intersect_triangle(tray, pos[triangle.x], pos[triangle.y], pos[triangle.z], t, u, v)) return intersection3f();
+    // set up intersection
+    auto intersection = intersection3f();
+    intersection.hit = true;
+    intersection.ray_t = t;
+    intersection.pos = tray.eval(t);
+    intersection.norm = normalize(norm[triangle.x]*u+norm[triangle.y]*v+norm[triangle.z]*(1-u-v));
+    intersection.texcoord = zero2f;
+    return intersection;
+}
+
+// get the refined patch of a face, refining it on first use and evicting
+// the least recently used patches when over budget
+std::shared_ptr<SubdivisionPatch> subdivision_patch(Mesh* mesh, int fid) {
+    auto cache = mesh->_subdiv_cache;
+    // look up the patch and mark it as recently used
+    {
+        std::lock_guard<std::mutex> lock(cache->mutex);
+        auto it = cache->patches.find(fid);
+        if(it != cache->patches.end()) {
+            cache->lru.splice(cache->lru.begin(), cache->lru, it->second.second);
+            return it->second.first;
+        }
+    }
+    // refine the face outside the lock
+    auto refined = subdivide_catmullclark_face(cache->base, cache->vertex_faces, fid, cache->level);
+    auto patch = std::make_shared<SubdivisionPatch>();
+    patch->pos = refined->pos;
+    patch->norm = refined->norm;
+    for(auto f : refined->quad) {
+        patch->triangle.push_back({f.x,f.y,f.z});
+        patch->triangle.push_back({f.x,f.z,f.w});
+    }
+    delete refined;
+    // make the patch accelerator
+    if(patch->triangle.size() > BVHAccelerator_min_prims) {
+        auto bboxes = vector<range3f>(patch->triangle.size());
+        for(auto i : range(patch->triangle.size())) {
+            auto f = patch->triangle[i];
+            bboxes[i] = make_range3f({patch->pos[f.x],patch->pos[f.y],patch->pos[f.z]});
+        }
+        patch->bvh = make_accelerator(bboxes);
+    }
+    // insert the patch, unless another thread refined it in the meantime
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    auto it = cache->patches.find(fid);
+    if(it != cache->patches.end()) {
+        cache->lru.splice(cache->lru.begin(), cache->lru, it->second.second);
+        return it->second.first;
+    }
+    cache->lru.push_front(fid);
+    cache->patches[fid] = make_pair(patch, cache->lru.begin());
+    cache->num_triangles += patch->triangle.size();
+    // evict least recently used patches (threads still using them keep them alive)
+    while(cache->num_triangles > cache->max_triangles and cache->lru.size() > 1) {
+        auto old = cache->lru.back();
+        cache->num_triangles -= cache->patches[old].first->triangle.size();
+        cache->patches.erase(old);
+        cache->lru.pop_back();
+    }
+    return patch;
+}
+
+// intersect a lazily subdivided face in the mesh local frame
+intersection3f intersect_subdivision_patch(Mesh* mesh, int fid, const ray3f& tray) {
+    // grab the refined face
+    auto patch = subdivision_patch(mesh, fid);
+    auto intersection = intersection3f();
+    // intersect its triangles
+    if(patch->bvh) {
+        intersection = intersect(patch->bvh, 0, tray, [&patch](int tid, ray3f tray){
+            return intersect_triangle(patch->pos, patch->norm, patch->triangle[tid], tray); });
+    } else {
+        auto sray = tray;
+        for(auto& triangle : patch->triangle) {
+            auto sintersection = intersect_triangle(patch->pos, patch->norm, triangle, sray);
+            if(not sintersection.hit) continue;
+            intersection = sintersection;
+            sray.tmax = intersection.ray_t;
+        }
+    }
+    intersection.mat = mesh->mat;
+    return intersection;
+}
+
+// intersect a lazily subdivided face in the mesh local frame without returning values
+bool intersect_subdivision_patch_shadow(Mesh* mesh, int fid, const ray3f& tray) {
+    // grab the refined face
+    auto patch = subdivision_patch(mesh, fid);
+    // intersect its triangles
+    if(patch->bvh) {
+        return intersect_shadow(patch->bvh, 0, tray, [&patch](int tid, ray3f tray){
+            auto f = patch->triangle[tid];
+            return intersect_triangle(tray, patch->pos[f.x], patch->pos[f.y], patch->pos[f.z]); });
+    } else {
+        for(auto f : patch->triangle) {
+            if(intersect_triangle(tray, patch->pos[f.x], patch->pos[f.y], patch->pos[f.z])) return true;
+        }
+        return false;
+    }
+}
+
+// intersect the triangles of an out-of-core cluster in the mesh local frame
+intersection3f intersect_cluster(Mesh* mesh, const ClusterView& cluster, int nodeid, const ray3f& ray) {
+    // grab node
+    auto& node = cluster.nodes[nodeid];
+    // intersect bbox
+    if(not intersect_bbox(ray, node.bbox)) return intersection3f();
+    // copy the ray to allow for shortening it
+    auto intersection = intersection3f();
+    auto sray = ray;
+    if(node.leaf) {
+        // leaves reference the cluster triangles directly
+        for(auto tid : range(node.n0, node.n1)) {
+            auto f = cluster.triangle[tid];
+            auto t = 0.0f, u = 0.0f, v = 0.0f;
+            if(not intersect_triangle(sray, cluster.pos[f.x], cluster.pos[f.y], cluster.pos[f.z], t, u, v)) continue;
+            intersection.hit = true;
+            intersection.ray_t = t;
+            intersection.pos = sray.eval(t);
+            if(cluster.norm) intersection.norm = normalize(cluster.norm[f.x]*u+cluster.norm[f.y]*v+cluster.norm[f.z]*(1-u-v));
+            else intersection.norm = normalize(cross(cluster.pos[f.y]-cluster.pos[f.x], cluster.pos[f.z]-cluster.pos[f.x]));
+            if(cluster.texcoord) {
+                auto t0 = cluster.texcoord[f.x], t1 = cluster.texcoord[f.y], t2 = cluster.texcoord[f.z];
+                intersection.texcoord = t0*u+t1*v+t2*(1-u-v);
+                auto uvarea = abs((t1.x-t0.x)*(t2.y-t0.y)-(t2.x-t0.x)*(t1.y-t0.y));
+                auto area = length(cross(cluster.pos[f.y]-cluster.pos[f.x], cluster.pos[f.z]-cluster.pos[f.x]));
+                intersection.texcoord_density = (area > 0) ? uvarea / area : 0;
+            } else intersection.texcoord = zero2f;
+            intersection.mat = mesh->mat;
+            sray.tmax = t;
+        }
+    } else {
+        for(auto n : { node.n0, node.n1 }) {
+            auto sintersection = intersect_cluster(mesh, cluster, n, sray);
+            if(not sintersection.hit) continue;
+            intersection = sintersection;
+            sray.tmax = intersection.ray_t;
+        }
+    }
+    return intersection;
+}
+
+// intersect the triangles of an out-of-core cluster in the mesh local frame without returning values
+bool intersect_cluster_shadow(const ClusterView& cluster, int nodeid, const ray3f& ray) {
+    auto& node = cluster.nodes[nodeid];
+    if(not intersect_bbox(ray, node.bbox)) return false;
+    if(node.leaf) {
+        for(auto tid : range(node.n0, node.n1)) {
+            auto f = cluster.triangle[tid];
+            if(intersect_triangle(ray, cluster.pos[f.x], cluster.pos[f.y], cluster.pos[f.z])) return true;
+        }
+        return false;
+    }
+    return intersect_cluster_shadow(cluster, node.n0, ray) or intersect_cluster_shadow(cluster, node.n1, ray);
+}
+
+// intersect an out-of-core mesh in its local frame, faulting in the clusters reached by the ray
+intersection3f intersect_clustermesh(Mesh* mesh, int nodeid, const ray3f& ray) {
+    auto clusters = mesh->_clusters;
+    if(not clusters->header->num_nodes) return intersection3f();
+    auto& node = clusters->nodes[nodeid];
+    if(not intersect_bbox(ray, node.bbox)) return intersection3f();
+    auto intersection = intersection3f();
+    auto sray = ray;
+    if(node.leaf) {
+        // leaves reference clusters
+        for(auto cid : range(node.n0, node.n1)) {
+            auto sintersection = intersect_cluster(mesh, clustermesh_cluster(clusters, cid), 0, sray);
+            if(not sintersection.hit) continue;
+            intersection = sintersection;
+            sray.tmax = intersection.ray_t;
+        }
+    } else {
+        for(auto n : { node.n0, node.n1 }) {
+            auto sintersection = intersect_clustermesh(mesh, n, sray);
+            if(not sintersection.hit) continue;
+            intersection = sintersection;
+            sray.tmax = intersection.ray_t;
+        }
+    }
+    return intersection;
+}
+
+// intersect an out-of-core mesh in its local frame without returning values
+bool intersect_clustermesh_shadow(Mesh* mesh, int nodeid, const ray3f& ray) {
+    auto clusters = mesh->_clusters;
+    if(not clusters->header->num_nodes) return false;
+    auto& node = clusters->nodes[nodeid];
+    if(not intersect_bbox(ray, node.bbox)) return false;
+    if(node.leaf) {
+        for(auto cid : range(node.n0, node.n1)) {
+            if(intersect_cluster_shadow(clustermesh_cluster(clusters, cid), 0, ray)) return true;
+        }
+        return false;
+    }
+    return intersect_clustermesh_shadow(mesh, node.n0, ray) or intersect_clustermesh_shadow(mesh, node.n1, ray);
+}
+
+// find the cluster of an out-of-core mesh whose bounds a ray enters first (does not fault clusters in)
+void first_cluster(ClusterMesh* clusters, int nodeid, const ray3f& ray, int& cid, float& t) {
+    auto& node = clusters->nodes[nodeid];
+    auto t0 = 0.0f, t1 = 0.0f;
+    if(not intersect_bbox(ray, node.bbox, t0, t1) or (cid >= 0 and t0 >= t)) return;
+    if(node.leaf) { cid = node.n0; t = t0; return; }
+    first_cluster(clusters, node.n0, ray, cid, t);
+    first_cluster(clusters, node.n1, ray, cid, t);
+}
+
+// set up lazy subdivision for a mesh: the bvh holds the coarse quads bounded by their
+// 1-ring (which contains the limit patch) and faces are refined on first hit; the mesh is
+// left unchanged, so that the scene can be accelerated again or saved
+void make_subdivision_cache(Scene* scene, Mesh* mesh) {
+    // create the cache (a previous cache is released with the scene)
+    auto cache = arena_new<SubdivisionCache>(scene->arena);
+    cache->max_triangles = scene->subdivision_cache_size;
+    cache->level = mesh->subdivision_catmullclark_level;
+    // one eager level turns triangles into quads, so that faces can be refined on their own
+    // (smoothing is forced to keep vertices shared; normals are recomputed per patch)
+    auto base = arena_new<Mesh>(scene->arena);
+    base->pos = mesh->pos;
+    base->triangle = mesh->triangle;
+    base->quad = mesh->quad;
+    if(not base->triangle.empty()) {
+        base->subdivision_catmullclark_level = 1;
+        base->subdivision_catmullclark_smooth = true;
+        subdivide_catmullclark(base);
+        cache->level -= 1;
+    }
+    base->subdivision_catmullclark_smooth = mesh->subdivision_catmullclark_smooth;
+    cache->base = base;
+    cache->vertex_faces.resize(base->pos.size());
+    for(auto fid : range(base->quad.size())) {
+        for(auto i : range(4)) cache->vertex_faces[base->quad[fid][i]].push_back(fid);
+    }
+    // find boundary vertices, where the subdivision rules are not convex
+    auto edge_count = map<pair<int,int>,int>();
+    for(auto f : base->quad) {
+        for(auto i : range(4)) edge_count[make_pair(min(f[i],f[(i+1)%4]),max(f[i],f[(i+1)%4]))] += 1;
+    }
+    auto boundary = vector<bool>(base->pos.size(),false);
+    for(auto& e : edge_count) if(e.second == 1) boundary[e.first.first] = boundary[e.first.second] = true;
+    // bound each face by its 1-ring, doubled if the 1-ring touches the boundary
+    auto nfaces = (int)base->quad.size();
+    auto ncurves = (int)(mesh->line.size()+mesh->spline.size());
+    auto bboxes = vector<range3f>(nfaces+ncurves);
+    auto footprint_level = 0;
+    for(auto fid : range(nfaces)) {
+        auto f = base->quad[fid];
+        auto bbox = range3f();
+        auto onboundary = false;
+        for(auto i : range(4)) {
+            for(auto rf : cache->vertex_faces[f[i]]) {
+                for(auto j : range(4)) {
+                    bbox = runion(bbox, base->pos[base->quad[rf][j]]);
+                    onboundary = onboundary or boundary[base->quad[rf][j]];
+                }
+            }
+        }
+        bboxes[fid] = (onboundary) ? rscale(bbox, 2) : bbox;
+        // level for micro-faces of about subdivision_footprint pixels
+        if(scene->subdivision_footprint > 0) {
+            auto fbbox = make_range3f({base->pos[f.x],base->pos[f.y],base->pos[f.z],base->pos[f.w]});
+            auto dist = length(transform_point(mesh->frame, center(fbbox)) - scene->camera->frame.o);
+            auto pixel = scene->camera->width * dist / (scene->camera->dist * scene->image_width);
+            auto ratio = length(size(fbbox)) / (pixel * scene->subdivision_footprint);
+            if(ratio > 1) footprint_level = max(footprint_level, (int)ceil(log2(ratio)));
+        }
+    }
+    // with a footprint, all faces take the level of the largest one on screen, since faces refined
+    // to different levels would not match along their shared edges
+    if(scene->subdivision_footprint > 0) cache->level = min(cache->level, footprint_level);
+    // curves are stored after the faces
+    for(auto i : range(ncurves)) bboxes[nfaces+i] = mesh_curve_bbox(mesh, i);
+    mesh->_subdiv_cache = cache;
+    mesh->bvh = make_accelerator(bboxes, scene->arena);
+}
+
+// bounds of a local bounding box placed in a frame
+inline range3f transform_bbox(const frame3f& f, const range3f& bbox) {
+    auto ret = range3f();
+    for(auto& p : corners(bbox)) ret = runion(ret, transform_point(f,p));
+    return ret;
+}
+
+// linearly interpolate motion bounds between shutter open (s=0) and close (s=1)
+inline range3f lerp_bbox(const range3f* bounds, float s) {
+    return range3f(bounds[0].min*(1-s)+bounds[1].min*s, bounds[0].max*(1-s)+bounds[1].max*s);
+}
+
+// shutter open and close as absolute animation times
+inline vec2f motion_shutter(Scene* scene) {
+    return vec2f(scene->animation->time + scene->animation->shutter.x, scene->animation->time + scene->animation->shutter.y);
+}
+
+// compute the world bounds of an animated object at shutter open and close,
+// padded by how much the keyframed motion strays from linear in between
+void make_motion_bounds(FrameAnimation* animation, const range3f& bbox, const vec2f& shutter, range3f* bounds) {
+    bounds[0] = transform_bbox(animate_compute_frame(animation, shutter.x), bbox);
+    bounds[1] = transform_bbox(animate_compute_frame(animation, shutter.y), bbox);
+    auto pad = zero3f;
+    for(auto i : range(1,BVHAccelerator_motion_samples)) {
+        auto s = i / float(BVHAccelerator_motion_samples);
+        auto sbbox = transform_bbox(animate_compute_frame(animation, shutter.x*(1-s)+shutter.y*s), bbox);
+        auto lbbox = lerp_bbox(bounds, s);
+        pad = max(pad, max(lbbox.min-sbbox.min, sbbox.max-lbbox.max));
+    }
+    for(auto i : range(2)) bounds[i] = rscale(range3f(bounds[i].min-pad, bounds[i].max+pad), 1+BVHAccelerator_epsilon);
+}
+
+// get the frame of an object at the ray time; for animated objects under motion blur,
+// the ray is first tested against the interpolated motion bounds (returns false if missed)
+inline bool motion_frame(Scene* scene, FrameAnimation* animation, const range3f* bounds,
+                         const frame3f& frame, const ray3f& ray, frame3f& rframe) {
+    if(not scene->animation->motion_blur or not animation) { rframe = frame; return true; }
+    auto shutter = motion_shutter(scene);
+    auto s = (shutter.y > shutter.x) ? clamp((ray.time-shutter.x)/(shutter.y-shutter.x), 0.0f, 1.0f) : 0.0f;
+    if(not intersect_bbox(ray, lerp_bbox(bounds, s))) return false;
+    rframe = animate_compute_frame(animation, ray.time);
+    return true;
+}
+
 // intersects the scene and return the first intrerseciton
 intersection3f intersect(Scene* scene, ray3f ray) {
     // create a default intersection record to be returned
     auto intersection = intersection3f();
     // foreach surface
     for(auto surface : scene->surfaces) {
+        // grab the surface frame at the ray time, skip if the motion bounds are missed
+        auto frame = identity_frame3f;
+        if(not motion_frame(scene, surface->animation, surface->_motion_bounds, surface->frame, ray, frame)) continue;
         // if it is a quad
         if(surface->isquad) {
             // compute ray intersection (and ray parameter), continue if not hit
-            auto tray = transform_ray_inverse(surface->frame,ray);
+            auto tray = transform_ray_inverse(frame,ray);
             
             // intersect quad
             auto t = 0.0f; auto p = zero3f;
@@ -260,13 +725,14 @@ intersection3f intersect(Scene* scene, ray3f ray) {
             // if hit, set intersection record values
             intersection.hit = true;
             intersection.ray_t = t;
-            intersection.pos = transform_point(surface->frame,p);
-            intersection.norm = transform_normal(surface->frame,z3f);
+            intersection.pos = transform_point(frame,p);
+            intersection.norm = transform_normal(frame,z3f);
             intersection.texcoord = {0.5f*p.x/surface->radius+0.5f,0.5f*p.y/surface->radius+0.5f};
+            intersection.texcoord_density = 1 / (4*surface->radius*surface->radius);
             intersection.mat = surface->mat;
         } else {
             // compute ray intersection (and ray parameter), continue if not hit
-            auto tray = transform_ray_inverse(surface->frame,ray);
+            auto tray = transform_ray_inverse(frame,ray);
             
             // intersect sphere
             auto t = 0.0f;
@@ -285,31 +751,50 @@ intersection3f intersect(Scene* scene, ray3f ray) {
             // if hit, set intersection record values
             intersection.hit = true;
             intersection.ray_t = t;
-            intersection.pos = transform_point(surface->frame,p);
-            intersection.norm = transform_normal(surface->frame,n);
+            intersection.pos = transform_point(frame,p);
+            intersection.norm = transform_normal(frame,n);
             intersection.texcoord = {(pif+(float)atan2(n.y, n.x))/(2*pif),(float)acos(n.z)/pif};
+            intersection.texcoord_density = 1 / (2*pif*pif*surface->radius*surface->radius);
             intersection.mat = surface->mat;
         }
     }
     // foreach mesh
     for(auto mesh : scene->meshes) {
-        // quads are not supported: check for error
-        error_if_not(mesh->quad.empty(), "quad intersection is not supported");
+        // quads are not supported, unless lazily subdivided: check for error
+        error_if_not(mesh->quad.empty() or mesh->_subdiv_cache, "quad intersection is not supported");
+        // grab the mesh frame at the ray time, skip if the motion bounds are missed
+        auto frame = identity_frame3f;
+        if(not motion_frame(scene, mesh->animation, mesh->_motion_bounds, mesh->frame, ray, frame)) continue;
         // tranform the ray
-        auto tray = transform_ray_inverse(mesh->frame, ray);
+        auto tray = transform_ray_inverse(frame, ray);
         // save auto mesh intersection
         auto sintersection = intersection3f();
+        // if it is out-of-core
+        if(mesh->_clusters) {
+            sintersection = intersect_clustermesh(mesh, 0, tray);
+        }
         // if it is accelerated
-        if(mesh->bvh) {
+        else if(mesh->bvh) {
             sintersection = intersect(mesh->bvh, 0, tray,
                [mesh](int tid, ray3f tray){
+                   // lazily subdivided faces are stored first
+                   // (with the curves after them, since the triangles are part of the faces)
+                   if(mesh->_subdiv_cache) {
+                       auto nfaces = (int)mesh->_subdiv_cache->base->quad.size();
+                       if(tid < nfaces) return intersect_subdivision_patch(mesh, tid, tray);
+                       return intersect_mesh_curve(mesh, tid-nfaces, tray);
+                   }
+                   
+                   // curves are stored after triangles
+                   if(tid >= (int)mesh->triangle.size()) return intersect_mesh_curve(mesh, tid-(int)mesh->triangle.size(), tray);
+                   
                    // grab triangle
                    auto triangle = mesh->triangle[tid];
                    
                    // grab vertices
-                   auto v0 = mesh->pos[triangle.x];
-                   auto v1 = mesh->pos[triangle.y];
-                   auto v2 = mesh->pos[triangle.z];
+                   auto v0 = mesh_pos(mesh, triangle.x);
+                   auto v1 = mesh_pos(mesh, triangle.y);
+                   auto v2 = mesh_pos(mesh, triangle.z);
                    
                    // intersect triangle
                    auto t = 0.0f, u = 0.0f, v = 0.0f;
@@ -323,15 +808,16 @@ intersection3f intersect(Scene* scene, ray3f ray) {
                    sintersection.hit = true;
                    sintersection.ray_t = t;
                    sintersection.pos = tray.eval(t);
-                   sintersection.norm = normalize(mesh->norm[triangle.x]*u+
-                                                  mesh->norm[triangle.y]*v+
-                                                  mesh->norm[triangle.z]*(1-u-v));
-                   if(mesh->texcoord.empty()) sintersection.texcoord = zero2f;
+                   sintersection.norm = normalize(mesh_norm(mesh, triangle.x)*u+
+                                                  mesh_norm(mesh, triangle.y)*v+
+                                                  mesh_norm(mesh, triangle.z)*(1-u-v));
+                   if(not mesh_has_texcoord(mesh)) sintersection.texcoord = zero2f;
                    else {
-                       sintersection.texcoord = mesh->texcoord[triangle.x]*u+
-                                                mesh->texcoord[triangle.y]*v+
-                                                mesh->texcoord[triangle.z]*(1-u-v);
+                       sintersection.texcoord = mesh_texcoord(mesh, triangle.x)*u+
+                                                mesh_texcoord(mesh, triangle.y)*v+
+                                                mesh_texcoord(mesh, triangle.z)*(1-u-v);
                    }
+                   sintersection.texcoord_density = mesh_texcoord_density(mesh, triangle);
                    sintersection.mat = mesh->mat;
                    return sintersection;
                });
@@ -341,9 +827,9 @@ intersection3f intersect(Scene* scene, ray3f ray) {
             // foreach triangle
             for(auto triangle : mesh->triangle) {
                 // grab vertices
-                auto v0 = mesh->pos[triangle.x];
-                auto v1 = mesh->pos[triangle.y];
-                auto v2 = mesh->pos[triangle.z];
+                auto v0 = mesh_pos(mesh, triangle.x);
+                auto v1 = mesh_pos(mesh, triangle.y);
+                auto v2 = mesh_pos(mesh, triangle.z);
                 
                 // intersect triangle
                 auto t = 0.0f, u = 0.0f, v = 0.0f;
@@ -359,17 +845,30 @@ intersection3f intersect(Scene* scene, ray3f ray) {
                 sintersection.hit = true;
                 sintersection.ray_t = t;
                 sintersection.pos = tray.eval(t);
-                sintersection.norm = normalize(mesh->norm[triangle.x]*u+
-                                               mesh->norm[triangle.y]*v+
-                                               mesh->norm[triangle.z]*(1-u-v));
-                if(mesh->texcoord.empty()) sintersection.texcoord = zero2f;
+                sintersection.norm = normalize(mesh_norm(mesh, triangle.x)*u+
+                                               mesh_norm(mesh, triangle.y)*v+
+                                               mesh_norm(mesh, triangle.z)*(1-u-v));
+                if(not mesh_has_texcoord(mesh)) sintersection.texcoord = zero2f;
                 else {
-                    sintersection.texcoord = mesh->texcoord[triangle.x]*u+
-                                             mesh->texcoord[triangle.y]*v+
-                                             mesh->texcoord[triangle.z]*(1-u-v);
+                    sintersection.texcoord = mesh_texcoord(mesh, triangle.x)*u+
+                                             mesh_texcoord(mesh, triangle.y)*v+
+                                             mesh_texcoord(mesh, triangle.z)*(1-u-v);
                 }
+                sintersection.texcoord_density = mesh_texcoord_density(mesh, triangle);
                 sintersection.mat = mesh->mat;
             }
+            // foreach curve
+            for(auto cid : range(mesh->line.size()+mesh->spline.size())) {
+                // intersect curve
+                auto cintersection = intersect_mesh_curve(mesh, cid, tray);
+                
+                // skip if not hit or not closer then the found hit
+                if(not cintersection.hit) continue;
+                if(cintersection.ray_t > sintersection.ray_t and sintersection.hit) continue;
+                
+                // set intersection
+                sintersection = cintersection;
+            }
         }
         // if did not hit the mesh, skip
         if(not sintersection.hit) continue;
@@ -378,8 +877,8 @@ intersection3f intersect(Scene* scene, ray3f ray) {
         // set interserction
         intersection = sintersection;
         // transform by mesh frame
-        intersection.pos = transform_point(mesh->frame,sintersection.pos);
-        intersection.norm = transform_normal(mesh->frame,sintersection.norm);
+        intersection.pos = transform_point(frame,sintersection.pos);
+        intersection.norm = transform_normal(frame,sintersection.norm);
         // set material
         intersection.mat = sintersection.mat;
     }
@@ -392,16 +891,19 @@ intersection3f intersect(Scene* scene, ray3f ray) {
 bool intersect_shadow(Scene* scene, ray3f ray) {
     // foreach surface
     for(auto surface : scene->surfaces) {
+        // grab the surface frame at the ray time, skip if the motion bounds are missed
+        auto frame = identity_frame3f;
+        if(not motion_frame(scene, surface->animation, surface->_motion_bounds, surface->frame, ray, frame)) continue;
         // if it is a quad
         if(surface->isquad) {
             // compute ray intersection (and ray parameter), continue if not hit
-            auto tray = transform_ray_inverse(surface->frame,ray);
+            auto tray = transform_ray_inverse(frame,ray);
             
             // intersect quad
             if(intersect_quad(tray, surface->radius)) return true;
         } else {
             // compute ray intersection (and ray parameter), continue if not hit
-            auto tray = transform_ray_inverse(surface->frame,ray);
+            auto tray = transform_ray_inverse(frame,ray);
             
             // intersect sphere
             if(intersect_sphere(tray, surface->radius)) return true;
@@ -409,21 +911,39 @@ bool intersect_shadow(Scene* scene, ray3f ray) {
     }
     // foreach mesh
     for(auto mesh : scene->meshes) {
-        // quads are not supported: check for error
-        error_if_not(mesh->quad.empty(), "quad intersection is not supported");
+        // quads are not supported, unless lazily subdivided: check for error
+        error_if_not(mesh->quad.empty() or mesh->_subdiv_cache, "quad intersection is not supported");
+        // grab the mesh frame at the ray time, skip if the motion bounds are missed
+        auto frame = identity_frame3f;
+        if(not motion_frame(scene, mesh->animation, mesh->_motion_bounds, mesh->frame, ray, frame)) continue;
         // tranform the ray
-        auto tray = transform_ray_inverse(mesh->frame, ray);
+        auto tray = transform_ray_inverse(frame, ray);
+        // if it is out-of-core
+        if(mesh->_clusters) {
+            if(intersect_clustermesh_shadow(mesh, 0, tray)) return true;
+        }
         // if it is accelerated
-        if(mesh->bvh) {
+        else if(mesh->bvh) {
             if(intersect_shadow(mesh->bvh, 0, tray,
                                 [mesh](int tid, ray3f tray){
+                                    // lazily subdivided faces are stored first
+                                    // (with the curves after them, since the triangles are part of the faces)
+                                    if(mesh->_subdiv_cache) {
+                                        auto nfaces = (int)mesh->_subdiv_cache->base->quad.size();
+                                        if(tid < nfaces) return intersect_subdivision_patch_shadow(mesh, tid, tray);
+                                        return intersect_mesh_curve(mesh, tid-nfaces, tray).hit;
+                                    }
+                                    
+                                    // curves are stored after triangles
+                                    if(tid >= (int)mesh->triangle.size()) return intersect_mesh_curve(mesh, tid-(int)mesh->triangle.size(), tray).hit;
+                                    
                                     // grab triangle
                                     auto triangle = mesh->triangle[tid];
                                           
                                     // grab vertices
-                                    auto v0 = mesh->pos[triangle.x];
-                                    auto v1 = mesh->pos[triangle.y];
-                                    auto v2 = mesh->pos[triangle.z];
+                                    auto v0 = mesh_pos(mesh, triangle.x);
+                                    auto v1 = mesh_pos(mesh, triangle.y);
+                                    auto v2 = mesh_pos(mesh, triangle.z);
                             
                                     // return if intersected
                                     return intersect_triangle(tray, v0, v1, v2);})) return true;
@@ -431,13 +951,18 @@ bool intersect_shadow(Scene* scene, ray3f ray) {
             // foreach triangle
             for(auto triangle : mesh->triangle) {
                 // grab vertices
-                auto v0 = mesh->pos[triangle.x];
-                auto v1 = mesh->pos[triangle.y];
-                auto v2 = mesh->pos[triangle.z];
+                auto v0 = mesh_pos(mesh, triangle.x);
+                auto v1 = mesh_pos(mesh, triangle.y);
+                auto v2 = mesh_pos(mesh, triangle.z);
                 
                 // intersect triangle
                 if(intersect_triangle(tray, v0, v1, v2)) return true;
             }
+            // foreach curve
+            for(auto cid : range(mesh->line.size()+mesh->spline.size())) {
+                // intersect curve
+                if(intersect_mesh_curve(mesh, cid, tray).hit) return true;
+            }
         }
     }
     
@@ -450,12 +975,19 @@ void accelerate(Scene* scene) {
     // foreach mesh, init bvh acceleration structure to nullptr
     for(auto mesh : scene->meshes) mesh->bvh = nullptr;
     
+    // lazily subdivided meshes keep their coarse faces in a bvh and refine them on first hit
+    for(auto mesh : scene->meshes) {
+        if(mesh->subdivision_catmullclark_lazy and mesh->subdivision_catmullclark_level) make_subdivision_cache(scene, mesh);
+    }
+    
     // if scene should be accelerated using bvh
     if(scene->accelerate_bvh) {
         // foreach mesh
         for (auto mesh : scene->meshes) {
-            // acceleration structure does not support animations
-            if(mesh->animation) continue;
+            // skip lazily subdivided meshes
+            if(mesh->_subdiv_cache) continue;
+            
+            // the bvh is built in the mesh local frame, so it stays valid under keyframed animation
             
             // triangulate quads (convert all quads into two tris)
             for(auto f : mesh->quad) {
@@ -465,19 +997,59 @@ void accelerate(Scene* scene) {
             // clear out quads vector
             mesh->quad.clear();
             
+            // compress vertices before building the bvh, so bounds enclose the decoded triangles
+            if(mesh->compress_vertices and not mesh->_compressed) compress_vertices(mesh, scene->arena);
+            
             // make acceleration structure
             // check whether to accelerate
-            if (mesh->triangle.size()+mesh->quad.size() > BVHAccelerator_min_prims) {
-                // grab all bbox
-                auto bboxes = vector<range3f>(mesh->triangle.size());
+            auto ncurves = (int)(mesh->line.size()+mesh->spline.size());
+            if (mesh->triangle.size()+ncurves > BVHAccelerator_min_prims) {
+                // grab all bbox (curves are stored after triangles)
+                auto bboxes = vector<range3f>(mesh->triangle.size()+ncurves);
                 for(auto i : range(mesh->triangle.size())) {
                     auto f = mesh->triangle[i];
-                    bboxes[i] = make_range3f({mesh->pos[f.x],mesh->pos[f.y],mesh->pos[f.z]});
+                    bboxes[i] = make_range3f({mesh_pos(mesh, f.x),mesh_pos(mesh, f.y),mesh_pos(mesh, f.z)});
                 }
+                for(auto i : range(ncurves)) bboxes[mesh->triangle.size()+i] = mesh_curve_bbox(mesh, i);
                 // make accelerator
-                mesh->bvh = make_accelerator(bboxes);
+                mesh->bvh = make_accelerator(bboxes, scene->arena);
             }
         }
     }
+    
+    // if motion blurred, compute the world bounds of animated objects at shutter open and close
+    if(scene->animation->motion_blur) {
+        auto shutter = motion_shutter(scene);
+        for(auto mesh : scene->meshes) {
+            if(not mesh->animation) continue;
+            auto bbox = range3f();
+            for(auto& p : mesh->pos) bbox = runion(bbox, p);
+            if(mesh->_compressed) bbox = runion(bbox, mesh->_compressed->bbox);
+            if(mesh->_subdiv_cache) bbox = runion(bbox, mesh->bvh->nodes[0].bbox);
+            if(mesh->_clusters) bbox = runion(bbox, clustermesh_bbox(mesh->_clusters));
+            if(not mesh->line.empty() or not mesh->spline.empty()) bbox = range3f(bbox.min-one3f*mesh->curve_radius, bbox.max+one3f*mesh->curve_radius);
+            make_motion_bounds(mesh->animation, bbox, shutter, mesh->_motion_bounds);
+        }
+        for(auto surface : scene->surfaces) {
+            if(not surface->animation) continue;
+            auto r = surface->radius;
+            auto bbox = (surface->isquad) ? range3f(vec3f(-r,-r,0),vec3f(r,r,0)) : range3f(vec3f(-r,-r,-r),vec3f(r,r,r));
+            make_motion_bounds(surface->animation, bbox, shutter, surface->_motion_bounds);
+        }
+    }
 }
 
+int ray_cluster(Scene* scene, ray3f ray) {
+    // clusters are numbered across meshes; meshes are taken at their rest frame
+    auto key = -1, offset = 0;
+    auto tmin = ray3f_rayinf;
+    for(auto mesh : scene->meshes) {
+        if(not mesh->_clusters) continue;
+        auto clusters = mesh->_clusters;
+        auto cid = -1; auto t = 0.0f;
+        if(clusters->header->num_nodes) first_cluster(clusters, 0, transform_ray_inverse(mesh->frame, ray), cid, t);
+        if(cid >= 0 and t < tmin) { key = offset + cid; tmin = t; }
+        offset += clusters->header->num_clusters;
+    }
+    return key;
+}
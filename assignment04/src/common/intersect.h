@@ -10,13 +10,14 @@ struct intersection3f {
     vec3f       pos;        // hit position
     vec3f       norm;       // hit normal
     vec2f       texcoord;   // hit texture coordinates
+    float       texcoord_density; // texcoord area per unit of surface area (0 if unknown)
     Material*   mat;        // hit material
     
     // constructor (defaults to no intersection)
-    intersection3f() : hit(false) { }
+    intersection3f() : hit(false), texcoord_density(0) { }
     
     // constructor to override default intersection
-    explicit intersection3f(bool hit) : hit(hit) { }
+    explicit intersection3f(bool hit) : hit(hit), texcoord_density(0) { }
 };
 
 #define ray3f_epsilon 0.0005f
@@ -28,32 +29,35 @@ struct ray3f {
     vec3f d;        // direction
     float tmin;     // min t value
     float tmax;     // max t value
+    float time;     // animation time (for motion blur)
+    float cone_width;   // ray cone width at the origin (for texture filtering)
+    float cone_spread;  // ray cone spread angle (for texture filtering)
     
     // Default constructor
-    ray3f() : e(zero3f), d(z3f), tmin(ray3f_epsilon), tmax(ray3f_rayinf) { }
+    ray3f() : e(zero3f), d(z3f), tmin(ray3f_epsilon), tmax(ray3f_rayinf), time(0), cone_width(0), cone_spread(0) { }
     
     // Element-wise constructor
     ray3f(const vec3f& e, const vec3f& d) :
-    e(e), d(d), tmin(ray3f_epsilon), tmax(ray3f_rayinf) { }
+    e(e), d(d), tmin(ray3f_epsilon), tmax(ray3f_rayinf), time(0), cone_width(0), cone_spread(0) { }
     
     // Element-wise constructor
-    ray3f(const vec3f& e, const vec3f& d, float tmin, float tmax) :
-    e(e), d(d), tmin(tmin), tmax(tmax) { }
+    ray3f(const vec3f& e, const vec3f& d, float tmin, float tmax, float time = 0) :
+    e(e), d(d), tmin(tmin), tmax(tmax), time(time), cone_width(0), cone_spread(0) { }
     
     // Eval ray at a specific t
     vec3f eval(float t) const { return e + d * t; }
     
     // Create a ray from point a to point b
-    static ray3f make_segment(const vec3f& a, const vec3f& b) { return ray3f(a,normalize(b-a),ray3f_epsilon,dist(a,b)-2*ray3f_epsilon); }
+    static ray3f make_segment(const vec3f& a, const vec3f& b, float time = 0) { return ray3f(a,normalize(b-a),ray3f_epsilon,dist(a,b)-2*ray3f_epsilon,time); }
 };
 
 // transform a ray by a frame
-inline ray3f transform_ray(const frame3f& f, const ray3f& v) { return ray3f(transform_point(f,v.e), transform_vector(f,v.d), v.tmin, v.tmax); }
-inline ray3f transform_ray_from_local(const frame3f& f, const ray3f& v) { return ray3f(transform_point(f,v.e), transform_vector(f,v.d), v.tmin, v.tmax); }
+inline ray3f transform_ray(const frame3f& f, const ray3f& v) { auto r = v; r.e = transform_point(f,v.e); r.d = transform_vector(f,v.d); return r; }
+inline ray3f transform_ray_from_local(const frame3f& f, const ray3f& v) { auto r = v; r.e = transform_point(f,v.e); r.d = transform_vector(f,v.d); return r; }
 
 // transform a ray by a frame inverse
-inline ray3f transform_ray_inverse(const frame3f& f, const ray3f& v) { return ray3f(transform_point_inverse(f,v.e),transform_vector_inverse(f,v.d),v.tmin,v.tmax); }
-inline ray3f transform_ray_to_local(const frame3f& f, const ray3f& v) { return ray3f(transform_point_inverse(f,v.e),transform_vector_inverse(f,v.d),v.tmin,v.tmax); }
+inline ray3f transform_ray_inverse(const frame3f& f, const ray3f& v) { auto r = v; r.e = transform_point_inverse(f,v.e); r.d = transform_vector_inverse(f,v.d); return r; }
+inline ray3f transform_ray_to_local(const frame3f& f, const ray3f& v) { auto r = v; r.e = transform_point_inverse(f,v.e); r.d = transform_vector_inverse(f,v.d); return r; }
 
 // prepare scene acceleration and triangulate meshes
 void accelerate(Scene* scene);
@@ -64,4 +68,8 @@ intersection3f intersect(Scene* scene, ray3f ray);
 // intersects the scene and return any intrerseciton
 bool intersect_shadow(Scene* scene, ray3f ray);
 
+// out-of-core cluster first entered by a ray, numbered across the scene meshes (-1 if none);
+// tracing rays in cluster order keeps the faulted in geometry of out-of-core meshes coherent
+int ray_cluster(Scene* scene, ray3f ray);
+
 #endif
@@ -1,37 +1,180 @@
 #include "json.h"
-#include "picojson.h"
 
-// json value conversion from parser
-static jsonvalue _to_jsonvalue(const picojson::value& pjson) {
-    if(pjson.is<picojson::null>()) return jsonvalue();
-    else if(pjson.is<bool>()) return jsonvalue( pjson.get<bool>() );
-    else if(pjson.is<double>()) return jsonvalue( pjson.get<double>() );
-    else if(pjson.is<string>()) return jsonvalue( pjson.get<string>() );
-    else if(pjson.is<picojson::array>()) {
-        auto json = jsonvalue::array();
-        for(auto& j : pjson.get<picojson::array>()) json.push_back(_to_jsonvalue(j));
-        return jsonvalue(json);
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+// recursive descent json parser building jsonvalues in place
+struct _JsonParser {
+    const char*                     cur;        // current character
+    const char*                     end;        // end of input
+    const char*                     begin;      // start of input (for error lines)
+    const map<string,jsontarget>*   targets;    // streamed arrays of the top-level object
+    bool                            failed = false; // whether an error was found
+    
+    // report an error and stop parsing
+    void fail(const char* msg) {
+        if(failed) return;
+        auto line = 1 + (int)std::count(begin, cur, '\n');
+        error("json reading error: %s at line %d\n", msg, line);
+        failed = true; cur = end;
     }
-    else if(pjson.is<picojson::object>()) {
-        auto json = jsonvalue::object();
-        for(auto& nj : pjson.get<picojson::object>()) json[nj.first] = _to_jsonvalue(nj.second);
-        return jsonvalue(json);
-    } else { error("unknown type"); return jsonvalue(); }
-}
+    
+    // skip whitespace
+    void skip() { while(cur < end and (*cur == ' ' or *cur == '\n' or *cur == '\r' or *cur == '\t')) cur ++; }
+    
+    // consume an expected character
+    bool expect(char c) { skip(); if(cur < end and *cur == c) { cur ++; return true; } fail("unexpected character"); return false; }
+    
+    // parse a literal keyword
+    bool keyword(const char* word) {
+        auto len = strlen(word);
+        if(end - cur < (long)len or strncmp(cur, word, len) != 0) { fail("bad literal"); return false; }
+        cur += len; return true;
+    }
+    
+    // parse a number
+    double number() {
+        char* last = nullptr;
+        auto d = strtod(cur, &last);
+        if(last == cur or last > end) { fail("bad number"); return 0; }
+        cur = last;
+        return d;
+    }
+    
+    // parse the four hex digits of a \u escape
+    unsigned hex4() {
+        if(end - cur < 4 or not std::all_of(cur, cur+4, [](char c){ return (bool)isxdigit((unsigned char)c); })) { fail("bad escape"); return 0; }
+        auto code = (unsigned)strtoul(string(cur, 4).c_str(), nullptr, 16); cur += 4;
+        return code;
+    }
+    
+    // parse a string, decoding escapes (\u escapes are encoded as utf8)
+    string str() {
+        auto ret = string();
+        if(not expect('"')) return ret;
+        while(cur < end and *cur != '"') {
+            if(*cur != '\\') { ret.push_back(*cur++); continue; }
+            if(++cur >= end) break;
+            switch(*cur++) {
+                case '"': ret.push_back('"'); break;
+                case '\\': ret.push_back('\\'); break;
+                case '/': ret.push_back('/'); break;
+                case 'b': ret.push_back('\b'); break;
+                case 'f': ret.push_back('\f'); break;
+                case 'n': ret.push_back('\n'); break;
+                case 'r': ret.push_back('\r'); break;
+                case 't': ret.push_back('\t'); break;
+                case 'u': {
+                    auto code = hex4();
+                    // combine a utf16 surrogate pair into a single code point
+                    if(code >= 0xd800 and code < 0xdc00) {
+                        if(end - cur < 6 or cur[0] != '\\' or cur[1] != 'u') { fail("bad surrogate pair"); return ret; }
+                        cur += 2;
+                        auto low = hex4();
+                        if(low < 0xdc00 or low >= 0xe000) { fail("bad surrogate pair"); return ret; }
+                        code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                    } else if(code >= 0xdc00 and code < 0xe000) { fail("bad surrogate pair"); return ret; }
+                    if(failed) return ret;
+                    if(code < 0x80) ret.push_back((char)code);
+                    else if(code < 0x800) { ret.push_back((char)(0xc0 | (code >> 6))); ret.push_back((char)(0x80 | (code & 0x3f))); }
+                    else if(code < 0x10000) { ret.push_back((char)(0xe0 | (code >> 12))); ret.push_back((char)(0x80 | ((code >> 6) & 0x3f))); ret.push_back((char)(0x80 | (code & 0x3f))); }
+                    else { ret.push_back((char)(0xf0 | (code >> 18))); ret.push_back((char)(0x80 | ((code >> 12) & 0x3f))); ret.push_back((char)(0x80 | ((code >> 6) & 0x3f))); ret.push_back((char)(0x80 | (code & 0x3f))); }
+                } break;
+                default: fail("bad escape"); return ret;
+            }
+        }
+        if(cur >= end) { fail("unterminated string"); return ret; }
+        cur ++;
+        return ret;
+    }
+    
+    // stream a (possibly nested) numeric array into a target
+    void stream(const jsontarget& target) {
+        if(not expect('[')) return;
+        skip();
+        if(cur < end and *cur == ']') { cur ++; if(target.end) target.end(); return; }
+        while(not failed) {
+            skip();
+            if(cur < end and *cur == '[') {
+                if(not target.row) { fail("unexpected nested array"); return; }
+                target.row();
+                stream(target);
+            } else target.push(number());
+            skip();
+            if(cur < end and *cur == ',') { cur ++; continue; }
+            if(expect(']') and target.end) target.end();
+            return;
+        }
+    }
+    
+    // parse any value
+    jsonvalue value(bool toplevel = false) {
+        skip();
+        if(cur >= end) { fail("unexpected end of file"); return jsonvalue(); }
+        switch(*cur) {
+            case '{': {
+                cur ++;
+                auto obj = jsonvalue::object();
+                skip();
+                if(cur < end and *cur == '}') { cur ++; return jsonvalue(std::move(obj)); }
+                while(not failed) {
+                    skip();
+                    auto name = str();
+                    if(not expect(':')) break;
+                    skip();
+                    // stream the arrays registered for the top-level object
+                    auto target = (toplevel and cur < end and *cur == '[') ? targets->find(name) : targets->end();
+                    if(target != targets->end()) stream(target->second);
+                    else obj[name] = value();
+                    skip();
+                    if(cur < end and *cur == ',') { cur ++; continue; }
+                    expect('}');
+                    break;
+                }
+                return jsonvalue(std::move(obj));
+            }
+            case '[': {
+                cur ++;
+                auto arr = jsonvalue::array();
+                skip();
+                if(cur < end and *cur == ']') { cur ++; return jsonvalue(std::move(arr)); }
+                while(not failed) {
+                    arr.push_back(value());
+                    skip();
+                    if(cur < end and *cur == ',') { cur ++; continue; }
+                    expect(']');
+                    break;
+                }
+                return jsonvalue(std::move(arr));
+            }
+            case '"': return jsonvalue(str());
+            case 't': keyword("true"); return jsonvalue(true);
+            case 'f': keyword("false"); return jsonvalue(false);
+            case 'n': keyword("null"); return jsonvalue();
+            default: return jsonvalue(number());
+        }
+    }
+};
 
 // json handling
-jsonvalue load_json(const string& filename) {
+jsonvalue load_json(const string& filename, const map<string,jsontarget>& targets) {
     // open file
-    std::ifstream stream(filename.c_str(), std::ifstream::in);
+    std::ifstream stream(filename.c_str(), std::ifstream::in | std::ifstream::binary);
     error_if_not(stream.good(), "cannot open file: %s\n", filename.c_str());
-    // read json
-    picojson::value pjson;
-    stream >> pjson;
-    auto err = picojson::get_last_error();
-    error_if_not(err.empty(), "json reading error: %s\n", err.c_str());
+    // read the whole file (zero terminated for strtod)
+    auto text = string((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
     stream.close();
-    // conversion
-    auto json = _to_jsonvalue(pjson);
+    // parse
+    auto parser = _JsonParser();
+    parser.begin = parser.cur = text.c_str();
+    parser.end = text.c_str() + text.size();
+    parser.targets = &targets;
+    auto json = parser.value(true);
+    // only whitespace may follow the root value
+    parser.skip();
+    if(parser.cur < parser.end) parser.fail("trailing characters");
     // done
     return json;
 }
@@ -3,6 +3,8 @@
 
 #include "common.h"
 
+#include <functional>
+
 // simple generic value for serialization and command line options
 // modeled on the JSON model, but with builtin semantics for fast
 // different number formats and arrays of basic types
@@ -34,14 +36,25 @@ struct jsonvalue {
     explicit jsonvalue(const array& a) : _type(arrayt), _a(new vector<jsonvalue>(a)) { }
     explicit jsonvalue(const object& o) : _type(objectt), _o(new map<string,jsonvalue>(o)) { }
     
+    // value constructors taking ownership
+    explicit jsonvalue(string&& s) : _type(stringt), _s(new string(std::move(s))) { }
+    explicit jsonvalue(array&& a) : _type(arrayt), _a(new vector<jsonvalue>(std::move(a))) { }
+    explicit jsonvalue(object&& o) : _type(objectt), _o(new map<string,jsonvalue>(std::move(o))) { }
+    
     // copy constructor
     jsonvalue(const jsonvalue& j) : _type(nullt) { set(j); }
     
+    // move constructor
+    jsonvalue(jsonvalue&& j) : _type(nullt) { _steal(j); }
+    
     // destuctor
     ~jsonvalue() { _clear(); }
     
     // assignment
-    jsonvalue& operator=(const jsonvalue& j) { set(j); return *this; }
+    jsonvalue& operator=(const jsonvalue& j) { if(this != &j) set(j); return *this; }
+    
+    // move assignment
+    jsonvalue& operator=(jsonvalue&& j) { if(this != &j) { _clear(); _steal(j); } return *this; }
     
     // clear
     void _clear() {
@@ -50,6 +63,20 @@ struct jsonvalue {
         if(_type==objectt) delete _o;
         _type = nullt;
     }
+    // take over the value of j, leaving it null
+    void _steal(jsonvalue& j) {
+        _type = j._type;
+        switch(_type) {
+            case nullt: break;
+            case boolt: _b = j._b; break;
+            case doublet: _d = j._d; break;
+            case stringt: _s = j._s; break;
+            case arrayt: _a = j._a; break;
+            case objectt: _o = j._o; break;
+            default: error("wrong type");
+        }
+        j._type = nullt;
+    }
     // set
     void set(const jsonvalue& j) {
         if(_type != nullt) _clear();
@@ -91,8 +118,16 @@ struct jsonvalue {
     const jsonvalue& object_element(const string& name) const { error_if_not(object_contains(name), "wrong element name"); return as_object_ref().find(name)->second; }
 };
 
-// json loading
-jsonvalue load_json(const string& filename);
+// destination for a numeric array of the top-level object, streamed by load_json
+// without building jsonvalues (the array is then left out of the loaded object)
+struct jsontarget {
+    std::function<void(double)> push;       // append a number
+    std::function<void()>       row;        // start a nested array (empty if not allowed)
+    std::function<void()>       end;        // end an array, nested or not (may be empty)
+};
+
+// json loading; arrays of the top-level object named in targets are streamed into them
+jsonvalue load_json(const string& filename, const map<string,jsontarget>& targets = map<string,jsontarget>());
 
 // command line specification
 struct CommandLine {
@@ -0,0 +1,49 @@
+#include "mapfile.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile* open_mapped_file(const string& filename) {
+#ifndef _WIN32
+    auto fd = ::open(filename.c_str(), O_RDONLY);
+    if(fd < 0) return nullptr;
+    auto file = new MappedFile();
+    struct stat st;
+    error_if_not(fstat(fd, &st) == 0, "cannot stat file: %s\n", filename.c_str());
+    file->size = st.st_size;
+    if(file->size) {
+        auto data = mmap(nullptr, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        error_if_not(data != MAP_FAILED, "cannot map file: %s\n", filename.c_str());
+        file->data = (const unsigned char*)data;
+        file->_mapped = true;
+    }
+    ::close(fd);
+#else
+    auto f = fopen(filename.c_str(), "rb");
+    if(not f) return nullptr;
+    auto file = new MappedFile();
+    fseek(f, 0, SEEK_END);
+    file->size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    auto buffer = new unsigned char[file->size];
+    error_if_not(fread(buffer, 1, file->size, f) == file->size, "error reading file: %s\n", filename.c_str());
+    fclose(f);
+    file->data = buffer;
+    file->_mapped = false;
+#endif
+    return file;
+}
+
+void close_mapped_file(MappedFile* file) {
+#ifndef _WIN32
+    if(file->_mapped) munmap((void*)file->data, file->size);
+    else delete [] file->data;
+#else
+    delete [] file->data;
+#endif
+    delete file;
+}
@@ -0,0 +1,20 @@
+#ifndef _MAPFILE_H_
+#define _MAPFILE_H_
+
+#include "common.h"
+
+// read-only contents of a file, memory mapped when supported (read into memory otherwise)
+struct MappedFile {
+    const unsigned char*    data = nullptr;     // file contents
+    size_t                  size = 0;           // file size
+    
+    bool                    _mapped = false;    // whether contents are memory mapped
+};
+
+// open a file for reading its contents in place (nullptr if the file cannot be opened)
+MappedFile* open_mapped_file(const string& filename);
+
+// close a file, invalidating its contents
+void close_mapped_file(MappedFile* file);
+
+#endif
@@ -1,7 +1,26 @@
 #include "scene.h"
+#include "binmesh.h"
+#include "clustermesh.h"
+#include "bonetracks.h"
+#include "taskpool.h"
 
-vector<image3f*> get_textures(Scene* scene) {
-    auto textures = set<image3f*>();
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <unordered_map>
+
+Scene::~Scene() {
+    for(auto mesh : meshes) close_clustermesh(mesh->_clusters);
+    delete_cluster_cache(geometry_cache);
+    delete_arena(arena);
+    delete_texture_cache(texture_cache);
+}
+
+vector<TextureHandle*> get_textures(Scene* scene) {
+    auto textures = set<TextureHandle*>();
     for(auto mesh : scene->meshes) {
         if(mesh->mat->ke_txt) textures.insert(mesh->mat->ke_txt);
         if(mesh->mat->kd_txt) textures.insert(mesh->mat->kd_txt);
@@ -15,7 +34,7 @@ vector<image3f*> get_textures(Scene* scene) {
         if(surface->mat->norm_txt) textures.insert(surface->mat->norm_txt);
     }
     if(scene->background_txt) textures.insert(scene->background_txt);
-    return vector<image3f*>(textures.begin(),textures.end());
+    return vector<TextureHandle*>(textures.begin(),textures.end());
 }
 
 Camera* lookat_camera(vec3f eye, vec3f center, vec3f up, float width, float height, float dist) {
@@ -53,12 +72,14 @@ void set_view_turntable(Camera* camera, float rotate_phi, float rotate_theta, fl
 
 
 void json_set_values(const jsonvalue& json, float* value, int n) {
-    error_if_not(n == json.array_size(), "incorrect array size");
-    for(auto i : range(n)) value[i] = json.array_element(i).as_float();
+    auto& array = json.as_array_ref();
+    error_if_not(n == array.size(), "incorrect array size");
+    for(auto i : range(n)) value[i] = array[i].as_float();
 }
 void json_set_values(const jsonvalue& json, int* value, int n) {
-    error_if_not(n == json.array_size(), "incorrect array size");
-    for(auto i : range(n)) value[i] = json.array_element(i).as_int();
+    auto& array = json.as_array_ref();
+    error_if_not(n == array.size(), "incorrect array size");
+    for(auto i : range(n)) value[i] = array[i].as_int();
 }
 
 void json_set_value(const jsonvalue& json, bool& value)  { value = json.as_bool(); }
@@ -104,6 +125,37 @@ void json_set_value(const jsonvalue& json, vector<vector<mat4f>>& value) {
     for(auto i : range(value.size())) json_set_value(json.array_element(i), value[i]);
 }
 
+// streaming target filling an array of elements made of N scalars of type S
+// (arrays whose length is not a multiple of N are rejected)
+template<typename S, int N, typename T>
+jsontarget json_target(vector<T>& value) {
+    value.clear();
+    auto count = std::make_shared<int>(0);
+    auto target = jsontarget();
+    target.push = [&value,count](double d) {
+        if(*count % N == 0) value.push_back(T());
+        reinterpret_cast<S*>(&value.back())[*count % N] = (S)d;
+        (*count) ++;
+    };
+    target.end = [count]() { error_if_not(*count % N == 0, "array length %d is not a multiple of %d\n", *count, N); };
+    return target;
+}
+// streaming target filling an array of matrix arrays (one per nested row)
+jsontarget json_target(vector<vector<mat4f>>& value) {
+    value.clear();
+    auto count = std::make_shared<int>(0);
+    auto target = jsontarget();
+    target.row = [&value,count]() { value.push_back(vector<mat4f>()); *count = 0; };
+    target.push = [&value,count](double d) {
+        error_if_not(not value.empty(), "incorrect array nesting");
+        if(*count % 16 == 0) value.back().push_back(mat4f());
+        (&value.back().back().x.x)[*count % 16] = (float)d;
+        (*count) ++;
+    };
+    target.end = [count]() { error_if_not(*count % 16 == 0, "array length %d is not a multiple of 16\n", *count); };
+    return target;
+}
+
 template<typename T>
 void json_set_optvalue(const jsonvalue& json, T& value, const string& name) {
     if(not json.object_contains(name)) return;
@@ -116,8 +168,28 @@ void json_set_optvalue(const jsonvalue& json, T& value, const string& name) {
 
 
 
+SceneArena* json_arena = nullptr;   // owns the objects of the scene being loaded (nullptr allocates them on the heap)
+
+// make an object of the scene being loaded
+template<typename T>
+T* json_new() { return (json_arena) ? arena_new<T>(json_arena) : new T(); }
+
+// move a heap allocated object into the scene being loaded
+template<typename T>
+T* json_adopt(T* object) {
+    if(not json_arena or not object) return object;
+    auto adopted = arena_new<T>(json_arena);
+    *adopted = std::move(*object);
+    delete object;
+    return adopted;
+}
+
+// delete an object made by json_new (objects in the arena are released with the scene)
+template<typename T>
+void json_delete(T* object) { if(not json_arena) delete object; }
+
 Camera* json_parse_camera(const jsonvalue& json) {
-    auto camera = new Camera();
+    auto camera = json_new<Camera>();
     json_set_optvalue(json, camera->frame, "frame");
     json_set_optvalue(json, camera->width, "width");
     json_set_optvalue(json, camera->height, "height");
@@ -135,11 +207,13 @@ Camera* json_parse_lookatcamera(const jsonvalue& json) {
     json_set_optvalue(json, width, "width");
     json_set_optvalue(json, height, "height");
     json_set_optvalue(json, dist, "dist");
-    return lookat_camera(from, to, up, width, height, dist);
+    return json_adopt(lookat_camera(from, to, up, width, height, dist));
 }
 
-vector<string>          json_texture_paths;
-map<string,image3f*>    json_texture_cache;
+thread_local vector<string>  json_texture_paths = { "" };    // per thread, since files are parsed by loading tasks
+TextureCache*               json_texture_cache = nullptr;   // textures of the scene being loaded
+ClusterCache*               json_geometry_cache = nullptr;  // out-of-core geometry of the scene being loaded
+TaskPool*                   json_load_pool = nullptr;       // pool loading files (nullptr loads them serially)
 
 void json_texture_path_push(string filename) {
     auto pos = filename.rfind("/");
@@ -148,28 +222,46 @@ void json_texture_path_push(string filename) {
 }
 void json_texture_path_pop() { json_texture_paths.pop_back(); }
 
-void json_parse_opttexture(jsonvalue json, image3f*& txt, string name) {
-    if(not json.object_contains(name)) return;
-    auto filename = json.object_element(name).as_string();
-    if(filename.empty()) { txt = nullptr; return; }
-    auto dirname = json_texture_paths.back();
-    auto fullname = dirname + filename;
-    if (json_texture_cache.find(fullname) == json_texture_cache.end()) {
-        auto ext = fullname.substr(fullname.size()-3);
+// load a file in a task of the loading pool, reporting its loading time
+void json_load_task(const string& filename, const std::function<void()>& load) {
+    auto paths = json_texture_paths;
+    taskpool_run(json_load_pool, [=](){
+        auto saved_paths = json_texture_paths;
+        json_texture_paths = paths;
+        auto start = std::chrono::steady_clock::now();
+        load();
+        auto elapsed = std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now()-start).count();
+        message("loaded %s in %.1f ms\n", filename.c_str(), elapsed);
+        json_texture_paths = saved_paths;
+    });
+}
+
+// get the texture handle of an image file from the texture cache of the scene being loaded
+TextureHandle* json_texture(const string& fullname) {
+    auto ext = fullname.substr(fullname.size()-3);
+    error_if_not(ext == "pfm" or ext == "png", "unsupported image format %s\n", ext.c_str());
+    return texture_cache_handle(json_texture_cache, fullname, [fullname,ext](){
         if(ext == "pfm") {
             auto image = read_pnm("models/pisa_latlong.pfm", true);
             image = image.gamma(1/2.2);
-            json_texture_cache[fullname] = new image3f(image);
-        } else if(ext == "png") {
+            return make_texture(image, true);
+        } else {
             auto image = read_png(fullname,true);
-            json_texture_cache[fullname] = new image3f(image);
-        } else error("unsupported image format %s\n", ext.c_str());
-    }
-    txt = json_texture_cache[fullname];
+            return make_texture(image, false);
+        }
+    });
+}
+
+void json_parse_opttexture(jsonvalue json, TextureHandle*& txt, string name) {
+    if(not json.object_contains(name)) return;
+    auto filename = json.object_element(name).as_string();
+    if(filename.empty()) { txt = nullptr; return; }
+    auto dirname = json_texture_paths.back();
+    txt = json_texture(dirname + filename);
 }
 
 Material* json_parse_material(const jsonvalue& json) {
-    auto material = new Material();
+    auto material = json_new<Material>();
     json_set_optvalue(json, material->kd, "kd");
     json_set_optvalue(json, material->ks, "ks");
     json_set_optvalue(json, material->kr, "kr");
@@ -184,7 +276,7 @@ Material* json_parse_material(const jsonvalue& json) {
 }
 
 FrameAnimation* json_parse_frame_animation(const jsonvalue& json) {
-    auto animation = new FrameAnimation();
+    auto animation = json_new<FrameAnimation>();
     json_set_optvalue(json, animation->rest_frame, "rest_frame");
     json_set_optvalue(json, animation->keytimes, "keytimes");
     json_set_optvalue(json, animation->translation, "translation");
@@ -193,11 +285,12 @@ FrameAnimation* json_parse_frame_animation(const jsonvalue& json) {
 }
 
 Surface* json_parse_surface(const jsonvalue& json) {
-    auto surface = new Surface();
+    auto surface = json_new<Surface>();
     json_set_optvalue(json, surface->frame, "frame");
     json_set_optvalue(json, surface->radius,"radius");
     json_set_optvalue(json, surface->isquad,"isquad");
     if(json.object_contains("material")) surface->mat = json_parse_material(json.object_element("material"));
+    else surface->mat = json_new<Material>();
     json_set_optvalue(json, surface->subdivision_level,"subdivision_level");
     json_set_optvalue(json, surface->subdivision_smooth,"subdivision_smooth");
     if(json.object_contains("animation")) surface->animation = json_parse_frame_animation(json.object_element("animation"));
@@ -211,8 +304,8 @@ vector<Surface*> json_parse_surfaces(const jsonvalue& json) {
 }
 
 
-MeshSkinning* json_parse_mesh_skinning(const jsonvalue& json) {
-    auto skinning = new MeshSkinning();
+MeshSkinning* json_parse_mesh_skinning(const jsonvalue& json, MeshSkinning* skinning = nullptr) {
+    if(not skinning) skinning = json_new<MeshSkinning>();
     json_set_optvalue(json, skinning->vert_rest_pos, "rest_pos");
     json_set_optvalue(json, skinning->vert_rest_norm, "rest_norm");
     json_set_optvalue(json, skinning->vert_bone_ids, "bone_ids");
@@ -222,7 +315,7 @@ MeshSkinning* json_parse_mesh_skinning(const jsonvalue& json) {
 }
 
 MeshSimulation* json_parse_mesh_simulation(const jsonvalue& json) {
-    auto simulation = new MeshSimulation();
+    auto simulation = json_new<MeshSimulation>();
     json_set_optvalue(json, simulation->init_pos, "init_pos");
     json_set_optvalue(json, simulation->init_vel, "init_vel");
     json_set_optvalue(json, simulation->mass, "mass");
@@ -242,13 +335,81 @@ MeshSimulation* json_parse_mesh_simulation(const jsonvalue& json) {
     return simulation;
 }
 
+MeshCollision* json_parse_mesh_collision(const jsonvalue& json) {
+    auto collision = json_new<MeshCollision>();
+    json_set_optvalue(json, collision->radius, "radius");
+    json_set_optvalue(json, collision->isquad, "isquad");
+    return collision;
+}
+
+MeshSkinning* json_load_mesh_skinning(const string& filename) {
+    // stream the large arrays directly into the skinning
+    auto skinning = json_new<MeshSkinning>();
+    auto targets = map<string,jsontarget>();
+    targets["rest_pos"] = json_target<float,3>(skinning->vert_rest_pos);
+    targets["rest_norm"] = json_target<float,3>(skinning->vert_rest_norm);
+    targets["bone_ids"] = json_target<int,4>(skinning->vert_bone_ids);
+    targets["bone_weights"] = json_target<float,4>(skinning->vert_bone_weights);
+    targets["bone_xforms"] = json_target(skinning->bone_xforms);
+    return json_parse_mesh_skinning(load_json(filename, targets), skinning);
+}
+
+void json_parse_mesh_values(const jsonvalue& json, Mesh* mesh);
+
+void json_load_mesh(const string& filename, Mesh* mesh) {
+    // stream the large arrays directly into the mesh
+    auto targets = map<string,jsontarget>();
+    targets["pos"] = json_target<float,3>(mesh->pos);
+    targets["norm"] = json_target<float,3>(mesh->norm);
+    targets["texcoord"] = json_target<float,2>(mesh->texcoord);
+    targets["triangle"] = json_target<int,3>(mesh->triangle);
+    targets["quad"] = json_target<int,4>(mesh->quad);
+    targets["point"] = json_target<int,1>(mesh->point);
+    targets["line"] = json_target<int,2>(mesh->line);
+    targets["spline"] = json_target<int,4>(mesh->spline);
+    json_parse_mesh_values(load_json(filename, targets), mesh);
+}
+
 Mesh* json_parse_mesh(const jsonvalue& json) {
-    auto mesh = new Mesh();
-    if(json.object_contains("json_mesh")) {
-        json_texture_path_push(json.object_element("json_mesh").as_string());
-        mesh = json_parse_mesh(load_json(json.object_element("json_mesh").as_string()));
-        json_texture_path_pop();
-    }
+    auto mesh = json_new<Mesh>();
+    // meshes stored in files are loaded by a task, that then sets the values in json
+    auto filename = json.object_contains("json_mesh") ? json.object_element("json_mesh").as_string() :
+                    json.object_contains("bin_mesh") ? json.object_element("bin_mesh").as_string() :
+                    json.object_contains("obj_mesh") ? json.object_element("obj_mesh").as_string() :
+                    json.object_contains("ply_mesh") ? json.object_element("ply_mesh").as_string() :
+                    json.object_contains("cluster_mesh") ? json.object_element("cluster_mesh").as_string() :
+                    json.object_contains("json_skinning") ? json.object_element("json_skinning").as_string() : "";
+    if(filename.empty()) { json_parse_mesh_values(json, mesh); return mesh; }
+    json_load_task(filename, [=](){
+        if(json.object_contains("json_mesh")) {
+            json_texture_path_push(json.object_element("json_mesh").as_string());
+            json_load_mesh(json.object_element("json_mesh").as_string(), mesh);
+            json_texture_path_pop();
+        }
+        if(json.object_contains("bin_mesh")) {
+            auto loaded = load_binmesh(json.object_element("bin_mesh").as_string());
+            *mesh = std::move(*loaded); delete loaded;
+            mesh->skinning = json_adopt(mesh->skinning);
+            if(mesh->skinning) mesh->skinning->bone_animation = json_adopt(mesh->skinning->bone_animation);
+            mesh->simulation = json_adopt(mesh->simulation);
+        }
+        if(json.object_contains("obj_mesh")) {
+            auto loaded = load_obj_meshes(json.object_element("obj_mesh").as_string(), true)[0];
+            *mesh = std::move(*loaded); json_delete(loaded);
+        }
+        if(json.object_contains("ply_mesh")) {
+            auto loaded = load_ply_mesh(json.object_element("ply_mesh").as_string());
+            *mesh = std::move(*loaded); json_delete(loaded);
+        }
+        if(json.object_contains("cluster_mesh")) {
+            mesh->_clusters = open_clustermesh(json.object_element("cluster_mesh").as_string(), json_geometry_cache);
+        }
+        json_parse_mesh_values(json, mesh);
+    });
+    return mesh;
+}
+
+void json_parse_mesh_values(const jsonvalue& json, Mesh* mesh) {
     json_set_optvalue(json, mesh->frame, "frame");
     json_set_optvalue(json, mesh->pos, "pos");
     json_set_optvalue(json, mesh->norm, "norm");
@@ -258,22 +419,45 @@ Mesh* json_parse_mesh(const jsonvalue& json) {
     json_set_optvalue(json, mesh->point, "point");
     json_set_optvalue(json, mesh->line, "line");
     json_set_optvalue(json, mesh->spline, "spline");
+    json_set_optvalue(json, mesh->curve_radius, "curve_radius");
     if(json.object_contains("material")) mesh->mat = json_parse_material(json.object_element("material"));
+    if(not mesh->mat) mesh->mat = json_new<Material>();
     json_set_optvalue(json, mesh->subdivision_catmullclark_level, "subdivision_catmullclark_level");
     json_set_optvalue(json, mesh->subdivision_catmullclark_smooth, "subdivision_catmullclark_smooth");
+    json_set_optvalue(json, mesh->subdivision_catmullclark_lazy, "subdivision_catmullclark_lazy");
     json_set_optvalue(json, mesh->subdivision_bezier_level, "subdivision_bezier_level");
     json_set_optvalue(json, mesh->subdivision_bezier_uniform, "subdivision_bezier_uniform");
+    json_set_optvalue(json, mesh->compress_vertices, "compress_vertices");
     if(json.object_contains("animation")) mesh->animation = json_parse_frame_animation(json.object_element("animation"));
     if(json.object_contains("skinning")) mesh->skinning = json_parse_mesh_skinning(json.object_element("skinning"));
-    if(json.object_contains("json_skinning")) mesh->skinning = json_parse_mesh_skinning(load_json(json.object_element("json_skinning").as_string()));
+    if(json.object_contains("json_skinning")) mesh->skinning = json_load_mesh_skinning(json.object_element("json_skinning").as_string());
     if(json.object_contains("simulation")) mesh->simulation = json_parse_mesh_simulation(json.object_element("simulation"));
+    if (mesh->simulation and json.object_contains("simulation_solver")) {
+        auto solver = json.object_element("simulation_solver").as_string();
+        error_if_not(solver == "explicit" or solver == "implicit" or solver == "xpbd", "unknown simulation solver: %s\n", solver.c_str());
+        mesh->simulation->solver = (solver == "implicit") ? simulation_implicit : (solver == "xpbd") ? simulation_xpbd : simulation_explicit;
+    }
+    if (mesh->simulation) {
+        json_set_optvalue(json, mesh->simulation->implicit_steps, "implicit_steps");
+        json_set_optvalue(json, mesh->simulation->xpbd_substeps, "xpbd_substeps");
+        json_set_optvalue(json, mesh->simulation->xpbd_iterations, "xpbd_iterations");
+        json_set_optvalue(json, mesh->simulation->xpbd_jacobi, "xpbd_jacobi");
+        json_set_optvalue(json, mesh->simulation->bending_ks, "bending_ks");
+        json_set_optvalue(json, mesh->simulation->normals_epsilon, "normals_epsilon");
+    }
+    if(json.object_contains("collision")) mesh->collision = json_parse_mesh_collision(json.object_element("collision"));
+    auto compress_bones = false;
+    json_set_optvalue(json, compress_bones, "compress_bones");
+    if (mesh->skinning and compress_bones and not mesh->skinning->bone_animation) {
+        mesh->skinning->bone_animation = json_adopt(compress_bone_xforms(mesh->skinning->bone_xforms));
+        vector<vector<mat4f>>().swap(mesh->skinning->bone_xforms);
+    }
     if (mesh->skinning) {
         if (mesh->skinning->vert_rest_pos.empty()) mesh->skinning->vert_rest_pos = mesh->pos;
         if (mesh->skinning->vert_rest_norm.empty()) mesh->skinning->vert_rest_norm = mesh->norm;
         if (mesh->pos.empty()) mesh->pos = mesh->skinning->vert_rest_pos;
         if (mesh->norm.empty()) mesh->norm = mesh->skinning->vert_rest_norm;
     }
-    return mesh;
 }
 
 vector<Mesh*> json_parse_meshes(const jsonvalue& json) {
@@ -284,7 +468,7 @@ vector<Mesh*> json_parse_meshes(const jsonvalue& json) {
 }
 
 Light* json_parse_light(const jsonvalue& json) {
-    auto light = new Light();
+    auto light = json_new<Light>();
     json_set_optvalue(json, light->frame, "frame");
     json_set_optvalue(json, light->intensity, "intensity");
     return light;
@@ -298,22 +482,35 @@ vector<Light*> json_parse_lights(const jsonvalue& json) {
 }
 
 SceneAnimation* json_parse_scene_animation(const jsonvalue& json) {
-    auto animation = new SceneAnimation();
+    auto animation = json_new<SceneAnimation>();
     json_set_optvalue(json, animation->time, "time");
     json_set_optvalue(json, animation->length, "length");
     json_set_optvalue(json, animation->dt, "dt");
     json_set_optvalue(json, animation->simsteps, "simsteps");
+    json_set_optvalue(json, animation->adaptive_steps, "adaptive_steps");
+    json_set_optvalue(json, animation->implicit_fallback, "implicit_fallback");
     json_set_optvalue(json, animation->gravity, "gravity");
     json_set_optvalue(json, animation->bounce_dump, "bounce_dump");
+    json_set_optvalue(json, animation->motion_blur, "motion_blur");
+    json_set_optvalue(json, animation->shutter, "shutter");
     return animation;
 }
 
 Scene* json_parse_scene(const jsonvalue& json) {
     // prepare scene
     auto scene = new Scene();
+    json_arena = scene->arena;
     // camera
     if (json.object_contains("camera")) scene->camera = json_parse_camera(json.object_element("camera"));
     if (json.object_contains("lookat_camera")) scene->camera = json_parse_lookatcamera(json.object_element("lookat_camera"));
+    // textures (referenced by the materials parsed below)
+    json_set_optvalue(json, scene->texture_cache_size, "texture_cache_size");
+    scene->texture_cache = make_texture_cache((size_t)scene->texture_cache_size << 20);
+    json_texture_cache = scene->texture_cache;
+    // out-of-core geometry (referenced by the meshes parsed below)
+    json_set_optvalue(json, scene->geometry_cache_size, "geometry_cache_size");
+    scene->geometry_cache = make_cluster_cache((size_t)scene->geometry_cache_size << 20);
+    json_geometry_cache = scene->geometry_cache;
     // surfaces
     if(json.object_contains("surfaces")) scene->surfaces = json_parse_surfaces(json.object_element("surfaces"));
     // meshes
@@ -325,6 +522,10 @@ Scene* json_parse_scene(const jsonvalue& json) {
     if(json.object_contains("meshes")) {
         scene->meshes = json_parse_meshes(json.object_element("meshes"));
     }
+    if(json.object_contains("obj_meshes")) {
+        auto meshes = load_obj_meshes(json.object_element("obj_meshes").as_string());
+        scene->meshes.insert(scene->meshes.end(), meshes.begin(), meshes.end());
+    }
     // lights
     if(json.object_contains("lights")) scene->lights = json_parse_lights(json.object_element("lights"));
     // animation
@@ -337,6 +538,8 @@ Scene* json_parse_scene(const jsonvalue& json) {
     json_parse_opttexture(json, scene->background_txt, "background_txt");
     json_set_optvalue(json, scene->ambient, "ambient");
     json_set_optvalue(json, scene->accelerate_bvh, "accelerate_bvh");
+    json_set_optvalue(json, scene->subdivision_cache_size, "subdivision_cache_size");
+    json_set_optvalue(json, scene->subdivision_footprint, "subdivision_footprint");
     json_set_optvalue(json, scene->path_max_depth, "path_max_depth");
     json_set_optvalue(json, scene->path_sample_brdf, "path_sample_brdf");
     json_set_optvalue(json, scene->path_shadows, "path_shadows");
@@ -346,29 +549,506 @@ Scene* json_parse_scene(const jsonvalue& json) {
     return scene;
 }
 
+Mesh* load_json_mesh(const string& filename, const string& skinning_filename) {
+    json_texture_cache = make_texture_cache(0);
+    json_texture_paths = { "" };
+    json_load_pool = make_taskpool();
+    auto json = jsonvalue::object();
+    json["json_mesh"] = jsonvalue(filename);
+    if(not skinning_filename.empty()) json["json_skinning"] = jsonvalue(skinning_filename);
+    auto mesh = json_parse_mesh(jsonvalue(json));
+    delete_taskpool(json_load_pool);
+    json_load_pool = nullptr;
+    json_texture_cache = nullptr;
+    json_texture_paths = { "" };
+    return mesh;
+}
+
 Scene* load_json_scene(const string& filename) {
-    json_texture_cache.clear();
     json_texture_paths = { "" };
+    // files referenced by the scene are loaded concurrently while parsing
+    json_load_pool = make_taskpool();
+    auto start = std::chrono::steady_clock::now();
     auto scene = json_parse_scene(load_json(filename));
-    json_texture_cache.clear();
+    // without a memory budget, textures are loaded up front once all materials are known
+    taskpool_wait(json_load_pool);
+    if(not scene->texture_cache->budget) {
+        for(auto& entry : scene->texture_cache->handles) {
+            auto handle = entry.second;
+            json_load_task(handle->filename, [handle](){ texture_resolve(handle); });
+        }
+    }
+    delete_taskpool(json_load_pool);
+    json_load_pool = nullptr;
+    auto elapsed = std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now()-start).count();
+    message("loaded %s in %.1f ms\n", filename.c_str(), elapsed);
+    json_arena = nullptr;
+    json_texture_cache = nullptr;
+    json_geometry_cache = nullptr;
     json_texture_paths = { "" };
     return scene;
 }
 
+
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+
+// read a whole file into a zero terminated buffer (so that numbers can be parsed in place)
+static string _load_binary_file(const string& filename) {
+    std::ifstream stream(filename.c_str(), std::ifstream::in | std::ifstream::binary);
+    error_if_not(stream.good(), "cannot open file: %s\n", filename.c_str());
+    return string((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+}
+
+// directory of a file, including the trailing separator
+static string _file_dirname(const string& filename) {
+    auto pos = filename.rfind("/");
+    return (pos == string::npos) ? string() : filename.substr(0,pos+1);
+}
+
+// obj loading in parallel: files are split in at most obj_max_chunks chunks of at least
+// obj_min_chunk_size bytes, and vertices are merged in obj_dedup_partitions hash partitions
+#define obj_max_chunks 64
+#define obj_min_chunk_size (1 << 20)
+#define obj_dedup_partitions 16
+
+// obj vertex indices of a chunk: >= 0 for (0-based) global indices, chunk-local indices of
+// relative ones are stored shifted by -obj_relative, obj_missing marks missing indices
+#define obj_relative (1 << 30)
+#define obj_missing INT_MIN
+
+// obj elements parsed from a chunk of lines
+struct _ObjChunk {
+    vector<vec3f>   pos;            // positions
+    vector<vec2f>   texcoord;       // texture coordinates
+    vector<vec3f>   norm;           // normals
+    vector<vec3i>   verts;          // face and line vertices (position, texcoord, normal indices)
+    vector<vec4i>   elements;       // elements (first vertex, number of vertices, is line, material slot)
+    vector<string>  materials;      // material names used in the chunk (slot -1 inherits the previous chunk's)
+    vector<string>  mtllibs;        // material libraries
+};
+
+// skip spaces and tabs
+static const char* _obj_skip(const char* c) { while(*c == ' ' or *c == '\t') c ++; return c; }
+
+// read the rest of the line as a name
+static string _obj_name(const char* c) {
+    c = _obj_skip(c);
+    auto end = c;
+    while(*end and *end != '\n' and *end != '\r') end ++;
+    while(end > c and (end[-1] == ' ' or end[-1] == '\t')) end --;
+    return string(c, end);
+}
+
+// parse an obj index, making negative (relative) indices chunk-local
+static int _obj_index(const char*& c, int count) {
+    if(not isdigit(*c) and *c != '-' and *c != '+') return obj_missing;
+    auto end = (char*)nullptr;
+    auto idx = (int)strtol(c, &end, 10);
+    if(end == c) return obj_missing;
+    c = end;
+    return (idx > 0) ? idx - 1 : count + idx - obj_relative;
+}
+
+// parse the obj lines in [begin,end)
+static void _obj_parse_chunk(const char* begin, const char* end, _ObjChunk& chunk) {
+    auto material = -1;
+    for(auto line = begin; line < end; ) {
+        auto next = line;
+        while(next < end and *next != '\n') next ++;
+        if(next < end) next ++;
+        auto c = _obj_skip(line);
+        auto end_ptr = (char*)nullptr;
+        if(c[0] == 'v' and (c[1] == ' ' or c[1] == '\t')) {
+            auto p = zero3f;
+            p.x = strtof(c+2, &end_ptr); p.y = strtof(end_ptr, &end_ptr); p.z = strtof(end_ptr, &end_ptr);
+            chunk.pos.push_back(p);
+        } else if(c[0] == 'v' and c[1] == 't') {
+            auto t = zero2f;
+            t.x = strtof(c+2, &end_ptr); t.y = strtof(end_ptr, &end_ptr);
+            chunk.texcoord.push_back(t);
+        } else if(c[0] == 'v' and c[1] == 'n') {
+            auto n = zero3f;
+            n.x = strtof(c+2, &end_ptr); n.y = strtof(end_ptr, &end_ptr); n.z = strtof(end_ptr, &end_ptr);
+            chunk.norm.push_back(n);
+        } else if((c[0] == 'f' or c[0] == 'l') and (c[1] == ' ' or c[1] == '\t')) {
+            auto first = (int)chunk.verts.size();
+            auto is_line = (c[0] == 'l');
+            c += 2;
+            while(true) {
+                c = _obj_skip(c);
+                auto v = vec3i(obj_missing, obj_missing, obj_missing);
+                v.x = _obj_index(c, chunk.pos.size());
+                if(v.x == obj_missing) break;
+                if(*c == '/') { c ++; if(*c != '/') v.y = _obj_index(c, chunk.texcoord.size()); }
+                if(*c == '/') { c ++; v.z = _obj_index(c, chunk.norm.size()); }
+                chunk.verts.push_back(v);
+            }
+            chunk.elements.push_back(vec4i(first, chunk.verts.size()-first, is_line, material));
+        } else if(strncmp(c, "usemtl", 6) == 0) {
+            material = chunk.materials.size();
+            chunk.materials.push_back(_obj_name(c+6));
+        } else if(strncmp(c, "mtllib", 6) == 0) {
+            chunk.mtllibs.push_back(_obj_name(c+6));
+        }
+        line = next;
+    }
+}
+
+// load the materials of an obj material library
+static void _obj_load_mtl(const string& filename, map<string,Material*>& materials) {
+    auto text = _load_binary_file(filename);
+    auto dirname = _file_dirname(filename);
+    auto material = (Material*)nullptr;
+    for(auto line = text.c_str(); *line; ) {
+        auto next = strchr(line, '\n');
+        next = (next) ? next + 1 : line + strlen(line);
+        auto c = _obj_skip(line);
+        auto end_ptr = (char*)nullptr;
+        auto color = [&](const char* c){
+            auto v = zero3f;
+            v.x = strtof(c, &end_ptr); v.y = strtof(end_ptr, &end_ptr); v.z = strtof(end_ptr, &end_ptr);
+            return v;
+        };
+        auto texture = [&](const char* c){ return (json_texture_cache) ? json_texture(dirname + _obj_name(c)) : nullptr; };
+        if(strncmp(c, "newmtl", 6) == 0) { material = json_new<Material>(); materials[_obj_name(c+6)] = material; }
+        else if(not material) { }
+        else if(strncmp(c, "Kd", 2) == 0) material->kd = color(c+2);
+        else if(strncmp(c, "Ks", 2) == 0) material->ks = color(c+2);
+        else if(strncmp(c, "Ke", 2) == 0) material->ke = color(c+2);
+        else if(strncmp(c, "Ns", 2) == 0) material->n = strtof(c+2, &end_ptr);
+        else if(strncmp(c, "map_Kd", 6) == 0) material->kd_txt = texture(c+6);
+        else if(strncmp(c, "map_Ks", 6) == 0) material->ks_txt = texture(c+6);
+        else if(strncmp(c, "map_Ke", 6) == 0) material->ke_txt = texture(c+6);
+        else if(strncmp(c, "map_bump", 8) == 0) material->norm_txt = texture(c+8);
+        else if(strncmp(c, "norm", 4) == 0) material->norm_txt = texture(c+4);
+        line = next;
+    }
+}
+
+// hash of obj face vertex indices
+struct _ObjVertexHash {
+    size_t operator()(const vec3i& v) const { return ((size_t)v.x * 73856093u) ^ ((size_t)v.y * 19349663u) ^ ((size_t)v.z * 83492791u); }
+};
+
+// make a mesh from the resolved obj elements (first vertex in verts, number of vertices, is line),
+// merging vertices with the same indices
+static Mesh* _obj_make_mesh(const vector<vec3f>& pos, const vector<vec2f>& texcoord, const vector<vec3f>& norm,
+                            const vector<vec3i>& verts, const vector<vec3i>& elements) {
+    // deduplicate vertices in parallel: each partition of the hash space numbers its own vertices
+    // in order of first use, so that results do not depend on the number of threads
+    auto nverts = (int)verts.size();
+    auto part_ids = vector<int>(nverts);
+    auto part_verts = vector<vector<vec3i>>(obj_dedup_partitions);
+    // bucket vertex indices by partition in one pass, keeping their order within each partition
+    auto hash = _ObjVertexHash();
+    auto part_of = vector<int>(nverts);
+    auto part_first = vector<int>(obj_dedup_partitions+1, 0);
+    for(auto i : range(nverts)) { part_of[i] = (int)(hash(verts[i]) % obj_dedup_partitions); part_first[part_of[i]+1] ++; }
+    for(auto part : range(obj_dedup_partitions)) part_first[part+1] += part_first[part];
+    auto part_entries = vector<int>(nverts);
+    auto fill = vector<int>(part_first.begin(), part_first.end()-1);
+    for(auto i : range(nverts)) part_entries[fill[part_of[i]]++] = i;
+    parallel_for(obj_dedup_partitions, [&](int part){
+        auto ids = std::unordered_map<vec3i,int,_ObjVertexHash>();
+        for(auto k : range(part_first[part], part_first[part+1])) {
+            auto i = part_entries[k];
+            auto it = ids.find(verts[i]);
+            if(it == ids.end()) {
+                it = ids.insert(make_pair(verts[i], (int)part_verts[part].size())).first;
+                part_verts[part].push_back(verts[i]);
+            }
+            part_ids[i] = it->second;
+        }
+    });
+    auto offsets = vector<int>(obj_dedup_partitions+1, 0);
+    for(auto part : range(obj_dedup_partitions)) offsets[part+1] = offsets[part] + part_verts[part].size();
+    // vertex data (texcoords and normals only if all vertices have them)
+    auto mesh = json_new<Mesh>();
+    auto has_texcoord = true, has_norm = true;
+    for(auto& v : verts) { has_texcoord = has_texcoord and v.y >= 0; has_norm = has_norm and v.z >= 0; }
+    mesh->pos.resize(offsets.back());
+    if(has_texcoord) mesh->texcoord.resize(offsets.back());
+    if(has_norm) mesh->norm.resize(offsets.back());
+    for(auto part : range(obj_dedup_partitions)) {
+        for(auto i : range(part_verts[part].size())) {
+            auto& v = part_verts[part][i];
+            auto vid = offsets[part] + i;
+            mesh->pos[vid] = pos[v.x];
+            if(has_texcoord) mesh->texcoord[vid] = texcoord[v.y];
+            if(has_norm) mesh->norm[vid] = norm[v.z];
+        }
+    }
+    // elements (polygons are triangulated as fans, polylines split in segments)
+    auto vid = [&](int i){ return offsets[part_of[i]] + part_ids[i]; };
+    for(auto& element : elements) {
+        auto first = element.x, count = element.y;
+        if(element.z) { for(auto i : range(1,max(1,count))) mesh->line.push_back(vec2i(vid(first+i-1),vid(first+i))); }
+        else if(count == 4) mesh->quad.push_back(vec4i(vid(first),vid(first+1),vid(first+2),vid(first+3)));
+        else { for(auto i : range(2,count)) mesh->triangle.push_back(vec3i(vid(first),vid(first+i-1),vid(first+i))); }
+    }
+    return mesh;
+}
+
+vector<Mesh*> load_obj_meshes(const string& filename, bool merge) {
+    // split the file in chunks of lines parsed in parallel
+    auto text = _load_binary_file(filename);
+    auto nchunks = max(1, min(obj_max_chunks, (int)(text.size() / obj_min_chunk_size)));
+    auto bounds = vector<const char*>(nchunks+1);
+    for(auto i : range(nchunks+1)) {
+        auto c = text.c_str() + (size_t)text.size() * i / nchunks;
+        if(i > 0 and i < nchunks) { while(*c and *c != '\n') c ++; if(*c) c ++; }
+        bounds[i] = c;
+    }
+    auto chunks = vector<_ObjChunk>(nchunks);
+    parallel_for(nchunks, [&](int i){ _obj_parse_chunk(bounds[i], bounds[i+1], chunks[i]); });
+    
+    // concatenate vertex data, resolving chunk-local indices
+    auto pos = vector<vec3f>(), norm = vector<vec3f>();
+    auto texcoord = vector<vec2f>();
+    auto resolve = [](int idx, int base){ return (idx == obj_missing) ? -1 : (idx >= 0) ? idx : base + idx + obj_relative; };
+    for(auto& chunk : chunks) {
+        auto base = vec3i(pos.size(), texcoord.size(), norm.size());
+        for(auto& v : chunk.verts) v = vec3i(resolve(v.x,base.x), resolve(v.y,base.y), resolve(v.z,base.z));
+        pos.insert(pos.end(), chunk.pos.begin(), chunk.pos.end());
+        texcoord.insert(texcoord.end(), chunk.texcoord.begin(), chunk.texcoord.end());
+        norm.insert(norm.end(), chunk.norm.begin(), chunk.norm.end());
+    }
+    
+    // group elements by material, in order of first use (materials carry over chunk boundaries)
+    auto group_names = vector<string>();
+    auto group_ids = map<string,int>();
+    auto group_verts = vector<vector<vec3i>>();
+    auto group_elements = vector<vector<vec3i>>();
+    auto current = string();
+    for(auto& chunk : chunks) {
+        for(auto& element : chunk.elements) {
+            if(element.w >= 0) current = chunk.materials[element.w];
+            auto name = (merge) ? string() : current;
+            if(group_ids.find(name) == group_ids.end()) {
+                group_ids[name] = group_names.size();
+                group_names.push_back(name);
+                group_verts.push_back(vector<vec3i>());
+                group_elements.push_back(vector<vec3i>());
+            }
+            auto group = group_ids[name];
+            group_elements[group].push_back(vec3i(group_verts[group].size(), element.y, element.z));
+            for(auto i : range(element.y)) {
+                auto& v = chunk.verts[element.x+i];
+                error_if_not(v.x >= 0 and v.x < (int)pos.size() and v.y < (int)texcoord.size() and v.z < (int)norm.size(),
+                             "bad vertex index in obj file %s\n", filename.c_str());
+                group_verts[group].push_back(v);
+            }
+        }
+    }
+    
+    // materials
+    auto materials = map<string,Material*>();
+    if(not merge) {
+        for(auto& chunk : chunks) for(auto& mtllib : chunk.mtllibs) _obj_load_mtl(_file_dirname(filename) + mtllib, materials);
+    }
+    
+    // one mesh per material
+    auto meshes = vector<Mesh*>();
+    for(auto group : range(group_names.size())) {
+        auto mesh = _obj_make_mesh(pos, texcoord, norm, group_verts[group], group_elements[group]);
+        mesh->mat = (materials.find(group_names[group]) != materials.end()) ? materials[group_names[group]] : json_new<Material>();
+        meshes.push_back(mesh);
+    }
+    if(meshes.empty()) { meshes.push_back(json_new<Mesh>()); meshes.back()->mat = json_new<Material>(); }
+    return meshes;
+}
+
+// ply property (scalar or list of scalars)
+struct _PlyProperty {
+    string  name;                   // property name
+    int     type = 0;               // scalar type (size in bytes, negative for signed, 0 for float, 8 for double)
+    int     count_type = -1;        // scalar type of the list count (-1 for scalars)
+};
+
+// ply element
+struct _PlyElement {
+    string                  name;       // element name
+    int                     count = 0;  // number of elements
+    vector<_PlyProperty>    properties; // properties
+};
+
+// ply scalar type from its name
+static int _ply_type(const string& name) {
+    if(name == "char" or name == "int8") return -1;
+    if(name == "uchar" or name == "uint8") return 1;
+    if(name == "short" or name == "int16") return -2;
+    if(name == "ushort" or name == "uint16") return 2;
+    if(name == "int" or name == "int32") return -4;
+    if(name == "uint" or name == "uint32") return 4;
+    if(name == "float" or name == "float32") return 0;
+    if(name == "double" or name == "float64") return 8;
+    error("unsupported ply type %s\n", name.c_str());
+    return 0;
+}
+
+// size in bytes of a ply scalar type
+static int _ply_size(int type) { return (type == 0) ? 4 : abs(type); }
+
+// read a ply scalar, advancing the data pointer (ascii if format is 0, big endian if 2);
+// binary reads are checked against the end of the data
+static double _ply_read(const char*& c, const char* end, int type, int format) {
+    if(format == 0) { auto last = (char*)nullptr; auto v = strtod(c, &last); c = last; return v; }
+    unsigned char bytes[8];
+    auto size = _ply_size(type);
+    error_if_not(end - c >= size, "truncated ply file\n");
+    if(end - c < size) { c = end; return 0; }
+    memcpy(bytes, c, size);
+    if(format == 2) std::reverse(bytes, bytes + size);
+    c += size;
+    switch(type) {
+        case -1: { int8_t v; memcpy(&v, bytes, 1); return v; }
+        case 1: { uint8_t v; memcpy(&v, bytes, 1); return v; }
+        case -2: { int16_t v; memcpy(&v, bytes, 2); return v; }
+        case 2: { uint16_t v; memcpy(&v, bytes, 2); return v; }
+        case -4: { int32_t v; memcpy(&v, bytes, 4); return v; }
+        case 4: { uint32_t v; memcpy(&v, bytes, 4); return v; }
+        case 0: { float v; memcpy(&v, bytes, 4); return v; }
+        case 8: { double v; memcpy(&v, bytes, 8); return v; }
+        default: return 0;
+    }
+}
+
+Mesh* load_ply_mesh(const string& filename) {
+    auto text = _load_binary_file(filename);
+    // parse header
+    auto format = -1;
+    auto elements = vector<_PlyElement>();
+    auto c = text.c_str();
+    auto end = text.c_str() + text.size();
+    error_if_not(text.compare(0, 3, "ply") == 0, "bad ply file %s\n", filename.c_str());
+    while(c < end) {
+        auto next = (const char*)memchr(c, '\n', end - c);
+        next = (next) ? next + 1 : end;
+        std::istringstream line(string(c, next));
+        c = next;
+        auto keyword = string();
+        line >> keyword;
+        if(keyword == "format") {
+            auto name = string();
+            line >> name;
+            format = (name == "ascii") ? 0 : (name == "binary_little_endian") ? 1 : (name == "binary_big_endian") ? 2 : -1;
+        } else if(keyword == "element") {
+            elements.push_back(_PlyElement());
+            line >> elements.back().name >> elements.back().count;
+        } else if(keyword == "property") {
+            error_if_not(not elements.empty(), "bad ply file %s\n", filename.c_str());
+            auto property = _PlyProperty();
+            auto type = string();
+            line >> type;
+            if(type == "list") {
+                auto count_type = string();
+                line >> count_type >> type;
+                property.count_type = _ply_type(count_type);
+            }
+            property.type = _ply_type(type);
+            line >> property.name;
+            elements.back().properties.push_back(property);
+        } else if(keyword == "end_header") break;
+    }
+    error_if_not(format >= 0, "unsupported ply format in %s\n", filename.c_str());
+    for(auto& element : elements) error_if_not(element.count >= 0, "bad element count in ply file %s\n", filename.c_str());
+    
+    // read elements
+    auto mesh = json_new<Mesh>();
+    mesh->mat = json_new<Material>();
+    for(auto& element : elements) {
+        auto is_vertex = element.name == "vertex", is_face = element.name == "face";
+        // vertex properties are read by name in slots (0-2 for pos, 3-5 for norm, 6-7 for texcoord)
+        auto slot = vector<int>(element.properties.size(), -1);
+        auto has_norm = false, has_texcoord = false, has_lists = false;
+        auto stride = 0;
+        for(auto i : range(element.properties.size())) {
+            auto& property = element.properties[i];
+            auto& name = property.name;
+            has_lists = has_lists or property.count_type >= 0;
+            stride += _ply_size(property.type);
+            if(not is_vertex) continue;
+            if(name == "x") slot[i] = 0;
+            if(name == "y") slot[i] = 1;
+            if(name == "z") slot[i] = 2;
+            if(name == "nx") { slot[i] = 3; has_norm = true; }
+            if(name == "ny") slot[i] = 4;
+            if(name == "nz") slot[i] = 5;
+            if(name == "u" or name == "s" or name == "texture_u") { slot[i] = 6; has_texcoord = true; }
+            if(name == "v" or name == "t" or name == "texture_v") slot[i] = 7;
+        }
+        // read a vertex, advancing the data pointer
+        auto read_vertex = [&](const char*& c, int vid){
+            float v[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+            for(auto i : range(element.properties.size())) {
+                auto& property = element.properties[i];
+                auto count = (property.count_type < 0) ? 1 : (int)_ply_read(c, end, property.count_type, format);
+                for(auto k : range(count)) {
+                    auto value = _ply_read(c, end, property.type, format);
+                    if(k == 0 and property.count_type < 0 and slot[i] >= 0) v[slot[i]] = value;
+                }
+            }
+            mesh->pos[vid] = vec3f(v[0],v[1],v[2]);
+            if(has_norm) mesh->norm[vid] = vec3f(v[3],v[4],v[5]);
+            if(has_texcoord) mesh->texcoord[vid] = vec2f(v[6],v[7]);
+        };
+        if(is_vertex) {
+            mesh->pos.resize(element.count);
+            if(has_norm) mesh->norm.resize(element.count);
+            if(has_texcoord) mesh->texcoord.resize(element.count);
+        }
+        // binary vertices have a fixed size, so they are converted in parallel
+        if(is_vertex and format != 0 and not has_lists) {
+            error_if_not(c + (size_t)stride * element.count <= end, "truncated ply file %s\n", filename.c_str());
+            auto data = c;
+            parallel_for(element.count, [&](int vid){ auto v = data + (size_t)stride * vid; read_vertex(v, vid); });
+            c += (size_t)stride * element.count;
+            continue;
+        }
+        auto face = vector<int>();
+        for(auto e : range(element.count)) {
+            error_if_not(c < end, "truncated ply file %s\n", filename.c_str());
+            if(is_vertex) { read_vertex(c, e); continue; }
+            for(auto i : range(element.properties.size())) {
+                auto& property = element.properties[i];
+                if(property.count_type < 0) { _ply_read(c, end, property.type, format); continue; }
+                auto count = (int)_ply_read(c, end, property.count_type, format);
+                error_if_not(count >= 0 and (format == 0 or c + (size_t)count * _ply_size(property.type) <= end), "truncated ply file %s\n", filename.c_str());
+                face.resize(count);
+                for(auto k : range(count)) face[k] = (int)_ply_read(c, end, property.type, format);
+                if(not is_face or (property.name != "vertex_indices" and property.name != "vertex_index")) continue;
+                // polygons are triangulated as fans
+                if(count == 4) mesh->quad.push_back(vec4i(face[0],face[1],face[2],face[3]));
+                else { for(auto k : range(2,max(2,count))) mesh->triangle.push_back(vec3i(face[0],face[k-1],face[k])); }
+            }
+        }
+    }
+    auto nverts = (int)mesh->pos.size();
+    for(auto& t : mesh->triangle) error_if_not(t.x >= 0 and t.x < nverts and t.y >= 0 and t.y < nverts and t.z >= 0 and t.z < nverts, "bad face in ply file %s\n", filename.c_str());
+    for(auto& q : mesh->quad) error_if_not(q.x >= 0 and q.x < nverts and q.y >= 0 and q.y < nverts and q.z >= 0 and q.z < nverts and q.w >= 0 and q.w < nverts, "bad face in ply file %s\n", filename.c_str());
+    return mesh;
+}
+
 Scene* create_test_scene_sphere() {
-    auto camera             = new Camera();
+    auto scene              = new Scene();
+    
+    auto camera             = arena_new<Camera>(scene->arena);
     camera->frame           = frame3f(z3f*2.5,x3f,y3f,z3f);
     camera->focus           = 2.5f;
     
-    auto light_point        = new Light();
+    auto light_point        = arena_new<Light>(scene->arena);
     light_point->frame      = frame3f(z3f*5,x3f,y3f,z3f);
     light_point->intensity  = one3f*10;
     
-    auto surf_sphere        = new Surface();
-    surf_sphere->mat        = new Material();
+    auto surf_sphere        = arena_new<Surface>(scene->arena);
+    surf_sphere->mat        = arena_new<Material>(scene->arena);
     surf_sphere->mat->n     = 100;
     
-    auto scene              = new Scene();
     scene->background       = one3f*0.2;
     scene->ambient          = one3f*0.2;
     scene->image_width      = 512;
@@ -385,43 +1065,44 @@ Scene* create_test_scene_sphere() {
 
 Scene* create_test_scene_sphereplane() {
     // sphere, plane, and shadows
-    auto camera            = new Camera();
+    auto scene             = new Scene();
+    
+    auto camera            = arena_new<Camera>(scene->arena);
     camera->frame          = frame3f(z3f*4,x3f,y3f,z3f);
     camera->focus          = 4.0f;
     
-    auto light_point       = new Light();
+    auto light_point       = arena_new<Light>(scene->arena);
     light_point->frame     = frame3f({6,12,6},x3f,y3f,z3f);
     light_point->intensity = one3f*100;
     
-    auto surf_plane        = new Surface();
+    auto surf_plane        = arena_new<Surface>(scene->arena);
     surf_plane->frame      = frame3f(-y3f,x3f,-z3f,y3f);
     surf_plane->radius     = 100;
     surf_plane->isquad     = true;
-    surf_plane->mat        = new Material();
+    surf_plane->mat        = arena_new<Material>(scene->arena);
     surf_plane->mat->kd    = one3f;
     surf_plane->mat->ks    = zero3f;
     surf_plane->mat->n     = 100;
     surf_plane->mat->kr    = one3f*0.25f;
     
-    auto surf_sphere       = new Surface();
+    auto surf_sphere       = arena_new<Surface>(scene->arena);
     surf_sphere->frame     = identity_frame3f;
     surf_sphere->radius    = 1;
     surf_sphere->isquad    = false;
-    surf_sphere->mat       = new Material();
+    surf_sphere->mat       = arena_new<Material>(scene->arena);
     surf_sphere->mat->kd   = {1,0.75,0.75};
     surf_sphere->mat->ks   = zero3f;
     surf_sphere->mat->n    = 100;
     surf_sphere->mat->kr   = zero3f;
     
-    auto surf_light         = new Surface();
+    auto surf_light         = arena_new<Surface>(scene->arena);
     surf_light->frame       = frame3f({60,120,60},x3f,y3f,z3f);
     surf_light->radius      = 1.0f;
-    surf_light->mat         = new Material();
+    surf_light->mat         = arena_new<Material>(scene->arena);
     surf_light->mat->kd     = zero3f;
     surf_light->mat->ks     = zero3f;
     surf_light->mat->ke     = vec3f(1,1,1.1)*10000;
     
-    auto scene             = new Scene();
     scene->background      = one3f*0.2f; //one3f*0.2;
     scene->ambient         = zero3f; //one3f*0.2;
     scene->image_width     = 512;
@@ -5,9 +5,22 @@
 #include "json.h"
 #include "vmath.h"
 #include "image.h"
+#include "texture.h"
+#include "arena.h"
 
 // forward declarations
 struct BVHAccelerator;
+struct SubdivisionCache;
+struct ClusterMesh;
+struct ClusterCache;
+struct CompressedVertices;
+struct BoneAnimation;
+struct AnimationTable;
+struct SpringAdjacency;
+struct ImplicitSystem;
+struct SpatialHash;
+struct XpbdConstraints;
+struct VertexFaces;
 
 // blinn-phong material
 // textures are scaled by the respective coefficient and may be missing
@@ -18,11 +31,11 @@ struct Material {
     vec3f       kr = zero3f;            // reflection coefficient
     vec3f       ke = zero3f;            // emission coefficient
     
-    image3f*    kd_txt   = nullptr;     // diffuse texture
-    image3f*    ks_txt   = nullptr;     // specular texture
-    image3f*    kr_txt   = nullptr;     // reflection texture
-    image3f*    norm_txt = nullptr;     // normal texture
-    image3f*    ke_txt   = nullptr;     // emission texture
+    TextureHandle*  kd_txt   = nullptr; // diffuse texture
+    TextureHandle*  ks_txt   = nullptr; // specular texture
+    TextureHandle*  kr_txt   = nullptr; // reflection texture
+    TextureHandle*  norm_txt = nullptr; // normal texture
+    TextureHandle*  ke_txt   = nullptr; // emission texture
     
     bool        double_sided = false;   // double-sided material
     bool        microfacet   = false;   // use microfacet formulation
@@ -43,6 +56,30 @@ struct MeshSkinning {
     vector<vec4i>           vert_bone_ids;      // skin bones
     vector<vec4f>           vert_bone_weights;  // skin weights
     vector<vector<mat4f>>   bone_xforms;   // bone xforms (bone index is the first index)
+    BoneAnimation*          bone_animation = nullptr;   // compressed bone xforms (used instead of bone_xforms)
+
+    // skinning kernel streams (structure of arrays padded to 8 vertices, built on first use)
+    int                     _num_bones = -1;    // bones when the streams were built
+    int                     _stride = 0;        // padded vertex count of each stream
+    vector<float>           _rest_soa;          // rest pos x,y,z and norm x,y,z streams
+    vector<int>             _bone_soa;          // bone id streams (missing bones use an identity)
+    vector<float>           _weight_soa;        // bone weight streams
+    vector<float>           _bone_matrices;     // 3x4 bone matrices at the current time
+};
+
+// simulation integrators
+enum SimulationSolver { simulation_explicit = 0, simulation_implicit = 1, simulation_xpbd = 2 };
+
+// simulation counters, accumulated since the last reset
+struct SimulationStats {
+    int                     steps = 0;          // integration steps
+    int                     cg_iterations = 0;  // conjugate gradient iterations (backward euler)
+    int                     contacts = 0;       // particle contacts resolved
+    double                  forces_ms = 0;      // time computing spring forces (assembling the system, projecting constraints)
+    double                  integrate_ms = 0;   // time integrating and colliding with surfaces
+    double                  hash_ms = 0;        // time building the spatial hash
+    double                  contacts_ms = 0;    // time resolving particle contacts
+    int                     fallbacks = 0;      // frames taken with backward euler instead of explicit steps
 };
 
 // Mesh Simulation Data
@@ -65,12 +102,31 @@ struct MeshSimulation {
     // simulation compute data
     vector<vec3f>           vel;       // velocity
     vector<vec3f>           force;     // forces
+    
+    // integrator
+    int                     solver = simulation_explicit;   // explicit euler, backward euler or xpbd
+    int                     implicit_steps = 1;             // backward euler steps per frame
+    int                     xpbd_substeps = 10;             // xpbd substeps per frame
+    int                     xpbd_iterations = 1;            // xpbd constraint iterations per substep
+    bool                    xpbd_jacobi = false;            // parallel jacobi iterations instead of gauss-seidel
+    float                   bending_ks = 0;                 // xpbd bending stiffness across faces (0 for none)
+    float                   normals_epsilon = 0;            // skip normals around particles that moved less than this
+    
+    SpringAdjacency*        _adjacency = nullptr;           // springs of each particle (built at reset)
+    float                   _stable_dt = 0;                 // explicit step limit of the springs (computed on first use)
+    ImplicitSystem*         _implicit = nullptr;            // backward euler system (built on first step)
+    SpatialHash*            _hash = nullptr;                // particle grid (built on first contact pass)
+    XpbdConstraints*        _xpbd = nullptr;                // xpbd constraints (built on first step)
+    VertexFaces*            _vertex_faces = nullptr;        // faces of each particle (built at reset)
+    
+    SimulationStats         stats;                          // simulation counters
 };
 
 // Mesh Collision Data
+// simulated meshes with a collision radius keep their particles apart (cloth self collision)
 struct MeshCollision {
-    float                   radius;     // collision radius
-    bool                    isquad;     // whether the collision object is a sphere or quad
+    float                   radius = 0;     // collision radius
+    bool                    isquad = false; // whether the collision object is a sphere or quad
 };
 
 // indexed mesh data structure with vertex positions and normals,
@@ -85,12 +141,15 @@ struct Mesh {
     vector<int>     point;                      // point
     vector<vec2i>   line;                       // line
     vector<vec4i>   spline;                     // cubic bezier segments
-    Material*       mat = new Material();       // material
+    float           curve_radius = 0.01f;       // radius of lines and splines when ray traced
+    Material*       mat = nullptr;              // material
     
     int  subdivision_catmullclark_level  = 0;       // catmullclark subdiv level
     bool subdivision_catmullclark_smooth = false;   // catmullclark subdiv smooth
+    bool subdivision_catmullclark_lazy   = false;   // catmullclark subdiv on first ray hit (ray tracing)
     int  subdivision_bezier_level        = 0;       // bezier subdiv level
     bool subdivision_bezier_uniform      = true;    // bezier subdiv: true=uniform, false=de casteljau
+    bool compress_vertices               = false;   // quantize vertices after tesselation (ray tracing)
     
     FrameAnimation* animation  = nullptr;       // animation data
     MeshSkinning*   skinning   = nullptr;       // skinning data
@@ -98,6 +157,10 @@ struct Mesh {
     MeshCollision*  collision  = nullptr;       // collision data
 
     BVHAccelerator* bvh = nullptr;              // bvh accelerator for intersection
+    SubdivisionCache* _subdiv_cache = nullptr;  // lazily refined catmull-clark patches
+    ClusterMesh*    _clusters = nullptr;        // out-of-core triangles (instead of the arrays above)
+    CompressedVertices* _compressed = nullptr;  // compressed vertices (instead of pos, norm and texcoord)
+    range3f         _motion_bounds[2];          // world bounds at shutter open and close (motion blur)
 };
 
 // surface made of either a sphere or a quad (as determined by
@@ -108,9 +171,10 @@ struct Surface {
     frame3f     frame = identity_frame3f;   // frame
     float       radius = 1;                 // radius
     bool        isquad = false;             // whether it's a quad
-    Material*   mat = new Material();       // material
+    Material*   mat = nullptr;              // material
 
     FrameAnimation* animation = nullptr;    // animation data
+    range3f     _motion_bounds[2];          // world bounds at shutter open and close (motion blur)
     
     Mesh*       _display_mesh = nullptr;    // display mesh
     int         subdivision_level = 0;
@@ -141,8 +205,14 @@ struct SceneAnimation {
     int     length = 0;                     // animation length
     float   dt = 1/30.0f;                   // time in seconds for each time step
     int     simsteps = 100;                 // simulation steps for time step of animation
+    bool    adaptive_steps = false;         // choose explicit steps per mesh and frame (up to simsteps)
+    bool    implicit_fallback = false;      // take a backward euler frame when simsteps is not stable
     vec3f   gravity = {0,-9.8f,0};          // acceleration of gravity
     vec2f   bounce_dump = {0.001f,0.5f};    // loss of velocity at bounce (parallel,ortho)
+    bool    motion_blur = false;            // sample a time per camera ray within the shutter
+    vec2f   shutter = {0,0.5f};             // shutter open and close, in frames after time
+    
+    AnimationTable* _table = nullptr;       // compiled keyframe animations (built on first update)
 };
 
 // scene comprised of a camera, a list of meshes,
@@ -151,8 +221,12 @@ struct SceneAnimation {
 // if a ray misses) the ambient illumination, the
 // image resolution (image_width, image_height) and
 // the samples per pixel (image_samples).
+// scene objects are allocated in the scene arena and
+// released with it when the scene is deleted.
 struct Scene {
-    Camera*             camera = new Camera();  // camera
+    SceneArena*         arena = make_arena();   // owns the objects of the scene
+    
+    Camera*             camera = arena_new<Camera>(arena);  // camera
     
     int                 image_width = 1024;      // image resolution in x
     int                 image_height = 1024;     // image resolution in y
@@ -161,13 +235,13 @@ struct Scene {
     vector<Light*>      lights;                 // lights
     
     vec3f               background = one3f*0.2; // background color
-    image3f*            background_txt = nullptr;// background texture
+    TextureHandle*      background_txt = nullptr;// background texture
     vec3f               ambient = one3f*0.2;    // ambient illumination
     
     vector<Surface*>    surfaces;               // surfaces
     vector<Mesh*>       meshes;                 // meshes
     
-    SceneAnimation*     animation = new SceneAnimation();    // scene animation data
+    SceneAnimation*     animation = arena_new<SceneAnimation>(arena);    // scene animation data
     
     bool                draw_wireframe = false; // whether to use wireframe for interactive drawing
     bool                draw_animated = false;  // whether to draw with animation
@@ -175,6 +249,12 @@ struct Scene {
     bool                draw_captureimage = false;  // whether to capture the image in the next frame
     
     bool                accelerate_bvh = true;  // use bvh accel structure
+    int                 subdivision_cache_size = 1<<20; // max refined triangles kept by lazy subdivision
+    float               subdivision_footprint = 0;  // lazy subdivision micro-face size in pixels (0: use mesh level)
+    int                 texture_cache_size = 0; // texture memory budget in MB (0: load all textures up front)
+    TextureCache*       texture_cache = nullptr;// textures of the scene
+    int                 geometry_cache_size = 0;// out-of-core geometry memory budget in MB (0: unlimited)
+    ClusterCache*       geometry_cache = nullptr;// resident clusters of out-of-core meshes
     
     int                 path_max_depth = 2;     // maximum path depth
     bool                path_sample_brdf = true;// sample brdf in path tracing
@@ -183,10 +263,12 @@ struct Scene {
     bool                mipmapping = false;     // if mipmap?
     bool                russianRoulette = false; // if russian?
     bool                blurryReflection = false;// if blurry?
+    
+    ~Scene();                                   // releases the arena, the textures and the out-of-core meshes
 };
 
 // grab all scene textures
-vector<image3f*> get_textures(Scene* scene);
+vector<TextureHandle*> get_textures(Scene* scene);
 
 // create a Camera at eye, pointing towards center with up vector up, and with specified image plane params
 Camera* lookat_camera(vec3f eye, vec3f center, vec3f up, float width, float height, float dist);
@@ -197,6 +279,15 @@ void set_view_turntable(Camera* camera, float rotate_phi, float rotate_theta, fl
 // load a scene from a json file
 Scene* load_json_scene(const string& filename);
 
+// load a mesh from a json file, as referenced by json_mesh (and json_skinning if given)
+Mesh* load_json_mesh(const string& filename, const string& skinning_filename = "");
+
+// load the meshes of an obj file, one per material (with merge, a single mesh ignoring materials)
+vector<Mesh*> load_obj_meshes(const string& filename, bool merge = false);
+
+// load a mesh from an ascii or binary ply file
+Mesh* load_ply_mesh(const string& filename);
+
 // create test scenes that do not need to be loaded from a file
 Scene* create_test_scene(int scene_type);
 
@@ -0,0 +1,565 @@
+#include "simulation.h"
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+
+// 3x3 block times vector
+static inline vec3f _block_mul(const float* m, const vec3f& v) {
+    return vec3f(m[0]*v.x + m[1]*v.y + m[2]*v.z, m[3]*v.x + m[4]*v.y + m[5]*v.z, m[6]*v.x + m[7]*v.y + m[8]*v.z);
+}
+
+// run body(i) for each i in [0,count) in parallel chunks of simulation_chunk_size
+// (small meshes run on the calling thread)
+template<typename F>
+static void _parallel_chunks(int count, const F& body) {
+    if(count <= simulation_chunk_size) { for(auto i : range(count)) body(i); return; }
+    parallel_for((count + simulation_chunk_size - 1) / simulation_chunk_size, [count,&body](int c){
+        for(auto i : range(c*simulation_chunk_size, min(count, (c+1)*simulation_chunk_size))) body(i);
+    });
+}
+
+// adjacency of the particle pairs of springs or constraints
+static SpringAdjacency* _make_adjacency(const vector<vec2i>& pairs, int nparticles, SceneArena* arena) {
+    auto adjacency = arena_new<SpringAdjacency>(arena);
+    auto npairs = (int)pairs.size();
+    // count slots per particle
+    adjacency->first.assign(nparticles+1, 0);
+    for(auto& ids : pairs) { adjacency->first[ids.x+1] ++; adjacency->first[ids.y+1] ++; }
+    for(auto i : range(nparticles)) adjacency->first[i+1] += adjacency->first[i];
+    // place the two slots of each pair, in pair order within each row
+    auto fill = vector<int>(adjacency->first.begin(), adjacency->first.end()-1);
+    adjacency->particle.resize(2*npairs);
+    adjacency->spring_slots.resize(npairs);
+    for(auto s : range(npairs)) {
+        auto ids = pairs[s];
+        auto sx = fill[ids.x]++, sy = fill[ids.y]++;
+        adjacency->particle[sx] = ids.y;
+        adjacency->particle[sy] = ids.x;
+        adjacency->spring_slots[s] = vec2i(sx,sy);
+    }
+    adjacency->slot_force.resize(2*npairs);
+    return adjacency;
+}
+
+SpringAdjacency* make_spring_adjacency(MeshSimulation* simulation, int nparticles, SceneArena* arena) {
+    auto pairs = vector<vec2i>();
+    for(auto& spring : simulation->springs) pairs.push_back(spring.ids);
+    return _make_adjacency(pairs, nparticles, arena);
+}
+
+ImplicitSystem* make_implicit_system(MeshSimulation* simulation, int nparticles, SceneArena* arena) {
+    auto system = arena_new<ImplicitSystem>(arena);
+    auto nsprings = (int)simulation->springs.size();
+    system->blocks.resize(9*2*nsprings);
+    system->diagonal.resize(9*nparticles);
+    system->slot_rhs.resize(2*nsprings);
+    for(auto v : { &system->rhs, &system->dv, &system->residual, &system->direction, &system->product, &system->precond }) v->resize(nparticles);
+    return system;
+}
+
+// assemble the system of a backward euler step of length h
+static void _implicit_assemble(Scene* scene, Mesh* mesh, float h) {
+    auto simulation = mesh->simulation;
+    auto adjacency = simulation->_adjacency;
+    auto system = simulation->_implicit;
+    // each spring computes its force, its jacobians and writes its two off diagonal blocks
+    // (the stiffness across the spring is dropped when compressed to keep the system definite)
+    _parallel_chunks((int)simulation->springs.size(), [mesh,simulation,adjacency,system,h](int s){
+        auto spring = simulation->springs[s];
+        auto delta_pos = mesh->pos[spring.ids.y] - mesh->pos[spring.ids.x];
+        auto spring_length = length(delta_pos);
+        auto delta_vel = simulation->vel[spring.ids.y] - simulation->vel[spring.ids.x];
+        float ks[9], kd[9];
+        auto d = (spring_length > 0) ? delta_pos / spring_length : zero3f;
+        auto t = (spring_length > 0) ? max(0.0f, 1 - spring.restlength / spring_length) : 0.0f;
+        for(auto r : range(3)) for(auto c : range(3)) {
+            auto dd = d[r]*d[c];
+            ks[r*3+c] = spring.ks * (dd + t * (((r == c) ? 1 : 0) - dd));
+            kd[r*3+c] = spring.kd * dd;
+        }
+        // force on the first end and its change along the velocities
+        auto force = d * (spring_length - spring.restlength) * spring.ks + dot(delta_vel,d) * d * spring.kd;
+        auto slots = adjacency->spring_slots[s];
+        auto rhs = h * force + h * h * _block_mul(ks, delta_vel);
+        system->slot_rhs[slots.x] = rhs;
+        system->slot_rhs[slots.y] = -rhs;
+        // off diagonal blocks are -(h^2 ks + h kd) in both rows
+        auto bx = system->blocks.data() + 9*slots.x;
+        auto by = system->blocks.data() + 9*slots.y;
+        for(auto k : range(9)) bx[k] = by[k] = -(h * h * ks[k] + h * kd[k]);
+    });
+    // each row gathers its diagonal block and right hand side from its springs
+    _parallel_chunks((int)mesh->pos.size(), [scene,simulation,adjacency,system,h](int i){
+        auto diagonal = system->diagonal.data() + 9*i;
+        auto m = simulation->mass[i];
+        for(auto k : range(9)) diagonal[k] = (k % 4 == 0) ? m : 0;
+        auto rhs = h * scene->animation->gravity * m;
+        for(auto b : range(adjacency->first[i], adjacency->first[i+1])) {
+            for(auto k : range(9)) diagonal[k] -= system->blocks[9*b+k];
+            rhs += system->slot_rhs[b];
+        }
+        system->rhs[i] = rhs;
+        system->precond[i] = vec3f(1 / diagonal[0], 1 / diagonal[4], 1 / diagonal[8]);
+    });
+}
+
+// system matrix times vector, with pinned rows filtered out
+static void _implicit_multiply(MeshSimulation* simulation, const vector<vec3f>& v, vector<vec3f>& out) {
+    auto adjacency = simulation->_adjacency;
+    auto system = simulation->_implicit;
+    _parallel_chunks((int)v.size(), [simulation,adjacency,system,&v,&out](int i){
+        if(simulation->pinned[i]) { out[i] = zero3f; return; }
+        auto r = _block_mul(system->diagonal.data() + 9*i, v[i]);
+        for(auto b : range(adjacency->first[i], adjacency->first[i+1])) r += _block_mul(system->blocks.data() + 9*b, v[adjacency->particle[b]]);
+        out[i] = r;
+    });
+}
+
+// sum body over [0,count) in parallel chunks, where body may also update the element it sums;
+// chunk sums are added in chunk order, so that the result does not depend on the number of threads
+template<typename F>
+static float _parallel_sum(int count, vector<float>& partials, const F& body) {
+    auto nchunks = (count + simulation_chunk_size - 1) / simulation_chunk_size;
+    partials.resize(nchunks);
+    parallel_for(nchunks, [count,&partials,&body](int c){
+        auto sum = 0.0f;
+        for(auto i : range(c*simulation_chunk_size, min(count, (c+1)*simulation_chunk_size))) sum += body(i);
+        partials[c] = sum;
+    });
+    auto sum = 0.0f;
+    for(auto c : range(nchunks)) sum += partials[c];
+    return sum;
+}
+
+// solve the system for the velocity change with a filtered preconditioned conjugate gradient
+// (vector updates are fused with the reductions that follow them)
+static void _implicit_solve(MeshSimulation* simulation) {
+    auto system = simulation->_implicit;
+    auto n = (int)system->dv.size();
+    auto& dv = system->dv; auto& r = system->residual; auto& c = system->direction; auto& q = system->product;
+    // start from no change, with pinned particles constrained
+    auto delta = _parallel_sum(n, system->partials, [simulation,system,&dv,&r,&c](int i){
+        dv[i] = zero3f;
+        r[i] = (simulation->pinned[i]) ? zero3f : system->rhs[i];
+        c[i] = r[i] * system->precond[i];
+        return dot(r[i], c[i]);
+    });
+    auto target = delta * implicit_cg_tolerance * implicit_cg_tolerance;
+    // iterate
+    system->iterations = 0;
+    while(delta > target and system->iterations < implicit_cg_iterations) {
+        _implicit_multiply(simulation, c, q);
+        auto cq = _parallel_sum(n, system->partials, [&c,&q](int i){ return dot(c[i], q[i]); });
+        if(cq <= 0) break;
+        auto alpha = delta / cq;
+        auto delta_new = _parallel_sum(n, system->partials, [system,alpha,&dv,&r,&c,&q](int i){
+            dv[i] += alpha * c[i];
+            r[i] -= alpha * q[i];
+            return dot(r[i], r[i] * system->precond[i]);
+        });
+        auto beta = delta_new / delta;
+        _parallel_chunks(n, [simulation,system,beta,&r,&c](int i){
+            c[i] = (simulation->pinned[i]) ? zero3f : r[i] * system->precond[i] + beta * c[i];
+        });
+        delta = delta_new;
+        system->iterations ++;
+    }
+}
+
+void simulate_collide(Scene* scene, Mesh* mesh, int i) {
+    // for each mesh, check for collision
+    for(auto collider : scene->surfaces) {
+        // compute inside tests
+        auto inside = false; auto pos = zero3f, norm = zero3f;
+        // if quad
+        if(collider->isquad) {
+            // compute local poisition
+            auto lpos = transform_point_inverse(collider->frame, mesh->pos[i]);
+            // perform inside test
+            if(lpos.z < 0 and lpos.x > -collider->radius and lpos.x < collider->radius
+               and lpos.y > -collider->radius and lpos.y < collider->radius) {
+                // if inside, set position and normal
+                inside = true;
+                pos = transform_point(collider->frame, {lpos.x,lpos.y,0});
+                norm = collider->frame.z;
+            }
+            // else sphere
+        } else {
+            // inside test
+            auto rr = (mesh->pos[i]-collider->frame.o) / collider->radius;
+            if(length(rr) < 1) {
+                // if inside, set position and normal
+                inside = true;
+                pos = collider->frame.o + (collider->radius) * normalize(rr);
+                norm = normalize(rr);
+            }
+        }
+        // if inside
+        if(inside) {
+            // set particle position
+            mesh->pos[i] = pos;
+            // update velocity
+            auto vel = mesh->simulation->vel[i];
+            mesh->simulation->vel[i] = (vel - dot(norm,vel)*norm)*(1-scene->animation->bounce_dump.x) -
+            dot(norm, vel)*norm*(1-scene->animation->bounce_dump.y);
+        }
+    }
+}
+
+// milliseconds elapsed since start
+static double _elapsed_ms(const std::chrono::steady_clock::time_point& start) {
+    return std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now()-start).count();
+}
+
+// bucket of a grid cell
+static inline int _hash_bucket(const SpatialHash* hash, int x, int y, int z) {
+    return (int)(((unsigned)x * 73856093u ^ (unsigned)y * 19349663u ^ (unsigned)z * 83492791u) & (unsigned)(hash->first.size()-2));
+}
+
+// grid cell of a position
+static inline vec3i _hash_cell(const SpatialHash* hash, const vec3f& p) {
+    return vec3i((int)floor(p.x / hash->cell_size), (int)floor(p.y / hash->cell_size), (int)floor(p.z / hash->cell_size));
+}
+
+SpatialHash* make_spatial_hash(int nparticles, float cell_size, SceneArena* arena) {
+    auto hash = arena_new<SpatialHash>(arena);
+    auto nbuckets = 1;
+    while(nbuckets < 2*nparticles) nbuckets *= 2;
+    hash->cell_size = cell_size;
+    hash->cell.resize(nparticles);
+    hash->bucket.resize(nparticles);
+    hash->count = vector<std::atomic<int>>(nbuckets);
+    hash->first.resize(nbuckets+1);
+    hash->entries.resize(nparticles);
+    hash->dpos.resize(nparticles);
+    hash->dvel.resize(nparticles);
+    return hash;
+}
+
+// sort the particles of a mesh into the buckets of the hash
+static void _hash_build(SpatialHash* hash, Mesh* mesh) {
+    auto nbuckets = (int)hash->count.size();
+    // count the particles of each bucket
+    _parallel_chunks(nbuckets, [hash](int b){ hash->count[b].store(0, std::memory_order_relaxed); });
+    _parallel_chunks((int)mesh->pos.size(), [hash,mesh](int i){
+        auto c = _hash_cell(hash, mesh->pos[i]);
+        hash->cell[i] = c;
+        hash->bucket[i] = _hash_bucket(hash, c.x, c.y, c.z);
+        hash->count[hash->bucket[i]].fetch_add(1, std::memory_order_relaxed);
+    });
+    // bucket offsets, then place particles using the counts as cursors
+    hash->first[0] = 0;
+    for(auto b : range(nbuckets)) {
+        hash->first[b+1] = hash->first[b] + hash->count[b].load(std::memory_order_relaxed);
+        hash->count[b].store(hash->first[b], std::memory_order_relaxed);
+    }
+    _parallel_chunks((int)mesh->pos.size(), [hash](int i){
+        hash->entries[hash->count[hash->bucket[i]].fetch_add(1, std::memory_order_relaxed)] = i;
+    });
+    // sort each bucket by particle, since concurrent placement is in any order
+    _parallel_chunks(nbuckets, [hash](int b){
+        if(hash->first[b+1] - hash->first[b] > 1) std::sort(hash->entries.begin()+hash->first[b], hash->entries.begin()+hash->first[b+1]);
+    });
+}
+
+void simulate_contacts(Scene* scene, Mesh* mesh) {
+    auto simulation = mesh->simulation;
+    auto radius = mesh->collision->radius;
+    auto adjacency = simulation->_adjacency;
+    // build the hash
+    auto start = std::chrono::steady_clock::now();
+    if(not simulation->_hash or simulation->_hash->cell_size != 2*radius) simulation->_hash = make_spatial_hash((int)mesh->pos.size(), 2*radius, scene->arena);
+    auto hash = simulation->_hash;
+    _hash_build(hash, mesh);
+    simulation->stats.hash_ms += _elapsed_ms(start);
+    // each particle gathers its corrections from the overlapping particles in the cells around it;
+    // overlaps are split between the two particles (pinned particles do not move) and their
+    // approaching velocity is removed
+    start = std::chrono::steady_clock::now();
+    std::atomic<int> contacts(0);
+    _parallel_chunks((int)mesh->pos.size(), [mesh,simulation,adjacency,hash,radius,&contacts](int i){
+        hash->dpos[i] = zero3f; hash->dvel[i] = zero3f;
+        if(simulation->pinned[i]) return;
+        // the cells within the radius are the cell of the particle and its neighbors on the side
+        // of the nearest cell face along each axis
+        auto c = hash->cell[i], o = c;
+        for(auto k : range(3)) if(mesh->pos[i][k] / hash->cell_size - c[k] < 0.5f) o[k] -= 1;
+        for(auto dz : range(2)) for(auto dy : range(2)) for(auto dx : range(2)) {
+            auto nc = vec3i(o.x+dx, o.y+dy, o.z+dz);
+            auto b = _hash_bucket(hash, nc.x, nc.y, nc.z);
+            for(auto e : range(hash->first[b], hash->first[b+1])) {
+                // skip particles of other cells in the same bucket
+                auto j = hash->entries[e];
+                auto jc = hash->cell[j];
+                if(j == i or jc.x != nc.x or jc.y != nc.y or jc.z != nc.z) continue;
+                auto delta_pos = mesh->pos[i] - mesh->pos[j];
+                auto dist2 = dot(delta_pos, delta_pos);
+                if(dist2 >= radius*radius or dist2 == 0) continue;
+                auto dist = sqrt(dist2);
+                // skip particles connected by a spring
+                auto connected = false;
+                for(auto k : range(adjacency->first[i], adjacency->first[i+1])) connected = connected or adjacency->particle[k] == j;
+                if(connected) continue;
+                // split the correction
+                auto norm = delta_pos / dist;
+                auto share = (simulation->pinned[j]) ? 1.0f : 0.5f;
+                hash->dpos[i] += norm * (radius - dist) * share;
+                auto vn = dot(simulation->vel[i] - simulation->vel[j], norm);
+                if(vn < 0) hash->dvel[i] -= norm * vn * share;
+                if(i < j or simulation->pinned[j]) contacts.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    });
+    // apply corrections
+    _parallel_chunks((int)mesh->pos.size(), [mesh,simulation,hash](int i){
+        mesh->pos[i] += hash->dpos[i];
+        simulation->vel[i] += hash->dvel[i];
+    });
+    simulation->stats.contacts += contacts.load();
+    simulation->stats.contacts_ms += _elapsed_ms(start);
+}
+
+void simulate_explicit(Scene* scene, Mesh* mesh, int substeps) {
+    auto simulation = mesh->simulation;
+    // build the spring adjacency if the scene was not reset
+    if(not simulation->_adjacency) simulation->_adjacency = make_spring_adjacency(simulation, (int)mesh->pos.size(), scene->arena);
+    auto adjacency = simulation->_adjacency;
+    // compute time per step
+    auto ddt = scene->animation->dt / substeps;
+    // foreach simulation steps
+    for(int j = 0; j < substeps; j ++) {
+        // for each spring, compute spring force on its ends
+        auto start = std::chrono::steady_clock::now();
+        _parallel_chunks((int)simulation->springs.size(), [mesh,simulation,adjacency](int s){
+            auto spring = simulation->springs[s];
+            // compute spring distance and length (normalizing with the same length)
+            auto delta_pos = mesh->pos[spring.ids.y] - mesh->pos[spring.ids.x];
+            auto spring_length = length(delta_pos);
+            auto spring_dir = (spring_length == 0) ? zero3f : delta_pos * 1 / spring_length;
+            // compute static force
+            auto fs = spring_dir * (spring_length - spring.restlength) * spring.ks;
+            // compute dynamic force
+            auto delta_vel = simulation->vel[spring.ids.y] - simulation->vel[spring.ids.x];
+            auto fd = dot(delta_vel,spring_dir) * spring_dir * spring.kd;
+            auto slots = adjacency->spring_slots[s];
+            adjacency->slot_force[slots.x] = fs + fd;
+            adjacency->slot_force[slots.y] = -(fs + fd);
+        });
+        simulation->stats.forces_ms += _elapsed_ms(start);
+        // for each particle, gather forces, then apply newton laws
+        start = std::chrono::steady_clock::now();
+        _parallel_chunks((int)mesh->pos.size(), [scene,mesh,simulation,adjacency,ddt](int i){
+            // compute extenal forces (gravity) and accumulate spring forces
+            auto force = scene->animation->gravity * simulation->mass[i];
+            for(auto k : range(adjacency->first[i], adjacency->first[i+1])) force += adjacency->slot_force[k];
+            simulation->force[i] = force;
+            // if pinned, skip
+            if(simulation->pinned[i]) return;
+            // acceleration
+            auto acc = force / simulation->mass[i];
+            // update velocity and positions using Euler's method
+            mesh->pos[i] += ddt * simulation->vel[i] + ddt * ddt * acc / 2;
+            simulation->vel[i] += ddt * acc;
+            // check for collisions
+            simulate_collide(scene, mesh, i);
+        });
+        simulation->stats.integrate_ms += _elapsed_ms(start);
+        simulation->stats.steps ++;
+        // particle contacts
+        if(mesh->collision and mesh->collision->radius > 0) simulate_contacts(scene, mesh);
+    }
+}
+
+int simulate_stable_substeps(Scene* scene, Mesh* mesh) {
+    auto simulation = mesh->simulation;
+    // spring limit, bounding the largest frequencies of each particle by the sum of its spring
+    // constants over its mass (h < 2/omega for stiffness, h < 2/c for damping)
+    if(simulation->_stable_dt <= 0) {
+        auto ks = vector<float>(mesh->pos.size(), 0), kd = vector<float>(mesh->pos.size(), 0);
+        for(auto& spring : simulation->springs) {
+            ks[spring.ids.x] += spring.ks; ks[spring.ids.y] += spring.ks;
+            kd[spring.ids.x] += spring.kd; kd[spring.ids.y] += spring.kd;
+        }
+        simulation->_stable_dt = std::numeric_limits<float>::max();
+        for(auto i : range(mesh->pos.size())) {
+            if(simulation->pinned[i]) continue;
+            if(ks[i] > 0) simulation->_stable_dt = min(simulation->_stable_dt, 2 / sqrt(2 * ks[i] / simulation->mass[i]));
+            if(kd[i] > 0) simulation->_stable_dt = min(simulation->_stable_dt, simulation->mass[i] / kd[i]);
+        }
+    }
+    auto step = simulation_stability * simulation->_stable_dt;
+    // velocity limit, on the shortest length that must not be skipped
+    auto size = std::numeric_limits<float>::max();
+    for(auto& spring : simulation->springs) size = min(size, spring.restlength);
+    if(mesh->collision and mesh->collision->radius > 0) size = min(size, mesh->collision->radius);
+    for(auto surface : scene->surfaces) size = min(size, surface->radius);
+    auto speed = 0.0f;
+    for(auto i : range(mesh->pos.size())) if(not simulation->pinned[i]) speed = max(speed, length(simulation->vel[i]));
+    if(speed > 0 and size < std::numeric_limits<float>::max()) step = min(step, simulation_cfl * size / speed);
+    // substeps
+    return (int)min(ceil(scene->animation->dt / step), (float)std::numeric_limits<int>::max() / 2);
+}
+
+void simulate_adaptive(Scene* scene, Mesh* mesh) {
+    auto substeps = simulate_stable_substeps(scene, mesh);
+    if(substeps > scene->animation->simsteps and scene->animation->implicit_fallback) {
+        simulate_implicit(scene, mesh);
+        mesh->simulation->stats.fallbacks ++;
+    } else simulate_explicit(scene, mesh, clamp(substeps, 1, scene->animation->simsteps));
+}
+
+void simulate_implicit(Scene* scene, Mesh* mesh) {
+    auto simulation = mesh->simulation;
+    // build the spring adjacency if the scene was not reset, and the system on first use
+    if(not simulation->_adjacency) simulation->_adjacency = make_spring_adjacency(simulation, (int)mesh->pos.size(), scene->arena);
+    if(not simulation->_implicit) simulation->_implicit = make_implicit_system(simulation, (int)mesh->pos.size(), scene->arena);
+    // compute time per step
+    auto h = scene->animation->dt / max(1, simulation->implicit_steps);
+    // foreach step
+    for(int j = 0; j < max(1, simulation->implicit_steps); j ++) {
+        // solve for the velocity change
+        auto start = std::chrono::steady_clock::now();
+        _implicit_assemble(scene, mesh, h);
+        simulation->stats.forces_ms += _elapsed_ms(start);
+        start = std::chrono::steady_clock::now();
+        _implicit_solve(simulation);
+        simulation->stats.cg_iterations += simulation->_implicit->iterations;
+        // update velocities and positions, then collide (pinned particles stay put)
+        _parallel_chunks((int)mesh->pos.size(), [scene,mesh,simulation,h](int i){
+            if(simulation->pinned[i]) return;
+            simulation->vel[i] += simulation->_implicit->dv[i];
+            mesh->pos[i] += h * simulation->vel[i];
+            simulate_collide(scene, mesh, i);
+        });
+        simulation->stats.integrate_ms += _elapsed_ms(start);
+        simulation->stats.steps ++;
+        // particle contacts
+        if(mesh->collision and mesh->collision->radius > 0) simulate_contacts(scene, mesh);
+    }
+}
+
+XpbdConstraints* make_xpbd_constraints(Mesh* mesh, SceneArena* arena) {
+    auto simulation = mesh->simulation;
+    auto xpbd = arena_new<XpbdConstraints>(arena);
+    auto add = [xpbd](const vec2i& ids, float restlength, float ks, float kd) {
+        xpbd->ids.push_back(ids);
+        xpbd->restlength.push_back(restlength);
+        xpbd->compliance.push_back((ks > 0) ? 1 / ks : 0);
+        xpbd->damping.push_back(kd);
+    };
+    // springs
+    for(auto& spring : simulation->springs) add(spring.ids, spring.restlength, spring.ks, spring.kd);
+    // bending
+    if(simulation->bending_ks > 0) {
+        // for each edge, the neighbors of its ends in each of its faces
+        auto wings = map<pair<int,int>,vector<vec2i>>();
+        auto add_edge = [&wings](int a, int b, int na, int nb) {
+            if(a > b) { std::swap(a,b); std::swap(na,nb); }
+            wings[make_pair(a,b)].push_back(vec2i(na,nb));
+        };
+        for(auto f : mesh->triangle) { add_edge(f.x,f.y,f.z,f.z); add_edge(f.y,f.z,f.x,f.x); add_edge(f.z,f.x,f.y,f.y); }
+        for(auto f : mesh->quad) { add_edge(f.x,f.y,f.w,f.z); add_edge(f.y,f.z,f.x,f.w); add_edge(f.z,f.w,f.y,f.x); add_edge(f.w,f.x,f.z,f.y); }
+        // connect the neighbors across each edge shared by two faces (once for triangles)
+        for(auto& edge : wings) {
+            if(edge.second.size() != 2) continue;
+            auto w0 = edge.second[0], w1 = edge.second[1];
+            auto a = vec2i(w0.x,w1.x), b = vec2i(w0.y,w1.y);
+            add(a, dist(simulation->init_pos[a.x], simulation->init_pos[a.y]), simulation->bending_ks, 0);
+            if(b.x != a.x or b.y != a.y) add(b, dist(simulation->init_pos[b.x], simulation->init_pos[b.y]), simulation->bending_ks, 0);
+        }
+    }
+    // particles
+    auto nparticles = (int)simulation->init_pos.size();
+    xpbd->inv_mass.resize(nparticles);
+    for(auto i : range(nparticles)) xpbd->inv_mass[i] = (simulation->pinned[i]) ? 0 : 1 / simulation->mass[i];
+    xpbd->lambda.resize(xpbd->ids.size());
+    xpbd->prev.resize(nparticles);
+    xpbd->adjacency = _make_adjacency(xpbd->ids, nparticles, arena);
+    return xpbd;
+}
+
+// multiplier change of a constraint and its direction, with damping along the substep motion
+static inline float _xpbd_delta_lambda(Mesh* mesh, XpbdConstraints* xpbd, int c, float h, vec3f& norm) {
+    auto ids = xpbd->ids[c];
+    auto w = xpbd->inv_mass[ids.x] + xpbd->inv_mass[ids.y];
+    auto delta_pos = mesh->pos[ids.y] - mesh->pos[ids.x];
+    auto len = length(delta_pos);
+    if(w == 0 or len == 0) return 0;
+    norm = delta_pos / len;
+    auto alpha = xpbd->compliance[c] / (h * h);
+    auto gamma = xpbd->compliance[c] * xpbd->damping[c] / h;
+    auto motion = dot(norm, (mesh->pos[ids.y] - xpbd->prev[ids.y]) - (mesh->pos[ids.x] - xpbd->prev[ids.x]));
+    return (-(len - xpbd->restlength[c]) - alpha * xpbd->lambda[c] - gamma * motion) / ((1 + gamma) * w + alpha);
+}
+
+// project the constraints in order, each seeing the corrections of the previous ones
+static void _xpbd_gauss_seidel(Mesh* mesh, XpbdConstraints* xpbd, float h) {
+    for(auto c : range(xpbd->ids.size())) {
+        auto norm = zero3f;
+        auto dl = _xpbd_delta_lambda(mesh, xpbd, c, h, norm);
+        xpbd->lambda[c] += dl;
+        mesh->pos[xpbd->ids[c].x] -= xpbd->inv_mass[xpbd->ids[c].x] * dl * norm;
+        mesh->pos[xpbd->ids[c].y] += xpbd->inv_mass[xpbd->ids[c].y] * dl * norm;
+    }
+}
+
+// project the constraints in parallel from the same positions, then move each particle by the
+// average of its corrections
+static void _xpbd_jacobi(Mesh* mesh, XpbdConstraints* xpbd, float h) {
+    auto adjacency = xpbd->adjacency;
+    _parallel_chunks((int)xpbd->ids.size(), [mesh,xpbd,adjacency,h](int c){
+        auto norm = zero3f;
+        auto dl = _xpbd_delta_lambda(mesh, xpbd, c, h, norm);
+        xpbd->lambda[c] += dl;
+        auto slots = adjacency->spring_slots[c];
+        adjacency->slot_force[slots.x] = -xpbd->inv_mass[xpbd->ids[c].x] * dl * norm;
+        adjacency->slot_force[slots.y] = xpbd->inv_mass[xpbd->ids[c].y] * dl * norm;
+    });
+    _parallel_chunks((int)mesh->pos.size(), [mesh,adjacency](int i){
+        auto count = adjacency->first[i+1] - adjacency->first[i];
+        if(not count) return;
+        auto correction = zero3f;
+        for(auto k : range(adjacency->first[i], adjacency->first[i+1])) correction += adjacency->slot_force[k];
+        mesh->pos[i] += correction / count;
+    });
+}
+
+void simulate_xpbd(Scene* scene, Mesh* mesh) {
+    auto simulation = mesh->simulation;
+    // build the adjacency if the scene was not reset, and the constraints on first use
+    if(not simulation->_adjacency) simulation->_adjacency = make_spring_adjacency(simulation, (int)mesh->pos.size(), scene->arena);
+    if(not simulation->_xpbd) simulation->_xpbd = make_xpbd_constraints(mesh, scene->arena);
+    auto xpbd = simulation->_xpbd;
+    // compute time per substep
+    auto h = scene->animation->dt / max(1, simulation->xpbd_substeps);
+    // foreach substep
+    for(int j = 0; j < max(1, simulation->xpbd_substeps); j ++) {
+        // predict positions (pinned particles stay put)
+        auto start = std::chrono::steady_clock::now();
+        _parallel_chunks((int)mesh->pos.size(), [scene,mesh,simulation,xpbd,h](int i){
+            xpbd->prev[i] = mesh->pos[i];
+            if(xpbd->inv_mass[i] == 0) return;
+            simulation->vel[i] += h * scene->animation->gravity;
+            mesh->pos[i] += h * simulation->vel[i];
+        });
+        // project constraints
+        for(auto& lambda : xpbd->lambda) lambda = 0;
+        for(int k = 0; k < max(1, simulation->xpbd_iterations); k ++) {
+            if(simulation->xpbd_jacobi) _xpbd_jacobi(mesh, xpbd, h);
+            else _xpbd_gauss_seidel(mesh, xpbd, h);
+        }
+        simulation->stats.forces_ms += _elapsed_ms(start);
+        // update velocities from the projected positions, then collide
+        start = std::chrono::steady_clock::now();
+        _parallel_chunks((int)mesh->pos.size(), [scene,mesh,simulation,xpbd,h](int i){
+            if(xpbd->inv_mass[i] == 0) return;
+            simulation->vel[i] = (mesh->pos[i] - xpbd->prev[i]) / h;
+            simulate_collide(scene, mesh, i);
+        });
+        simulation->stats.integrate_ms += _elapsed_ms(start);
+        simulation->stats.steps ++;
+        // particle contacts
+        if(mesh->collision and mesh->collision->radius > 0) simulate_contacts(scene, mesh);
+    }
+}
@@ -0,0 +1,117 @@
+#ifndef _SIMULATION_H_
+#define _SIMULATION_H_
+
+#include "scene.h"
+
+#include <atomic>
+
+// particles per parallel simulation task
+#define simulation_chunk_size 1024
+
+// springs of each particle in compressed rows, built at reset
+// forces are computed once per spring and written to its two slots, then each particle sums
+// its contiguous slots in a fixed order, so that particles are updated in parallel with
+// results independent of the number of threads
+struct SpringAdjacency {
+    vector<int>         first;          // first slot of each particle (one more entry than particles)
+    vector<int>         particle;       // particle at the other end of each slot
+    vector<vec2i>       spring_slots;   // slots of each spring in the rows of its ends
+    vector<vec3f>       slot_force;     // spring force on the particle of each row
+};
+
+// build the spring adjacency of a simulation
+SpringAdjacency* make_spring_adjacency(MeshSimulation* simulation, int nparticles, SceneArena* arena);
+
+// backward euler solver (Baraff and Witkin, Large Steps in Cloth Simulation)
+// each step solves (M - h df/dv - h^2 df/dx) dv = h (f + h df/dx v) with a jacobi preconditioned
+// conjugate gradient; pinned particles are constrained to keep their velocity by filtering
+// the solver residual and search directions
+#define implicit_cg_iterations 200      // max conjugate gradient iterations per step
+#define implicit_cg_tolerance 1e-5f     // conjugate gradient residual tolerance (relative to the right hand side)
+
+// sparse symmetric system of 3x3 blocks in the rows of the spring adjacency
+// off diagonal blocks are stored per adjacency slot, so that each spring writes only its own
+// blocks and each row gathers its diagonal and right hand side without races
+struct ImplicitSystem {
+    vector<float>       blocks;         // off diagonal blocks (9 floats each)
+    vector<float>       diagonal;       // diagonal blocks (9 floats each)
+    vector<vec3f>       slot_rhs;       // right hand side contribution of each spring end
+    vector<vec3f>       rhs;            // right hand side
+    vector<vec3f>       dv;             // velocity change
+    vector<vec3f>       residual;       // cg residual
+    vector<vec3f>       direction;      // cg search direction
+    vector<vec3f>       product;        // cg matrix times direction
+    vector<vec3f>       precond;        // inverse of the diagonal (jacobi preconditioner)
+    vector<float>       partials;       // per chunk partial sums of the cg reductions
+    int                 iterations = 0; // cg iterations of the last step
+};
+
+// build the backward euler system of a simulation
+ImplicitSystem* make_implicit_system(MeshSimulation* simulation, int nparticles, SceneArena* arena);
+
+// uniform grid of particles hashed into buckets, rebuilt every step with a parallel counting sort
+// cells are twice the collision radius, so contacts are found in the 8 cells nearest to a
+// particle; the particles of each bucket are sorted by index, so that contacts are resolved in
+// an order independent of the number of threads
+struct SpatialHash {
+    float                       cell_size = 0;  // grid cell size
+    vector<vec3i>               cell;           // grid cell of each particle
+    vector<int>                 bucket;         // bucket of each particle
+    vector<std::atomic<int>>    count;          // particles of each bucket (counted concurrently)
+    vector<int>                 first;          // first entry of each bucket (one more entry than buckets)
+    vector<int>                 entries;        // particles sorted by bucket
+    vector<vec3f>               dpos;           // position correction of each particle
+    vector<vec3f>               dvel;           // velocity correction of each particle
+};
+
+// build the spatial hash of a simulation, with a power of two number of buckets
+SpatialHash* make_spatial_hash(int nparticles, float cell_size, SceneArena* arena);
+
+// keep the particles of a simulated mesh at least the collision radius apart
+// (particles connected by a spring are not tested, so cloth only collides with itself)
+void simulate_contacts(Scene* scene, Mesh* mesh);
+
+// extended position based dynamics (Macklin et al., XPBD and Small Steps in Physics Simulation)
+// springs become distance constraints with compliance 1/ks and damping kd, and bending
+// constraints are added between the vertices across each edge shared by two faces; each substep
+// predicts positions, projects the constraints, derives velocities and collides with the surfaces
+struct XpbdConstraints {
+    vector<vec2i>       ids;            // constraint particles (springs, then bending)
+    vector<float>       restlength;     // constraint rest length
+    vector<float>       compliance;     // constraint compliance (inverse stiffness)
+    vector<float>       damping;        // constraint damping
+    vector<float>       lambda;         // constraint lagrange multiplier
+    vector<float>       inv_mass;       // inverse mass of each particle (0 if pinned)
+    vector<vec3f>       prev;           // particle positions at the start of the substep
+    SpringAdjacency*    adjacency;      // constraints of each particle (jacobi iterations)
+};
+
+// build the xpbd constraints of a simulated mesh
+XpbdConstraints* make_xpbd_constraints(Mesh* mesh, SceneArena* arena);
+
+// collide a particle with the scene surfaces, projecting it out and damping its velocity
+void simulate_collide(Scene* scene, Mesh* mesh, int i);
+
+// explicit step limits: a step is a fraction of the spring stability limit, and moves the fastest
+// particle by at most a fraction of the shortest spring, collision radius or surface radius
+#define simulation_stability 0.9f       // fraction of the stability limit of the springs
+#define simulation_cfl 0.5f             // fraction of the shortest length moved per step
+
+// advance a simulated mesh by one animation frame with explicit euler substeps
+void simulate_explicit(Scene* scene, Mesh* mesh, int substeps);
+
+// explicit substeps needed by a simulated mesh for the next animation frame, from the stiffness
+// and damping of its springs over its masses and from its current velocities
+int simulate_stable_substeps(Scene* scene, Mesh* mesh);
+
+// advance a simulated mesh by one animation frame with as many explicit substeps as needed,
+// capped at the scene simsteps, falling back to backward euler if enabled
+void simulate_adaptive(Scene* scene, Mesh* mesh);
+
+// advance a simulated mesh by one animation frame with backward euler steps
+void simulate_implicit(Scene* scene, Mesh* mesh);
+
+// advance a simulated mesh by one animation frame with xpbd substeps
+void simulate_xpbd(Scene* scene, Mesh* mesh);
+
+#endif
@@ -0,0 +1,104 @@
+#include "taskpool.h"
+
+#include <atomic>
+#include <memory>
+
+// run the front task, with lock held on entry and on exit
+static void _taskpool_run_front(TaskPool* pool, std::unique_lock<std::mutex>& lock) {
+    auto task = std::move(pool->tasks.front());
+    pool->tasks.pop_front();
+    lock.unlock();
+    task();
+    lock.lock();
+    pool->pending --;
+    if(pool->pending == 0) pool->done_cond.notify_all();
+}
+
+// worker loop
+static void _taskpool_worker(TaskPool* pool) {
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    while(true) {
+        pool->task_cond.wait(lock, [pool](){ return pool->stop or not pool->tasks.empty(); });
+        if(pool->tasks.empty()) return;
+        _taskpool_run_front(pool, lock);
+    }
+}
+
+TaskPool* make_taskpool(int nthreads) {
+    auto pool = new TaskPool();
+    if(nthreads <= 0) nthreads = std::thread::hardware_concurrency();
+    if(nthreads <= 0) nthreads = 1;
+    while((int)pool->threads.size() < nthreads) pool->threads.push_back(std::thread(_taskpool_worker, pool));
+    return pool;
+}
+
+void taskpool_run(TaskPool* pool, const std::function<void()>& task) {
+    if(not pool) { task(); return; }
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    pool->tasks.push_back(task);
+    pool->pending ++;
+    pool->task_cond.notify_one();
+}
+
+void taskpool_wait(TaskPool* pool) {
+    if(not pool) return;
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    while(pool->pending > 0) {
+        if(not pool->tasks.empty()) _taskpool_run_front(pool, lock);
+        else pool->done_cond.wait(lock);
+    }
+}
+
+void delete_taskpool(TaskPool* pool) {
+    if(not pool) return;
+    taskpool_wait(pool);
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->stop = true;
+    }
+    pool->task_cond.notify_all();
+    for(auto& thread : pool->threads) thread.join();
+    delete pool;
+}
+
+// blocks of a parallel_for call, shared with the pool tasks that may start after it returns
+struct _ParallelBatch {
+    const std::function<void(int)>* body = nullptr;     // loop body (only called before parallel_for returns)
+    int                             count = 0;          // loop count
+    int                             nblocks = 0;        // number of blocks
+    std::atomic<int>                next;               // next block to take
+    std::atomic<int>                done;               // completed blocks
+    std::mutex                      mutex;              // guards the wait on done
+    std::condition_variable         done_cond;          // signaled when all blocks are done
+    
+    _ParallelBatch() : next(0), done(0) { }
+};
+
+// take and run blocks of a batch until none is left
+static void _parallel_run_blocks(_ParallelBatch* batch) {
+    for(auto b = batch->next.fetch_add(1); b < batch->nblocks; b = batch->next.fetch_add(1)) {
+        auto start = (int)((long long)batch->count*b/batch->nblocks), end = (int)((long long)batch->count*(b+1)/batch->nblocks);
+        for(auto i : range(start, end)) (*batch->body)(i);
+        if(batch->done.fetch_add(1) + 1 == batch->nblocks) {
+            std::lock_guard<std::mutex> lock(batch->mutex);
+            batch->done_cond.notify_all();
+        }
+    }
+}
+
+void parallel_for(int count, const std::function<void(int)>& body) {
+    static const auto hardware_threads = (int)std::thread::hardware_concurrency();
+    auto nthreads = (hardware_threads < count) ? hardware_threads : count;
+    if(nthreads <= 1) { for(auto i : range(count)) body(i); return; }
+    // workers are created once, one less than the hardware threads since the caller works too
+    static auto pool = make_taskpool(hardware_threads - 1);
+    auto batch = std::make_shared<_ParallelBatch>();
+    batch->body = &body;
+    batch->count = count;
+    batch->nblocks = nthreads;
+    for(auto w = 0; w < nthreads - 1; w ++) taskpool_run(pool, [batch](){ _parallel_run_blocks(batch.get()); });
+    _parallel_run_blocks(batch.get());
+    // wait for the blocks taken by the workers
+    std::unique_lock<std::mutex> lock(batch->mutex);
+    batch->done_cond.wait(lock, [&batch](){ return batch->done.load() == batch->nblocks; });
+}
@@ -0,0 +1,37 @@
+#ifndef _TASKPOOL_H_
+#define _TASKPOOL_H_
+
+#include "common.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// pool of worker threads running tasks in submission order
+// tasks may submit further tasks (e.g. a mesh file scheduling its textures),
+// so dependencies are expressed by submitting the dependent work from the task it depends on
+struct TaskPool {
+    vector<std::thread>                 threads;        // worker threads
+    std::deque<std::function<void()>>   tasks;          // queued tasks
+    int                                 pending = 0;    // queued or running tasks
+    bool                                stop = false;   // whether workers should exit
+    std::mutex                          mutex;          // guards the members above
+    std::condition_variable             task_cond;      // signaled when a task is queued
+    std::condition_variable             done_cond;      // signaled when pending reaches zero
+};
+
+// make a task pool (nthreads <= 0 uses the hardware concurrency)
+TaskPool* make_taskpool(int nthreads = 0);
+
+// submit a task (runs it immediately if pool is nullptr)
+void taskpool_run(TaskPool* pool, const std::function<void()>& task);
+
+// wait for all tasks, including the ones they submit; the caller runs queued tasks while waiting
+void taskpool_wait(TaskPool* pool);
+
+// wait for all tasks and stop the workers
+void delete_taskpool(TaskPool* pool);
+
+#endif
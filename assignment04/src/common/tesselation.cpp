@@ -1,5 +1,7 @@
 #include "tesselation.h"
 
+#include <algorithm>
+
 // make normals for each face - duplicates all vertex data
 void facet_normals(Mesh* mesh) {
     // allocates new arrays
@@ -73,6 +75,74 @@ void smooth_normals(Mesh* mesh) {
     for (auto& n : mesh->norm) n = normalize(n);
 }
 
+// run body over [0,count) in parallel chunks
+static void _normals_chunks(int count, const std::function<void(int)>& body) {
+    parallel_for((count + normals_chunk_size - 1) / normals_chunk_size, [count,&body](int c){
+        for(auto i : range(c*normals_chunk_size, min(count, (c+1)*normals_chunk_size))) body(i);
+    });
+}
+
+VertexFaces* make_vertex_faces(Mesh* mesh, SceneArena* arena) {
+    auto adjacency = arena_new<VertexFaces>(arena);
+    auto nverts = (int)mesh->pos.size();
+    auto ntriangles = (int)mesh->triangle.size();
+    auto nfaces = ntriangles + (int)mesh->quad.size();
+    // count faces per vertex
+    adjacency->first.assign(nverts+1, 0);
+    for(auto f : mesh->triangle) for(auto i : range(3)) adjacency->first[f[i]+1] ++;
+    for(auto f : mesh->quad) for(auto i : range(4)) adjacency->first[f[i]+1] ++;
+    for(auto i : range(nverts)) adjacency->first[i+1] += adjacency->first[i];
+    // place faces in face order within each row
+    auto fill = vector<int>(adjacency->first.begin(), adjacency->first.end()-1);
+    adjacency->faces.resize(adjacency->first[nverts]);
+    for(auto fid : range(ntriangles)) for(auto i : range(3)) adjacency->faces[fill[mesh->triangle[fid][i]]++] = fid;
+    for(auto fid : range(nfaces-ntriangles)) for(auto i : range(4)) adjacency->faces[fill[mesh->quad[fid][i]]++] = ntriangles+fid;
+    adjacency->face_norm.resize(nfaces);
+    adjacency->last_pos.resize(nverts);
+    adjacency->moved.resize(nverts);
+    adjacency->dirty.resize(nfaces);
+    return adjacency;
+}
+
+void update_smooth_normals(Mesh* mesh, VertexFaces* adjacency, float epsilon) {
+    auto nverts = (int)mesh->pos.size();
+    auto ntriangles = (int)mesh->triangle.size();
+    auto nfaces = ntriangles + (int)mesh->quad.size();
+    error_if_not((int)adjacency->first.size() == nverts+1 and (int)adjacency->face_norm.size() == nfaces, "vertex faces do not match the mesh\n");
+    auto all = not adjacency->valid or (int)mesh->norm.size() != nverts;
+    mesh->norm.resize(nverts);
+    // mark moved vertices, keeping the position of their update
+    _normals_chunks(nverts, [mesh,adjacency,epsilon,all](int i){
+        adjacency->moved[i] = all or distSqr(mesh->pos[i], adjacency->last_pos[i]) > epsilon*epsilon;
+        if(adjacency->moved[i]) adjacency->last_pos[i] = mesh->pos[i];
+    });
+    // compute the normals of faces with a moved vertex
+    _normals_chunks(nfaces, [mesh,adjacency,ntriangles](int fid){
+        if(fid < ntriangles) {
+            auto f = mesh->triangle[fid];
+            adjacency->dirty[fid] = adjacency->moved[f.x] or adjacency->moved[f.y] or adjacency->moved[f.z];
+            if(not adjacency->dirty[fid]) return;
+            adjacency->face_norm[fid] = normalize(cross(mesh->pos[f.y]-mesh->pos[f.x], mesh->pos[f.z]-mesh->pos[f.x]));
+        } else {
+            auto f = mesh->quad[fid-ntriangles];
+            adjacency->dirty[fid] = adjacency->moved[f.x] or adjacency->moved[f.y] or adjacency->moved[f.z] or adjacency->moved[f.w];
+            if(not adjacency->dirty[fid]) return;
+            adjacency->face_norm[fid] = normalize(normalize(cross(mesh->pos[f.y]-mesh->pos[f.x], mesh->pos[f.z]-mesh->pos[f.x])) +
+                                                  normalize(cross(mesh->pos[f.z]-mesh->pos[f.x], mesh->pos[f.w]-mesh->pos[f.x])));
+        }
+    });
+    // gather the normals of vertices around changed faces
+    _normals_chunks(nverts, [mesh,adjacency](int i){
+        auto changed = false;
+        for(auto k : range(adjacency->first[i], adjacency->first[i+1])) changed = changed or adjacency->dirty[adjacency->faces[k]];
+        if(not changed) return;
+        auto n = zero3f;
+        for(auto k : range(adjacency->first[i], adjacency->first[i+1])) n += adjacency->face_norm[adjacency->faces[k]];
+        mesh->norm[i] = normalize(n);
+    });
+    adjacency->valid = true;
+}
+
 // smooth out tangents
 void smooth_tangents(Mesh* polyline) {
     // set tangent array
@@ -171,6 +241,54 @@ void subdivide_catmullclark(Mesh* subdiv) {
     delete mesh;
 }
 
+// apply Catmull-Clark subdivision to one face of an all-quad mesh
+// the 1-ring of a quad fully determines its refined vertices at any level, so the
+// face is subdivided together with its neighbors and only its descendants are kept
+Mesh* subdivide_catmullclark_face(Mesh* mesh, const vector<vector<int>>& vertex_faces, int fid, int level) {
+    // collect the 1-ring faces, with the face itself first
+    auto faces = vector<int>{fid};
+    for(auto i : range(4)) {
+        for(auto f : vertex_faces[mesh->quad[fid][i]]) {
+            if(std::find(faces.begin(), faces.end(), f) == faces.end()) faces.push_back(f);
+        }
+    }
+    // make a local mesh with the 1-ring faces only
+    auto local = new Mesh();
+    auto vmap = map<int,int>();
+    for(auto f : faces) {
+        auto q = mesh->quad[f];
+        for(auto i : range(4)) {
+            if(vmap.find(q[i]) == vmap.end()) { vmap[q[i]] = local->pos.size(); local->pos.push_back(mesh->pos[q[i]]); }
+            q[i] = vmap[q[i]];
+        }
+        local->quad.push_back(q);
+    }
+    // subdivide the local mesh; the descendants of quad k are quads [k*4^level,(k+1)*4^level)
+    local->subdivision_catmullclark_level = level;
+    local->subdivision_catmullclark_smooth = mesh->subdivision_catmullclark_smooth;
+    if(level) subdivide_catmullclark(local);
+    else if(local->subdivision_catmullclark_smooth) smooth_normals(local);
+    else facet_normals(local);
+    // keep only the descendants of the face, compacting vertices
+    auto patch = new Mesh();
+    auto pmap = map<int,int>();
+    for(auto qi : range(1 << (2*level))) {
+        auto q = local->quad[qi];
+        for(auto i : range(4)) {
+            if(pmap.find(q[i]) == pmap.end()) {
+                pmap[q[i]] = patch->pos.size();
+                patch->pos.push_back(local->pos[q[i]]);
+                patch->norm.push_back(local->norm[q[i]]);
+            }
+            q[i] = pmap[q[i]];
+        }
+        patch->quad.push_back(q);
+    }
+    // clear
+    delete local;
+    return patch;
+}
+
 // subdivide bezier spline into line segments (assume bezier has only bezier segments and no lines)
 void subdivide_bezier(Mesh* bezier) {
     // skip is needed
@@ -39,6 +39,30 @@ void facet_normals(Mesh* mesh);
 // compute smoothed normals
 void smooth_normals(Mesh* mesh);
 
+// vertices per parallel normal update task
+#define normals_chunk_size 1024
+
+// faces of each vertex in compressed rows (triangles, then quads offset by the triangle count),
+// built once for meshes whose vertices move but whose faces do not; face normals are computed
+// once per face, then each vertex sums its faces in face order, so updates run in parallel in
+// place and match smooth_normals
+struct VertexFaces {
+    vector<int>         first;          // first face of each vertex (one more entry than vertices)
+    vector<int>         faces;          // faces of each vertex
+    vector<vec3f>       face_norm;      // face normals (normalized, as in smooth_normals)
+    vector<vec3f>       last_pos;       // vertex positions at the last normal update
+    vector<char>        moved;          // vertices moved since the last update
+    vector<char>        dirty;          // faces with a moved vertex
+    bool                valid = false;  // whether normals were computed at least once
+};
+
+// build the vertex to face adjacency of a mesh
+VertexFaces* make_vertex_faces(Mesh* mesh, SceneArena* arena);
+
+// update smoothed normals in place, only around vertices that moved more than epsilon since
+// their last update (all vertices the first time)
+void update_smooth_normals(Mesh* mesh, VertexFaces* adjacency, float epsilon);
+
 // compute smoothed line tangents
 void smooth_tangents(Mesh* lines);
 
@@ -48,6 +72,10 @@ void subdivide(Scene* scene);
 // apply catmull-clark subdivision to the mesh recursively
 void subdivide_catmullclark(Mesh* subdiv);
 
+// apply catmull-clark subdivision to a single quad of an all-quad mesh using only its 1-ring
+// (vertex_faces lists the quads around each vertex); returns the refined quads of the face only
+Mesh* subdivide_catmullclark_face(Mesh* mesh, const vector<vector<int>>& vertex_faces, int fid, int level);
+
 // apply bezier spline subdivision
 void subdivide_bezier(Mesh* splines);
 
@@ -0,0 +1,129 @@
+#include "texture.h"
+
+// 8-bit texels are linear in this renderer (as read by read_png)
+static float* _make_ldr_lut(float* lut) { for(auto i : range(256)) lut[i] = i / 255.0f; return lut; }
+float texture3f_ldr_lut[256];
+static float* _texture3f_ldr_lut_init = _make_ldr_lut(texture3f_ldr_lut);
+
+unsigned short float_to_half(float f) {
+    unsigned bits; memcpy(&bits, &f, sizeof(bits));
+    auto sign = (bits >> 16) & 0x8000;
+    auto exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+    auto mantissa = bits & 0x7fffff;
+    if(((bits >> 23) & 0xff) == 0xff) return sign | 0x7c00 | ((mantissa) ? 0x200 : 0);
+    if(exponent <= 0) return sign;
+    if(exponent >= 31) return sign | 0x7bff;
+    // round to nearest (a carry into the exponent is still correct)
+    auto h = (exponent << 10) | (mantissa >> 13);
+    if((mantissa & 0x1000) and h < 0x7bff) h += 1;
+    return sign | h;
+}
+
+// convert an image into a tiled texture level
+static texture3f::Level _make_texture_level(const image3f& img, bool hdr) {
+    auto level = texture3f::Level();
+    level.width = img.width();
+    level.height = img.height();
+    level.tiles_x = (img.width() + texture3f_tile_size - 1) / texture3f_tile_size;
+    auto tiles_y = (img.height() + texture3f_tile_size - 1) / texture3f_tile_size;
+    auto size = 3 * level.tiles_x * tiles_y * texture3f_tile_size * texture3f_tile_size;
+    if(hdr) level.hdr.resize(size, 0);
+    else level.ldr.resize(size, 0);
+    for(auto j : range(img.height())) {
+        for(auto i : range(img.width())) {
+            auto idx = 3*texture3f::texel_index(level, i, j);
+            auto& c = img.at(i,j);
+            for(auto k : range(3)) {
+                if(hdr) level.hdr[idx+k] = float_to_half(c[k]);
+                else level.ldr[idx+k] = (unsigned char)clamp((int)round(c[k]*255), 0, 255);
+            }
+        }
+    }
+    return level;
+}
+
+texture3f* make_texture(const image3f& img, bool hdr) {
+    auto texture = new texture3f();
+    texture->is_hdr = hdr;
+    texture->levels.push_back(_make_texture_level(img, hdr));
+    for(auto& mip : make_mipmap(img)) texture->levels.push_back(_make_texture_level(mip, hdr));
+    return texture;
+}
+
+TextureCache* make_texture_cache(size_t budget) {
+    auto cache = new TextureCache();
+    cache->budget = budget;
+    return cache;
+}
+
+void delete_texture_cache(TextureCache* cache) {
+    if(not cache) return;
+    for(auto& entry : cache->handles) delete entry.second;
+    delete cache;
+}
+
+TextureHandle* texture_cache_handle(TextureCache* cache, const string& filename, const std::function<texture3f*()>& load) {
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    if(cache->handles.find(filename) != cache->handles.end()) return cache->handles[filename];
+    auto handle = new TextureHandle();
+    handle->filename = filename;
+    handle->load = load;
+    handle->cache = cache;
+    cache->handles[filename] = handle;
+    return handle;
+}
+
+// resolve the resident texels of a handle, marking them as used (nullptr texture if not loaded)
+static TextureRef _texture_cache_hit(TextureCache* cache, TextureHandle* handle) {
+    auto ref = TextureRef();
+    if(not cache->budget) {
+        ref.texture = handle->_resident.load(std::memory_order_acquire);
+        return ref;
+    }
+    ref._hold = std::atomic_load(&handle->_texture);
+    ref.texture = ref._hold.get();
+    if(not ref.texture) return ref;
+    // only write the reference bit if cleared, so that hits do not share cache lines across threads
+    if(not handle->_used.load(std::memory_order_relaxed)) handle->_used.store(true, std::memory_order_relaxed);
+    cache->hits.fetch_add(1, std::memory_order_relaxed);
+    return ref;
+}
+
+TextureRef texture_resolve(TextureHandle* handle) {
+    if(not handle) return TextureRef();
+    auto cache = handle->cache;
+    auto ref = _texture_cache_hit(cache, handle);
+    if(ref.texture) return ref;
+    // load once even if several threads miss together
+    std::lock_guard<std::mutex> load_lock(handle->_load_mutex);
+    ref = _texture_cache_hit(cache, handle);
+    if(ref.texture) return ref;
+    auto texture = std::shared_ptr<const texture3f>(handle->load());
+    // insert the texture
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    cache->misses ++;
+    handle->_size = texture->size_bytes();
+    handle->_used = true;
+    std::atomic_store(&handle->_texture, texture);
+    handle->_resident.store(texture.get(), std::memory_order_release);
+    cache->resident.push_back(handle);
+    cache->size += handle->_size;
+    // evict textures whose reference bit is cleared under the clock hand, always keeping the one
+    // just loaded; lookups may set bits again while sweeping, so bits are honored for two sweeps only
+    auto second_chances = 2 * (int)cache->resident.size();
+    while(cache->budget and cache->size > cache->budget and cache->resident.size() > 1) {
+        cache->hand %= (int)cache->resident.size();
+        auto evicted = cache->resident[cache->hand];
+        if(evicted == handle or (evicted->_used.exchange(false) and second_chances-- > 0)) { cache->hand ++; continue; }
+        cache->resident[cache->hand] = cache->resident.back();
+        cache->resident.pop_back();
+        cache->size -= evicted->_size;
+        evicted->_resident.store(nullptr, std::memory_order_release);
+        std::atomic_store(&evicted->_texture, std::shared_ptr<const texture3f>());
+        evicted->_size = 0;
+        cache->evictions ++;
+    }
+    ref.texture = texture.get();
+    if(cache->budget) ref._hold = texture;
+    return ref;
+}
@@ -0,0 +1,144 @@
+#ifndef _TEXTURE_H_
+#define _TEXTURE_H_
+
+#include "common.h"
+#include "vmath.h"
+#include "image.h"
+
+#include <cstring>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#define texture3f_tile_bits 3
+#define texture3f_tile_size (1 << texture3f_tile_bits)
+
+// lookup table decoding 8-bit texels
+extern float texture3f_ldr_lut[256];
+
+// decode a half float
+inline float half_to_float(unsigned short h) {
+    auto sign = (unsigned)(h >> 15) << 31;
+    auto exponent = (unsigned)(h >> 10) & 0x1f;
+    auto mantissa = (unsigned)h & 0x3ff;
+    if(exponent == 0) return ((sign) ? -1.0f : 1.0f) * mantissa * (1.0f / 16777216.0f);
+    auto bits = (exponent == 31) ? (sign | 0x7f800000 | (mantissa << 13)) : (sign | ((exponent + 112) << 23) | (mantissa << 13));
+    float f; memcpy(&f, &bits, sizeof(f)); return f;
+}
+
+// encode a half float (rounds to nearest, saturates large values, flushes denormals to zero)
+unsigned short float_to_half(float f);
+
+// interleave the bits of a tile-local coordinate pair (morton order)
+inline int morton2(int i, int j) {
+    auto spread = [](int x) { x = (x | (x << 2)) & 0x33; x = (x | (x << 1)) & 0x55; return x; };
+    return spread(i) | (spread(j) << 1);
+}
+
+// compact color texture used for rendering, with a full mip chain
+// ldr textures store 8-bit texels (decoded with texture3f_ldr_lut), hdr textures store
+// half float texels; texels are grouped in square tiles that are morton ordered inside,
+// so that the four texels of a bilinear fetch are mostly in the same cache line
+struct texture3f {
+    // single mip level
+    struct Level {
+        int                     width = 0;      // level width
+        int                     height = 0;     // level height
+        int                     tiles_x = 0;    // number of tiles in x
+        vector<unsigned char>   ldr;            // 8-bit texels (ldr textures)
+        vector<unsigned short>  hdr;            // half float texels (hdr textures)
+    };
+
+    bool            is_hdr = false;     // whether texels are stored as half floats
+    vector<Level>   levels;             // mip levels (level 0 is the full resolution)
+
+    // number of mip levels
+    int num_levels() const { return levels.size(); }
+    // level width
+    int width(int l = 0) const { return levels[l].width; }
+    // level height
+    int height(int l = 0) const { return levels[l].height; }
+    // memory used by the texels of all levels
+    size_t size_bytes() const {
+        auto size = (size_t)0;
+        for(auto& level : levels) size += level.ldr.size() + level.hdr.size() * sizeof(unsigned short);
+        return size;
+    }
+
+    // texel offset in the tiled layout
+    static int texel_index(const Level& level, int i, int j) {
+        auto tile = (j >> texture3f_tile_bits) * level.tiles_x + (i >> texture3f_tile_bits);
+        return (tile << (2*texture3f_tile_bits)) + morton2(i & (texture3f_tile_size-1), j & (texture3f_tile_size-1));
+    }
+
+    // texel access
+    vec3f at(int l, int i, int j) const {
+        auto& level = levels[l];
+        auto idx = 3*texel_index(level, i, j);
+        if(is_hdr) return vec3f(half_to_float(level.hdr[idx+0]),half_to_float(level.hdr[idx+1]),half_to_float(level.hdr[idx+2]));
+        return vec3f(texture3f_ldr_lut[level.ldr[idx+0]],texture3f_ldr_lut[level.ldr[idx+1]],texture3f_ldr_lut[level.ldr[idx+2]]);
+    }
+};
+
+// make a texture from an image, building its mip chain; hdr keeps half float texels
+texture3f* make_texture(const image3f& img, bool hdr);
+
+struct TextureCache;
+
+// texture referenced by materials, with texels managed by a texture cache;
+// texels are loaded on first lookup and released when evicted
+struct TextureHandle {
+    string                              filename;           // texture file (cache key)
+    std::function<texture3f*()>         load;               // loads the texels
+    TextureCache*                       cache = nullptr;    // owning cache
+    
+    std::shared_ptr<const texture3f>    _texture;           // resident texels (nullptr if not loaded, accessed atomically)
+    std::atomic<const texture3f*>       _resident;          // resident texels, read without a lock when nothing is evicted
+    std::atomic<bool>                   _used;              // clock reference bit, set by lookups
+    size_t                              _size = 0;          // memory of the resident texels
+    std::mutex                          _load_mutex;        // loads the texels once
+    
+    TextureHandle() : _resident(nullptr), _used(false) { }
+};
+
+// textures of a scene, kept within a memory budget by evicting textures not used recently
+// without a budget, textures are never evicted and lookups read them without locking; with
+// a budget, lookups hold the resolved texels, so evicting a texture in use by other threads
+// is safe, and only set a per-handle reference bit that the clock hand clears when evicting
+struct TextureCache {
+    size_t                      budget = 0;         // memory budget in bytes (0 for unlimited)
+    size_t                      size = 0;           // memory of the resident textures
+    std::atomic<long long>      hits;               // lookups of resident textures (counted with a budget)
+    long long                   misses = 0;         // lookups loading the texture
+    long long                   evictions = 0;      // textures evicted to fit the budget
+    map<string,TextureHandle*>  handles;            // handles by filename
+    vector<TextureHandle*>      resident;           // resident textures, in clock order
+    int                         hand = 0;           // clock hand in resident
+    std::mutex                  mutex;              // guards the members above, except hits
+    
+    TextureCache() : hits(0) { }
+};
+
+// texels resolved from a texture handle, valid while held (or, without a budget, while the cache lives)
+struct TextureRef {
+    const texture3f*                    texture = nullptr;  // texels (nullptr if no texture)
+    std::shared_ptr<const texture3f>    _hold;              // keeps evictable texels alive (empty without a budget)
+    
+    // texels
+    const texture3f* get() const { return texture; }
+};
+
+// make a texture cache with a memory budget in bytes (0 for unlimited)
+TextureCache* make_texture_cache(size_t budget);
+
+// delete a texture cache with its handles (texels held by lookups with a budget stay valid until released)
+void delete_texture_cache(TextureCache* cache);
+
+// get the handle of a texture file, creating it with its loader if not in the cache
+TextureHandle* texture_cache_handle(TextureCache* cache, const string& filename, const std::function<texture3f*()>& load);
+
+// resolve the texels of a texture handle, loading them on a miss (nullptr for a nullptr handle)
+TextureRef texture_resolve(TextureHandle* handle);
+
+#endif